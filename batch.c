@@ -0,0 +1,450 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* malloc(), realloc(), exit() */
+#include <stdio.h>        /* getline(), tmpfile(), printf() etc. */
+#include <string.h>       /* strerror(), strlen() */
+#include <errno.h>        /* errno */
+#include <inttypes.h>     /* uintmax_t */
+#include <sys/types.h>    /* pid_t */
+#include <sys/stat.h>     /* stat() */
+#include <sys/wait.h>     /* waitpid() */
+#include <unistd.h>       /* fork(), dup2(), optind */
+
+#include "export.h"
+#include "mktorrent.h"
+#include "batch.h"
+#include "init.h"
+#include "output.h"
+#include "msg.h"
+#include "ll.h"
+
+/*
+ * a line of the job file, it is run in a process of its own
+ */
+struct batch_job {
+	unsigned int line;       /* in the job file */
+	char *buf;               /* the arguments of the line point into */
+	int argc;
+	char **argv;             /* the options given with -B, then the line's */
+	const char *target;      /* the last argument of the line */
+	uintmax_t dev;           /* device the target is on */
+	int dev_known;           /* the target could be stat'ed */
+	pid_t pid;               /* running it, 0 before it starts */
+	long threads;            /* it hashes with */
+	int done;
+	FILE *out;               /* its standard output */
+};
+
+
+/*
+ * split a line into arguments as a shell would, in place. quotes
+ * group words and a backslash escapes the next character outside
+ * single quotes. returns the number of arguments, -1 if a quote
+ * isn't closed
+ */
+static int split_line(char *s, char **args)
+{
+	int n = 0;
+	char *w = s;
+
+	while (1) {
+		char quote = 0;
+
+		while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n')
+			s++;
+		if (*s == '\0' || *s == '#')
+			return n;
+
+		if (args)
+			args[n] = w;
+		n++;
+
+		for (; *s; s++) {
+			if (quote && *s == quote)
+				quote = 0;
+			else if (!quote && (*s == '\'' || *s == '"'))
+				quote = *s;
+			else if (!quote && (*s == ' ' || *s == '\t'
+					|| *s == '\r' || *s == '\n'))
+				break;
+			else {
+				if (*s == '\\' && quote != '\'' && s[1])
+					s++;
+				*w++ = *s;
+			}
+		}
+
+		if (quote)
+			return -1;
+		if (*s)
+			s++;
+		*w++ = '\0';
+	}
+}
+
+/*
+ * make the arguments of a job, the program, -j to print the result as
+ * JSON and nothing else, the other options given and the arguments of
+ * the line, which is split in place.
+ * returns their number, 0 if the line has none, -1 if a quote isn't
+ * closed and -2 if it has an option a job cannot take
+ */
+EXPORT int batch_argv(struct metafile *m, const char *argv0, char *line,
+		char ***argv)
+{
+	char *copy = strdup(line);
+	int n, i = 0;
+
+	/* count the arguments first */
+	FATAL_IF0(copy == NULL, "out of memory\n");
+	n = split_line(copy, NULL);
+	free(copy);
+	if (n <= 0)
+		return n;
+
+	LL_FOR(node, m->batch_args)
+		n++;
+
+	*argv = malloc((2 + n + 1) * sizeof(**argv));
+	FATAL_IF0(*argv == NULL, "out of memory\n");
+
+	(*argv)[i++] = (char *) argv0;
+	(*argv)[i++] = "-j";
+	LL_FOR(node, m->batch_args)
+		(*argv)[i++] = LL_DATA_AS(node, char*);
+	split_line(line, *argv + i);
+	(*argv)[2 + n] = NULL;
+
+	/* a job doesn't run jobs of its own */
+	if (job_option_refused(2 + n, *argv)) {
+		free(*argv);
+		*argv = NULL;
+		return -2;
+	}
+
+	return 2 + n;
+}
+
+/*
+ * read the jobs of the job file, every line but the empty ones and
+ * the comments holds the options and the target of a torrent
+ */
+static struct batch_job *read_jobs(struct metafile *m, const char *argv0,
+		size_t *count)
+{
+	struct batch_job *jobs = NULL;
+	char *line = NULL;
+	size_t size = 0;
+	unsigned int number = 0;
+	FILE *f;
+
+	f = fopen(m->batch_path, "r");
+	FATAL_IF(f == NULL, "cannot open '%s': %s\n",
+		m->batch_path, strerror(errno));
+
+	*count = 0;
+	while (getline(&line, &size, f) > 0) {
+		struct batch_job *j;
+		struct stat s;
+		char *buf, **argv;
+		int n;
+
+		number++;
+		buf = strdup(line);
+		FATAL_IF0(buf == NULL, "out of memory\n");
+
+		n = batch_argv(m, argv0, buf, &argv);
+		FATAL_IF(n == -1, "unclosed quote on line %u of '%s'\n",
+			number, m->batch_path);
+		FATAL_IF(n == -2, "line %u of '%s' has an option a job "
+			"cannot take\n", number, m->batch_path);
+		if (n == 0) {
+			free(buf);
+			continue;
+		}
+
+		jobs = realloc(jobs, (*count + 1) * sizeof(*jobs));
+		FATAL_IF0(jobs == NULL, "out of memory\n");
+		j = &jobs[(*count)++];
+		memset(j, 0, sizeof(*j));
+		j->line = number;
+		j->buf = buf;
+		j->argc = n;
+		j->argv = argv;
+		j->target = argv[n - 1];
+
+		/* a target that isn't there fails in its job */
+		if (stat(j->target, &s) == 0) {
+			j->dev = (uintmax_t) s.st_dev;
+			j->dev_known = 1;
+		}
+	}
+
+	FATAL_IF(ferror(f), "cannot read '%s': %s\n",
+		m->batch_path, strerror(errno));
+	fclose(f);
+	free(line);
+
+	return jobs;
+}
+
+#ifdef USE_PTHREADS
+/*
+ * the threads a job may hash with, out of those of a single run the
+ * jobs running at once share. the devices with jobs get an even share
+ * of them, but no more than are free, 0 if there are none
+ */
+EXPORT long job_threads(struct metafile *m, long busy, long devices)
+{
+	long share = m->threads / (devices > 0 ? devices : 1);
+
+	if (share < 1)
+		share = 1;
+	if (share > m->threads - busy)
+		share = m->threads - busy;
+
+	return share > 0 ? share : 0;
+}
+#endif
+
+/*
+ * run a job made by batch_argv() with the threads it may hash with,
+ * and its share of the read buffers of -M, given after the options of
+ * -B or -L so a line may still give its own.
+ * returns the exit status of the job
+ */
+EXPORT int run_job(struct metafile *m, int argc, char *argv[],
+		long threads, int (*run)(int argc, char *argv[]))
+{
+#ifdef USE_PTHREADS
+	char t[32], mem[32];
+	char **args = malloc((argc + 5) * sizeof(*args));
+	long share = m->memory * threads / m->threads;
+	int at = 2, n = 0;
+
+	FATAL_IF0(args == NULL, "out of memory\n");
+	LL_FOR(node, m->batch_args)
+		at++;
+
+	snprintf(t, sizeof(t), "%ld", threads);
+	snprintf(mem, sizeof(mem), "%ld", share > 0 ? share : 1);
+
+	for (int i = 0; i < at; i++)
+		args[n++] = argv[i];
+	args[n++] = "-t";
+	args[n++] = t;
+	if (m->memory) {
+		args[n++] = "-M";
+		args[n++] = mem;
+	}
+	for (int i = at; i <= argc; i++)
+		args[n++] = argv[i];
+
+	argc = n - 1;
+	argv = args;
+#else
+	(void) m;
+	(void) threads;
+#endif
+
+	/* parse the options of the job from the start */
+	optind = 1;
+	return run(argc, argv);
+}
+
+/*
+ * whether a job is running on the device of the given job
+ */
+static int device_busy(struct batch_job *jobs, size_t count,
+		struct batch_job *j)
+{
+	if (!j->dev_known)
+		return 0;
+
+	for (size_t i = 0; i < count; i++)
+		if (jobs[i].pid && !jobs[i].done && jobs[i].dev_known
+				&& jobs[i].dev == j->dev)
+			return 1;
+
+	return 0;
+}
+
+#ifdef USE_PTHREADS
+/*
+ * the devices of the jobs not done yet, a job whose target couldn't be
+ * stat'ed counts as one of its own
+ */
+static long busy_devices(struct batch_job *jobs, size_t count)
+{
+	long devices = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		size_t k = 0;
+
+		if (jobs[i].done)
+			continue;
+		while (k < i && !(!jobs[k].done && jobs[k].dev_known
+				&& jobs[i].dev_known && jobs[k].dev == jobs[i].dev))
+			k++;
+		if (k == i)
+			devices++;
+	}
+
+	return devices;
+}
+#endif
+
+/*
+ * run a job in a child process, which writes its result to
+ * a temporary file
+ */
+static void start_job(struct metafile *m, struct batch_job *j,
+		int (*run)(int argc, char *argv[]))
+{
+	j->out = tmpfile();
+	FATAL_IF(j->out == NULL, "cannot create a temporary file: %s\n",
+		strerror(errno));
+
+	if (!m->machine_readable)
+		printf("job %u: hashing %s\n", j->line, j->target);
+
+	/* don't leave what we've printed to be printed again */
+	fflush(stdout);
+	fflush(stderr);
+
+	j->pid = fork();
+	FATAL_IF(j->pid < 0, "cannot fork: %s\n", strerror(errno));
+
+	if (j->pid == 0) {
+		FATAL_IF(dup2(fileno(j->out), STDOUT_FILENO) < 0,
+			"cannot redirect the output: %s\n", strerror(errno));
+
+		exit(run_job(m, j->argc, j->argv, j->threads, run));
+	}
+}
+
+/*
+ * report the result of a job that is done, with -j the results
+ * of the job are printed with its line number added.
+ * returns 1 if it succeeded
+ */
+static int report_job(struct metafile *m, struct batch_job *j, int status)
+{
+	int ok = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+	char error[64];
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	if (WIFSIGNALED(status))
+		snprintf(error, sizeof(error), "killed by signal %d",
+			WTERMSIG(status));
+	else
+		snprintf(error, sizeof(error), "exit status %d",
+			WEXITSTATUS(status));
+
+	if (!m->machine_readable) {
+		if (ok)
+			printf("job %u: done %s\n", j->line, j->target);
+		else
+			printf("job %u: failed %s, %s\n", j->line, j->target, error);
+	} else if (!ok) {
+		printf("{\"job\": %u, \"target\": ", j->line);
+		print_json_string(stdout, j->target);
+		printf(", \"error\": \"%s\"}\n", error);
+	} else {
+		rewind(j->out);
+		while ((len = getline(&line, &size, j->out)) > 0) {
+			if (line[0] == '{')
+				printf("{\"job\": %u, %s", j->line, line + 1);
+			else
+				fwrite(line, 1, len, stdout);
+		}
+		free(line);
+	}
+
+	fflush(stdout);
+	fclose(j->out);
+	j->done = 1;
+
+	return ok;
+}
+
+/*
+ * create the torrents of the lines of the job file, each like a run
+ * with the options given with -B followed by those of the line.
+ * the jobs on the same device run one at a time in the order of the
+ * file, so they don't make the disk seek between them, while the
+ * jobs on other devices run at the same time, sharing the threads
+ * and the read buffers of a single run. a job starts with an even
+ * share of them for the devices with jobs left, once it is free.
+ * returns the exit status, a failure if any job failed
+ */
+EXPORT int run_batch(struct metafile *m, const char *argv0,
+		int (*run)(int argc, char *argv[]))
+{
+	size_t count;
+	size_t done = 0;
+	struct batch_job *jobs = read_jobs(m, argv0, &count);
+	int r = EXIT_SUCCESS;
+	long busy = 0;
+
+	while (done < count) {
+		int status;
+		pid_t pid;
+
+		/* start every job whose device is free, while
+		   there are threads free for it */
+		for (size_t i = 0; i < count; i++) {
+			if (jobs[i].pid || device_busy(jobs, count, &jobs[i]))
+				continue;
+
+#ifdef USE_PTHREADS
+			jobs[i].threads = job_threads(m, busy,
+				busy_devices(jobs, count));
+			if (jobs[i].threads == 0)
+				break;
+			busy += jobs[i].threads;
+#endif
+			start_job(m, &jobs[i], run);
+		}
+
+		do
+			pid = wait(&status);
+		while (pid < 0 && errno == EINTR);
+		FATAL_IF(pid < 0, "cannot wait for a job: %s\n", strerror(errno));
+
+		for (size_t i = 0; i < count; i++)
+			if (jobs[i].pid == pid && !jobs[i].done) {
+				if (!report_job(m, &jobs[i], status))
+					r = EXIT_FAILURE;
+				busy -= jobs[i].threads;
+				done++;
+			}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		free(jobs[i].argv);
+		free(jobs[i].buf);
+	}
+	free(jobs);
+
+	return r;
+}
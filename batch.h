@@ -0,0 +1,17 @@
+#ifndef MKTORRENT_BATCH_H
+#define MKTORRENT_BATCH_H
+
+#include "export.h"      /* EXPORT */
+#include "mktorrent.h"   /* struct metafile */
+
+EXPORT int batch_argv(struct metafile *m, const char *argv0, char *line,
+		char ***argv);
+#ifdef USE_PTHREADS
+EXPORT long job_threads(struct metafile *m, long busy, long devices);
+#endif
+EXPORT int run_job(struct metafile *m, int argc, char *argv[],
+		long threads, int (*run)(int argc, char *argv[]));
+EXPORT int run_batch(struct metafile *m, const char *argv0,
+		int (*run)(int argc, char *argv[]));
+
+#endif /* MKTORRENT_BATCH_H */
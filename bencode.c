@@ -0,0 +1,222 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* malloc(), free() */
+#include <stdio.h>        /* fopen(), fread() etc. */
+#include <string.h>       /* strlen(), memcmp(), strerror() */
+#include <errno.h>        /* errno */
+#include <stdint.h>       /* INTMAX_MAX */
+
+#include "export.h"
+#include "bencode.h"
+#include "msg.h"
+
+/* lists and dictionaries nested deeper than this are refused,
+   a file tree has a dictionary for every directory */
+#define BENCODE_MAX_DEPTH 512
+
+
+/*
+ * read the decimal number at *p, up to the terminator.
+ * returns 0 if it isn't one
+ */
+static int parse_number(const char **p, const char *end, char terminator,
+		intmax_t *r)
+{
+	const char *s = *p;
+	int negative = 0;
+	intmax_t n = 0;
+
+	if (s < end && *s == '-') {
+		negative = 1;
+		s++;
+	}
+
+	/* no leading zeros, and no negative zero */
+	if (s == end || *s < '0' || *s > '9'
+			|| (*s == '0' && (negative || (s + 1 < end && s[1] != terminator))))
+		return 0;
+
+	for (; s < end && *s >= '0' && *s <= '9'; s++) {
+		if (n > (INTMAX_MAX - (*s - '0')) / 10)
+			return 0;
+		n = 10 * n + (*s - '0');
+	}
+
+	if (s == end || *s != terminator)
+		return 0;
+
+	*p = s + 1;
+	*r = negative ? -n : n;
+	return 1;
+}
+
+/*
+ * read the value at *p and move past it, returns NULL if it
+ * isn't valid
+ */
+static struct bencode *parse_value(const char **p, const char *end,
+		unsigned int depth)
+{
+	struct bencode *b, **last;
+	const char *s = *p;
+	intmax_t n;
+
+	if (s == end || depth > BENCODE_MAX_DEPTH)
+		return NULL;
+
+	b = calloc(1, sizeof(*b));
+	FATAL_IF0(b == NULL, "out of memory\n");
+	b->raw = s;
+
+	switch (*s) {
+	case 'i':
+		s++;
+		if (!parse_number(&s, end, 'e', &b->i))
+			goto fail;
+		b->type = BENCODE_INTEGER;
+		break;
+	case 'l':
+	case 'd':
+		b->type = *s == 'l' ? BENCODE_LIST : BENCODE_DICT;
+		last = &b->child;
+		s++;
+		for (unsigned int k = 0; s < end && *s != 'e'; k++) {
+			*last = parse_value(&s, end, depth + 1);
+			if (*last == NULL)
+				goto fail;
+			/* the keys of a dictionary are strings */
+			if (b->type == BENCODE_DICT && k % 2 == 0
+					&& (*last)->type != BENCODE_STRING)
+				goto fail;
+			last = &(*last)->next;
+			b->len++;
+		}
+		/* every key has a value */
+		if (s == end || (b->type == BENCODE_DICT && b->len % 2))
+			goto fail;
+		s++;
+		break;
+	default:
+		if (!parse_number(&s, end, ':', &n) || n < 0
+				|| (uintmax_t) n > (uintmax_t) (end - s))
+			goto fail;
+		b->type = BENCODE_STRING;
+		b->s = s;
+		b->len = n;
+		s += n;
+	}
+
+	b->raw_len = s - b->raw;
+	*p = s;
+	return b;
+
+fail:
+	bencode_free(b);
+	return NULL;
+}
+
+/*
+ * parse the bencoded value in buf, returns NULL if it isn't valid
+ */
+EXPORT struct bencode *bencode_parse(const char *buf, size_t len)
+{
+	return parse_value(&buf, buf + len, 0);
+}
+
+EXPORT void bencode_free(struct bencode *b)
+{
+	while (b) {
+		struct bencode *next = b->next;
+
+		bencode_free(b->child);
+		free(b);
+		b = next;
+	}
+}
+
+/*
+ * the value of a key of a dictionary, or NULL if there is none
+ */
+EXPORT struct bencode *bencode_find(struct bencode *dict, const char *key,
+		size_t len)
+{
+	if (dict == NULL || dict->type != BENCODE_DICT)
+		return NULL;
+
+	for (struct bencode *k = dict->child; k; k = k->next->next)
+		if (k->len == len && memcmp(k->s, key, len) == 0)
+			return k->next;
+
+	return NULL;
+}
+
+/*
+ * the value of a key of a dictionary, or NULL if there is none
+ * or it is of another type
+ */
+EXPORT struct bencode *bencode_get(struct bencode *dict, const char *key,
+		enum bencode_type type)
+{
+	struct bencode *v = bencode_find(dict, key, strlen(key));
+
+	return v && v->type == type ? v : NULL;
+}
+
+/*
+ * compare a dictionary key with a string, in the order of the keys
+ */
+EXPORT int bencode_key_cmp(const struct bencode *k, const char *key)
+{
+	size_t len = strlen(key);
+	int r = memcmp(k->s, key, len < k->len ? len : k->len);
+
+	if (r == 0 && len != k->len)
+		r = k->len < len ? -1 : 1;
+
+	return r;
+}
+
+/*
+ * read a whole metainfo file into memory
+ */
+EXPORT char *bencode_read_file(const char *path, size_t *len)
+{
+	size_t size = 0;
+	char *buf = NULL;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	FATAL_IF(f == NULL, "cannot open '%s': %s\n", path, strerror(errno));
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? 2 * size : 65536;
+			buf = realloc(buf, size);
+			FATAL_IF0(buf == NULL, "out of memory\n");
+		}
+		*len += fread(buf + *len, 1, size - *len, f);
+	} while (*len == size);
+
+	FATAL_IF(ferror(f), "cannot read '%s': %s\n", path, strerror(errno));
+	fclose(f);
+
+	return buf;
+}
@@ -0,0 +1,36 @@
+#ifndef MKTORRENT_BENCODE_H
+#define MKTORRENT_BENCODE_H
+
+#include <stddef.h>      /* size_t */
+#include <stdint.h>      /* intmax_t */
+
+#include "export.h"      /* EXPORT */
+
+enum bencode_type { BENCODE_INTEGER, BENCODE_STRING, BENCODE_LIST, BENCODE_DICT };
+
+/*
+ * a value read from a bencoded buffer, its strings point into the
+ * buffer. the items of a list or dictionary are linked by next, and
+ * in a dictionary every key is followed by its value
+ */
+struct bencode {
+	enum bencode_type type;
+	const char *raw;         /* the encoding of the value in the buffer */
+	size_t raw_len;
+	intmax_t i;              /* value of an integer */
+	const char *s;           /* a string, not terminated */
+	size_t len;              /* its length */
+	struct bencode *child;   /* first item of a list or dictionary */
+	struct bencode *next;    /* next item of the list or dictionary */
+};
+
+EXPORT struct bencode *bencode_parse(const char *buf, size_t len);
+EXPORT void bencode_free(struct bencode *b);
+EXPORT struct bencode *bencode_find(struct bencode *dict, const char *key,
+		size_t len);
+EXPORT struct bencode *bencode_get(struct bencode *dict, const char *key,
+		enum bencode_type type);
+EXPORT int bencode_key_cmp(const struct bencode *k, const char *key);
+EXPORT char *bencode_read_file(const char *path, size_t *len);
+
+#endif /* MKTORRENT_BENCODE_H */
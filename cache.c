@@ -0,0 +1,387 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* malloc(), qsort(), bsearch() */
+#include <stdio.h>        /* fopen(), fread(), fwrite() etc. */
+#include <string.h>       /* memcpy(), strerror() */
+#include <errno.h>        /* errno */
+#include <unistd.h>       /* fsync(), unlink() */
+#include <inttypes.h>     /* PRIuMAX etc. */
+
+#include "export.h"
+#include "mktorrent.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "dedup.h"
+#include "msg.h"
+#include "ll.h"
+
+#define CACHE_MAGIC "mktorrent cache 1\n"
+
+/* the fields of an entry as they are written, before its hashes */
+#define CACHE_FIELDS 7
+
+
+static size_t digest_length(uint32_t kind)
+{
+	return kind == CACHE_V2 ? 32 : 20;
+}
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+	const struct cache_entry *x = a, *y = b;
+
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	if (x->piece_length != y->piece_length)
+		return x->piece_length < y->piece_length ? -1 : 1;
+	if (x->kind != y->kind)
+		return x->kind < y->kind ? -1 : 1;
+	return 0;
+}
+
+/*
+ * the entry of a file for a piece length and kind, if it is
+ * still the same file
+ */
+static struct cache_entry *find_entry(struct cache *c, struct file_data *f,
+		unsigned int piece_length, unsigned int kind)
+{
+	struct cache_entry key;
+	struct cache_entry *e;
+
+	key.dev = f->dev;
+	key.ino = f->ino;
+	key.piece_length = piece_length;
+	key.kind = kind;
+
+	e = bsearch(&key, c->entries, c->count, sizeof(*e), cache_entry_cmp);
+	if (e == NULL || e->size != f->size || e->mtime != f->mtime)
+		return NULL;
+
+	return e;
+}
+
+/*
+ * the piece length and kind of the pieces of a set, the last
+ * v1 piece of a file is padded unless it is the last file
+ */
+static unsigned int set_length(struct metafile *m, unsigned int set)
+{
+	return set == CHECKPOINT_V2 ? m->piece_length : m->piece_lengths[set];
+}
+
+static unsigned int set_kind(struct metafile *m, unsigned int set, int last)
+{
+	if (set == CHECKPOINT_V2)
+		return CACHE_V2;
+	return m->pad_files && !last ? CACHE_V1_PAD : CACHE_V1;
+}
+
+/*
+ * read the entries of the cache file, a damaged end is dropped
+ */
+static void load_cache(struct cache *c, const char *path)
+{
+	char magic[sizeof(CACHE_MAGIC) - 1];
+	size_t size = 0;
+	uint64_t h[CACHE_FIELDS];
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		if (errno != ENOENT)
+			fprintf(stderr, "warning: cannot open '%s': %s\n",
+				path, strerror(errno));
+		return;
+	}
+
+	if (fread(magic, sizeof(magic), 1, f) != 1
+			|| memcmp(magic, CACHE_MAGIC, sizeof(magic))) {
+		fprintf(stderr, "warning: '%s' is not a hash cache, "
+			"ignoring it\n", path);
+		fclose(f);
+		return;
+	}
+
+	while (fread(h, sizeof(h), 1, f) == 1) {
+		struct cache_entry *e;
+
+		if (h[5] > CACHE_V2 || h[6] == 0 || h[6] > h[2]) {
+			fprintf(stderr, "warning: '%s' is damaged\n", path);
+			break;
+		}
+
+		if (c->count == size) {
+			size = size ? 2 * size : 64;
+			e = realloc(c->entries, size * sizeof(*e));
+			FATAL_IF0(e == NULL, "out of memory\n");
+			c->entries = e;
+		}
+
+		e = &c->entries[c->count];
+		e->dev = h[0];
+		e->ino = h[1];
+		e->size = h[2];
+		e->mtime = (int64_t) h[3];
+		e->piece_length = h[4];
+		e->kind = h[5];
+		e->count = h[6];
+		e->hashes = malloc(e->count * digest_length(e->kind));
+		FATAL_IF0(e->hashes == NULL, "out of memory\n");
+
+		if (fread(e->hashes, e->count * digest_length(e->kind),
+					1, f) != 1) {
+			fprintf(stderr, "warning: '%s' is damaged\n", path);
+			free(e->hashes);
+			break;
+		}
+		c->count++;
+	}
+
+	fclose(f);
+
+	qsort(c->entries, c->count, sizeof(*c->entries), cache_entry_cmp);
+}
+
+/*
+ * read the cache file given, if any
+ */
+EXPORT void cache_open(struct cache *c, struct metafile *m)
+{
+	c->m = m;
+	c->entries = NULL;
+	c->count = 0;
+
+	if (m->cache_path)
+		load_cache(c, m->cache_path);
+}
+
+/*
+ * take the hashes of the units of unchanged files from the cache.
+ * a file starting a new piece of the largest piece length has the
+ * same pieces in every torrent, up to its last piece, which is the
+ * same when it ends the content or is padded the same.
+ * returns the number of units taken
+ */
+EXPORT uintmax_t cache_fill(struct cache *c, struct checkpoint *cp)
+{
+	struct metafile *m = c->m;
+	uintmax_t offset = 0;           /* of the file in the stream */
+	uintmax_t r = 0;
+
+	if (c->count == 0)
+		return 0;
+
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+		struct cache_entry *e[CHECKPOINT_V2 + 1];
+		uintmax_t first[CHECKPOINT_V2 + 1]; /* piece the file starts */
+		uintmax_t start = offset;
+		uintmax_t unit;
+		uintmax_t end;
+		int last = LL_NEXT(file_node) == NULL;
+
+		offset += f->size;
+
+		/* a duplicate is never read */
+		if (f->size == 0 || f->ino == 0 || is_duplicate(m, file_node))
+			continue;
+
+		if (m->pad_files) {
+			unit = f->piece;
+			end = unit + (f->size + cp->unit_len - 1) / cp->unit_len;
+		} else {
+			/* the last unit of the file goes on in the next */
+			if (start % cp->unit_len)
+				continue;
+			unit = start / cp->unit_len;
+			end = unit + (offset == m->size ?
+				(f->size + cp->unit_len - 1) / cp->unit_len :
+				f->size / cp->unit_len);
+		}
+
+		for (unsigned int set = 0; set <= CHECKPOINT_V2; set++) {
+			if (cp->digest[set] == 0)
+				continue;
+			e[set] = find_entry(c, f, set_length(m, set),
+				set_kind(m, set, last));
+			first[set] = m->pad_files ? f->piece :
+				start / set_length(m, set);
+		}
+
+		for (; unit < end; unit++) {
+			int found = 1;
+
+			if (checkpoint_done(cp, unit))
+				continue;
+
+			for (unsigned int set = 0; set <= CHECKPOINT_V2; set++) {
+				unsigned int n = checkpoint_pieces(cp, unit, set);
+
+				if (n && (e[set] == NULL || unit * cp->per[set]
+						- first[set] + n > e[set]->count))
+					found = 0;
+			}
+			if (!found)
+				continue;
+
+			for (unsigned int set = 0; set <= CHECKPOINT_V2; set++) {
+				unsigned int n = checkpoint_pieces(cp, unit, set);
+
+				if (n == 0)
+					continue;
+				memcpy(checkpoint_hash(cp, unit, set),
+					e[set]->hashes + (unit * cp->per[set]
+						- first[set]) * cp->digest[set],
+					n * cp->digest[set]);
+			}
+
+			checkpoint_unit(cp, unit);
+			r++;
+		}
+	}
+
+	if (r && !m->machine_readable)
+		printf("took %" PRIuMAX " of %" PRIuMAX " pieces "
+			"from the cache\n", r, cp->units);
+
+	return r;
+}
+
+static int write_cache_entry(FILE *f, struct cache_entry *e)
+{
+	uint64_t h[CACHE_FIELDS] = {
+		e->dev, e->ino, e->size, (uint64_t) e->mtime,
+		e->piece_length, e->kind, e->count
+	};
+
+	return fwrite(h, sizeof(h), 1, f) == 1
+		&& fwrite(e->hashes, e->count * digest_length(e->kind),
+			1, f) == 1;
+}
+
+/*
+ * write the entries of the files hashed to a new cache file,
+ * followed by the entries of other files, and put it in place
+ * of the old one
+ */
+static void store_cache(struct cache *c, struct checkpoint *cp)
+{
+	struct metafile *m = c->m;
+	struct cache_entry *entries;
+	size_t count = 0;
+	uintmax_t offset = 0;
+	char *tmp;
+	FILE *f;
+	int ok;
+
+	count = 0;
+	LL_FOR(file_node, m->file_list)
+		count++;
+
+	entries = malloc((count + 1) * (CHECKPOINT_V2 + 1) * sizeof(*entries));
+	tmp = malloc(strlen(m->cache_path) + 5);
+	FATAL_IF0(entries == NULL || tmp == NULL, "out of memory\n");
+
+	count = 0;
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+		uintmax_t start = offset;
+		int last = LL_NEXT(file_node) == NULL;
+
+		offset += f->size;
+
+		if (f->size == 0 || f->ino == 0 ||
+				(!m->pad_files && start % cp->unit_len))
+			continue;
+
+		for (unsigned int set = 0; set <= CHECKPOINT_V2; set++) {
+			struct cache_entry *e = &entries[count];
+			unsigned int len = set_length(m, set);
+
+			if (cp->digest[set] == 0)
+				continue;
+
+			e->dev = f->dev;
+			e->ino = f->ino;
+			e->size = f->size;
+			e->mtime = f->mtime;
+			e->piece_length = len;
+			e->kind = set_kind(m, set, last);
+
+			/* the last piece goes on in the next file */
+			e->count = m->pad_files || offset == m->size ?
+				(f->size + len - 1) / len : f->size / len;
+			e->hashes = cp->hash + cp->base[set] + cp->digest[set]
+				* (m->pad_files ? f->piece : start / len);
+
+			if (e->count)
+				count++;
+		}
+	}
+
+	qsort(entries, count, sizeof(*entries), cache_entry_cmp);
+
+	sprintf(tmp, "%s.tmp", m->cache_path);
+	f = fopen(tmp, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "warning: cannot create '%s': %s\n",
+			tmp, strerror(errno));
+		free(entries);
+		free(tmp);
+		return;
+	}
+
+	ok = fwrite(CACHE_MAGIC, strlen(CACHE_MAGIC), 1, f) == 1;
+	for (size_t i = 0; ok && i < count; i++)
+		ok = write_cache_entry(f, &entries[i]);
+	for (size_t i = 0; ok && i < c->count; i++)
+		if (bsearch(&c->entries[i], entries, count, sizeof(*entries),
+					cache_entry_cmp) == NULL)
+			ok = write_cache_entry(f, &c->entries[i]);
+
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	if (fclose(f))
+		ok = 0;
+	if (!ok || rename(tmp, m->cache_path)) {
+		fprintf(stderr, "warning: cannot write '%s': %s\n",
+			m->cache_path, strerror(errno));
+		unlink(tmp);
+	}
+
+	free(entries);
+	free(tmp);
+}
+
+/*
+ * keep the hashes of the files in the cache, once every piece
+ * is hashed, and those of duplicates copied
+ */
+EXPORT void cache_close(struct cache *c, struct checkpoint *cp)
+{
+	if (c->m->cache_path)
+		store_cache(c, cp);
+
+	for (size_t i = 0; i < c->count; i++)
+		free(c->entries[i].hashes);
+	free(c->entries);
+}
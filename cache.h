@@ -0,0 +1,40 @@
+#ifndef MKTORRENT_CACHE_H
+#define MKTORRENT_CACHE_H
+
+#include <stddef.h>      /* size_t */
+#include <stdint.h>      /* uint64_t etc. */
+
+#include "export.h"      /* EXPORT */
+#include "mktorrent.h"   /* struct metafile */
+#include "checkpoint.h"  /* struct checkpoint */
+
+/* kinds of piece hashes kept, the last v1 piece of a file differs
+   when it is followed by a pad file */
+enum cache_kind { CACHE_V1, CACHE_V1_PAD, CACHE_V2 };
+
+/*
+ * the hashes of the pieces of a file, from its start, for one piece
+ * length. the piece at offset o is number o / piece_length
+ */
+struct cache_entry {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	uint32_t piece_length;
+	uint32_t kind;
+	uint64_t count;               /* number of pieces */
+	unsigned char *hashes;
+};
+
+struct cache {
+	struct metafile *m;
+	struct cache_entry *entries;  /* sorted by file, length and kind */
+	size_t count;
+};
+
+EXPORT void cache_open(struct cache *c, struct metafile *m);
+EXPORT uintmax_t cache_fill(struct cache *c, struct checkpoint *cp);
+EXPORT void cache_close(struct cache *c, struct checkpoint *cp);
+
+#endif /* MKTORRENT_CACHE_H */
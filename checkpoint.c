@@ -0,0 +1,492 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* malloc(), exit(), atexit() */
+#include <stdio.h>        /* fopen(), fwrite(), rename() etc. */
+#include <string.h>       /* strlen(), strerror(), memcmp() */
+#include <errno.h>        /* errno */
+#include <signal.h>       /* sigaction() */
+#include <unistd.h>       /* fsync(), unlink() */
+#include <time.h>         /* time() */
+#include <inttypes.h>     /* PRIuMAX etc. */
+#include <stdatomic.h>    /* atomic_load() etc. */
+
+#ifdef USE_OPENSSL
+#include <openssl/sha.h>  /* SHA1_Init() etc. */
+#else
+#include "sha1.h"
+#endif
+
+#include "export.h"
+#include "mktorrent.h"
+#include "checkpoint.h"
+#include "verify.h"
+#include "msg.h"
+#include "ll.h"
+
+/* seconds between writing the checkpoint file */
+#ifndef CHECKPOINT_PERIOD
+#define CHECKPOINT_PERIOD 60
+#endif
+
+#define CHECKPOINT_MAGIC "mktorrent checkpoint 1\n"
+
+/* set when we're asked to stop, read by every reader */
+static atomic_int interrupted;
+
+/* the checkpoint written when we exit before the hashing is done */
+static struct checkpoint *current;
+
+/* written in place of the hashes of the units not done */
+static const unsigned char no_hash[32];
+
+
+/*
+ * the number of pieces of a set in a unit, the last unit may have
+ * fewer pieces of the smaller piece lengths than the others
+ */
+EXPORT unsigned int checkpoint_pieces(struct checkpoint *cp, uintmax_t unit,
+		unsigned int set)
+{
+	uintmax_t first = unit * cp->per[set];
+
+	if (cp->digest[set] == 0 || first >= cp->count[set])
+		return 0;
+
+	return cp->count[set] - first < cp->per[set] ?
+		cp->count[set] - first : cp->per[set];
+}
+
+/*
+ * where the hashes of the pieces of a set in a unit go
+ */
+EXPORT unsigned char *checkpoint_hash(struct checkpoint *cp, uintmax_t unit,
+		unsigned int set)
+{
+	return cp->hash + cp->base[set] + unit * cp->per[set] * cp->digest[set];
+}
+
+/*
+ * the number of pieces of every set in a unit
+ */
+EXPORT unsigned int checkpoint_unit_pieces(struct checkpoint *cp,
+		uintmax_t unit)
+{
+	unsigned int r = 0;
+
+	for (unsigned int set = 0; set <= CHECKPOINT_V2; set++)
+		r += checkpoint_pieces(cp, unit, set);
+
+	return r;
+}
+
+#ifdef USE_PTHREADS
+/*
+ * the number of pieces of every set in the units not read, before
+ * hashing those resumed, cached, not sampled or copied
+ */
+EXPORT unsigned int checkpoint_pieces_done(struct checkpoint *cp)
+{
+	unsigned int r = 0;
+
+	for (uintmax_t unit = 0; unit < cp->units; unit++)
+		if (checkpoint_skipped(cp, unit))
+			r += checkpoint_unit_pieces(cp, unit);
+
+	return r;
+}
+#endif
+
+/*
+ * the options the hashes depend on, and the path, size and
+ * modification time of every file
+ */
+static void fingerprint(struct checkpoint *cp)
+{
+	struct metafile *m = cp->m;
+	SHA_CTX c;
+	char buf[128];
+
+	SHA1_Init(&c);
+
+	snprintf(buf, sizeof(buf), "%d %d %" PRIuMAX, m->meta_version,
+		m->pad_files, m->size);
+	SHA1_Update(&c, (unsigned char *) buf, strlen(buf) + 1);
+	for (unsigned int i = 0; i < m->piece_length_count; i++) {
+		snprintf(buf, sizeof(buf), "%u", m->piece_lengths[i]);
+		SHA1_Update(&c, (unsigned char *) buf, strlen(buf) + 1);
+	}
+
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+
+		SHA1_Update(&c, (unsigned char *) f->path, strlen(f->path) + 1);
+		snprintf(buf, sizeof(buf), "%" PRIuMAX " %" PRId64,
+			f->size, f->mtime);
+		SHA1_Update(&c, (unsigned char *) buf, strlen(buf) + 1);
+	}
+
+	SHA1_Final(cp->fingerprint, &c);
+}
+
+/*
+ * write the units done to a new file, and put it in place of the
+ * old one when it is all written, so there always is a whole one.
+ * returns the number of units done, none are written if there are
+ * none. only warns when something fails, as it is called on exit
+ */
+static uintmax_t write_checkpoint(struct checkpoint *cp)
+{
+	unsigned char *bitmap;
+	uintmax_t done = 0;
+	char *tmp;
+	FILE *f;
+	int ok;
+
+	if (cp->path == NULL)
+		return 0;
+
+	bitmap = calloc(cp->units / 8 + 1, 1);
+	tmp = malloc(strlen(cp->path) + 5);
+	if (bitmap == NULL || tmp == NULL) {
+		fprintf(stderr, "warning: cannot write checkpoint: "
+			"out of memory\n");
+		free(bitmap);
+		free(tmp);
+		return 0;
+	}
+
+	/* a unit done after this is left for the next time */
+	for (uintmax_t u = 0; u < cp->units; u++)
+		if (checkpoint_done(cp, u)) {
+			bitmap[u / 8] |= 1 << u % 8;
+			done++;
+		}
+
+	if (done == 0) {
+		free(bitmap);
+		free(tmp);
+		return 0;
+	}
+
+	sprintf(tmp, "%s.tmp", cp->path);
+	f = fopen(tmp, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "warning: cannot create '%s': %s\n",
+			tmp, strerror(errno));
+		free(bitmap);
+		free(tmp);
+		return 0;
+	}
+
+	ok = fwrite(CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC), 1, f) == 1
+		&& fwrite(cp->fingerprint, sizeof(cp->fingerprint), 1, f) == 1
+		&& fwrite(bitmap, cp->units / 8 + 1, 1, f) == 1;
+
+	for (unsigned int set = 0; ok && set <= CHECKPOINT_V2; set++)
+		for (uintmax_t u = 0; ok && u < cp->units; u++) {
+			unsigned int n = checkpoint_pieces(cp, u, set);
+			unsigned char *hash = checkpoint_hash(cp, u, set);
+
+			for (unsigned int i = 0; ok && i < n; i++)
+				ok = fwrite(bitmap[u / 8] & 1 << u % 8 ?
+					hash + i * cp->digest[set] : no_hash,
+					cp->digest[set], 1, f) == 1;
+		}
+
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	if (fclose(f))
+		ok = 0;
+	if (!ok || rename(tmp, cp->path)) {
+		fprintf(stderr, "warning: cannot write '%s': %s\n",
+			cp->path, strerror(errno));
+		unlink(tmp);
+		done = 0;
+	}
+
+	free(bitmap);
+	free(tmp);
+
+	return done;
+}
+
+/*
+ * take the hashes of the units done from the checkpoint file
+ * of the run we resume, if it was made for the same content
+ */
+static void read_checkpoint(struct checkpoint *cp)
+{
+	struct metafile *m = cp->m;
+	char magic[sizeof(CHECKPOINT_MAGIC) - 1];
+	unsigned char fp[sizeof(cp->fingerprint)];
+	unsigned char *bitmap;
+	uintmax_t done = 0;
+	FILE *f;
+	int ok;
+
+	f = fopen(cp->path, "rb");
+	if (f == NULL) {
+		if (errno != ENOENT)
+			fprintf(stderr, "warning: cannot open '%s': %s\n",
+				cp->path, strerror(errno));
+		return;
+	}
+
+	bitmap = malloc(cp->units / 8 + 1);
+	FATAL_IF0(bitmap == NULL, "out of memory\n");
+
+	ok = fread(magic, sizeof(magic), 1, f) == 1
+		&& memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) == 0
+		&& fread(fp, sizeof(fp), 1, f) == 1;
+	if (ok && memcmp(fp, cp->fingerprint, sizeof(fp))) {
+		fprintf(stderr, "warning: the content or the options have "
+			"changed since '%s' was written, hashing it all\n",
+			cp->path);
+		fclose(f);
+		free(bitmap);
+		return;
+	}
+
+	ok = ok && fread(bitmap, cp->units / 8 + 1, 1, f) == 1;
+
+	for (unsigned int set = 0; ok && set <= CHECKPOINT_V2; set++)
+		for (uintmax_t u = 0; ok && u < cp->units; u++) {
+			unsigned int n = checkpoint_pieces(cp, u, set);
+			unsigned char *hash = checkpoint_hash(cp, u, set);
+
+			if (bitmap[u / 8] & 1 << u % 8)
+				ok = n == 0 || fread(hash, n * cp->digest[set],
+					1, f) == 1;
+			else
+				ok = n == 0 || fseek(f, n * cp->digest[set],
+					SEEK_CUR) == 0;
+		}
+
+	fclose(f);
+
+	if (!ok) {
+		fprintf(stderr, "warning: '%s' is damaged, hashing it all\n",
+			cp->path);
+		free(bitmap);
+		return;
+	}
+
+	for (uintmax_t u = 0; u < cp->units; u++)
+		if (bitmap[u / 8] & 1 << u % 8) {
+			atomic_store(&cp->left[u], 0);
+			done++;
+		}
+
+	free(bitmap);
+
+	if (!m->machine_readable)
+		printf("resuming with %" PRIuMAX " of %" PRIuMAX
+			" pieces hashed\n", done, cp->units);
+}
+
+static void on_signal(int sig)
+{
+	(void) sig;
+	atomic_store(&interrupted, 1);
+}
+
+/*
+ * save what we have when exiting on an error
+ */
+static void write_on_exit(void)
+{
+	if (current && !atomic_exchange(&current->writing, 1))
+		write_checkpoint(current);
+}
+
+/*
+ * find the units of the hash string, and take those done from the
+ * checkpoint file if we resume. the checkpoint file is written next
+ * to the metainfo file now and then, when we're interrupted and when
+ * we exit on an error
+ */
+EXPORT void checkpoint_open(struct checkpoint *cp, struct metafile *m,
+		unsigned char *hash)
+{
+	static int registered;
+	struct sigaction sa;
+	size_t base = 0;
+
+	memset(cp, 0, sizeof(*cp));
+	cp->m = m;
+	cp->hash = hash;
+
+	for (unsigned int i = 0; i < m->piece_length_count; i++)
+		if (m->piece_lengths[i] > cp->unit_len)
+			cp->unit_len = m->piece_lengths[i];
+
+	/* the hash strings of the piece lengths follow each other,
+	   and the v2 piece hashes follow them */
+	for (unsigned int set = 0; set <= CHECKPOINT_V2; set++) {
+		if (set == CHECKPOINT_V2) {
+			if (!(m->meta_version & META_V2))
+				continue;
+			cp->digest[set] = 32;
+			cp->count[set] = m->v2_pieces;
+			cp->per[set] = 1;
+		} else {
+			if (!(m->meta_version & META_V1)
+					|| set >= m->piece_length_count)
+				continue;
+			cp->digest[set] = 20;
+			cp->count[set] = m->pad_files ? m->pieces :
+				(m->size + m->piece_lengths[set] - 1)
+				/ m->piece_lengths[set];
+			cp->per[set] = cp->unit_len / m->piece_lengths[set];
+		}
+		cp->base[set] = base;
+		base += cp->count[set] * cp->digest[set];
+	}
+
+	cp->units = m->pad_files ? m->pieces :
+		(m->size + cp->unit_len - 1) / cp->unit_len;
+	cp->left = malloc((cp->units + 1) * sizeof(*cp->left));
+	FATAL_IF0(cp->left == NULL, "out of memory\n");
+	for (uintmax_t u = 0; u < cp->units; u++)
+		atomic_init(&cp->left[u], checkpoint_unit_pieces(cp, u));
+
+	/* there is nothing to resume when we verify */
+	if (m->verify_path == NULL) {
+		cp->path = malloc(strlen(m->metainfo_file_path) + 12);
+		FATAL_IF0(cp->path == NULL, "out of memory\n");
+		sprintf(cp->path, "%s.checkpoint", m->metainfo_file_path);
+
+		fingerprint(cp);
+		if (m->resume)
+			read_checkpoint(cp);
+	}
+
+	atomic_init(&cp->next, (long long) time(NULL) + CHECKPOINT_PERIOD);
+	atomic_init(&cp->writing, 0);
+
+	/* a second signal stops us at once */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sa.sa_flags = SA_RESETHAND | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	current = cp;
+	if (!registered) {
+		atexit(write_on_exit);
+		registered = 1;
+	}
+}
+
+/*
+ * the hashing is done, so the checkpoint file is no longer needed
+ */
+EXPORT void checkpoint_close(struct checkpoint *cp)
+{
+	struct sigaction sa;
+
+	current = NULL;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (cp->path && unlink(cp->path) && errno != ENOENT)
+		fprintf(stderr, "warning: cannot remove '%s': %s\n",
+			cp->path, strerror(errno));
+
+	free(cp->left);
+	free(cp->copied);
+	free(cp->path);
+}
+
+#ifdef USE_PTHREADS
+/*
+ * a piece of the unit is hashed
+ */
+EXPORT void checkpoint_piece(struct checkpoint *cp, uintmax_t unit)
+{
+	/* the last piece sees the hashes of the others */
+	if (atomic_fetch_sub_explicit(&cp->left[unit], 1,
+				memory_order_acq_rel) == 1 && cp->verify)
+		verify_unit(cp->verify, cp, unit);
+}
+#endif
+
+/*
+ * all the pieces of the unit are hashed, or taken from elsewhere
+ */
+EXPORT void checkpoint_unit(struct checkpoint *cp, uintmax_t unit)
+{
+	atomic_store_explicit(&cp->left[unit], 0, memory_order_release);
+	if (cp->verify)
+		verify_unit(cp->verify, cp, unit);
+}
+
+/*
+ * write the checkpoint file if it is time to, only one of the
+ * readers does so at a time
+ */
+EXPORT void checkpoint_update(struct checkpoint *cp)
+{
+	long long now = time(NULL);
+	long long next = atomic_load(&cp->next);
+
+	if (now < next || !atomic_compare_exchange_strong(&cp->next,
+				&next, now + CHECKPOINT_PERIOD))
+		return;
+
+	if (atomic_exchange(&cp->writing, 1))
+		return;
+
+	write_checkpoint(cp);
+	atomic_store(&cp->writing, 0);
+}
+
+/*
+ * whether we've been asked to stop, the readers then stop reading
+ */
+EXPORT int checkpoint_interrupted(void)
+{
+	return atomic_load_explicit(&interrupted, memory_order_relaxed);
+}
+
+/*
+ * write the units done when we've been interrupted and exit,
+ * called when the pieces being hashed are done
+ */
+EXPORT void checkpoint_stop(struct checkpoint *cp)
+{
+	uintmax_t done;
+
+	current = NULL;
+	done = write_checkpoint(cp);
+
+	if (done)
+		fprintf(stderr, "interrupted, %" PRIuMAX " of %" PRIuMAX
+			" pieces are saved in '%s', hash again with -k to go on\n",
+			done, cp->units, cp->path);
+	else
+		fprintf(stderr, "interrupted\n");
+
+	exit(EXIT_FAILURE);
+}
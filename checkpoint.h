@@ -0,0 +1,76 @@
+#ifndef MKTORRENT_CHECKPOINT_H
+#define MKTORRENT_CHECKPOINT_H
+
+#include <stddef.h>      /* size_t */
+#include <stdint.h>      /* uintmax_t */
+#include <stdatomic.h>   /* atomic_uint etc. */
+
+#include "export.h"      /* EXPORT */
+#include "mktorrent.h"   /* struct metafile */
+
+struct verify;
+
+/* the set of the v2 pieces, after those of the piece lengths */
+#define CHECKPOINT_V2 MAX_PIECE_LENGTHS
+
+/*
+ * the hashes done so far, kept by the piece of the largest piece
+ * length, a unit, which holds whole pieces of every other length.
+ * when every file starts a new piece there is a single piece length,
+ * and a unit is the v1 and v2 piece of the same part of a file
+ */
+struct checkpoint {
+	struct metafile *m;
+	char *path;                   /* of the checkpoint file, NULL when
+	                                 there is none */
+	unsigned char *hash;          /* the hash strings and v2 piece hashes */
+	uintmax_t units;              /* number of units */
+	unsigned int unit_len;        /* the largest piece length */
+	atomic_uint *left;            /* pieces of every unit not yet hashed */
+	unsigned char *copied;        /* the units not read, as their hashes are
+	                                 those of the first copy of a
+	                                 duplicate, or NULL if none is */
+	/* the pieces of every set, in the order of the hash string */
+	size_t base[MAX_PIECE_LENGTHS + 1];  /* offset in the hash string */
+	uintmax_t count[MAX_PIECE_LENGTHS + 1]; /* number of pieces */
+	unsigned int per[MAX_PIECE_LENGTHS + 1]; /* pieces in a unit */
+	unsigned int digest[MAX_PIECE_LENGTHS + 1]; /* length of a hash,
+	                                 0 when the set isn't hashed */
+	unsigned char fingerprint[20];  /* of the options and the files */
+	atomic_llong next;            /* when the checkpoint is written next */
+	atomic_int writing;
+	struct verify *verify;        /* checks every unit when it is done,
+	                                 or NULL */
+};
+
+EXPORT void checkpoint_open(struct checkpoint *cp, struct metafile *m,
+		unsigned char *hash);
+EXPORT void checkpoint_close(struct checkpoint *cp);
+EXPORT unsigned int checkpoint_pieces(struct checkpoint *cp, uintmax_t unit,
+		unsigned int set);
+EXPORT unsigned char *checkpoint_hash(struct checkpoint *cp, uintmax_t unit,
+		unsigned int set);
+EXPORT unsigned int checkpoint_unit_pieces(struct checkpoint *cp,
+		uintmax_t unit);
+#ifdef USE_PTHREADS
+EXPORT unsigned int checkpoint_pieces_done(struct checkpoint *cp);
+EXPORT void checkpoint_piece(struct checkpoint *cp, uintmax_t unit);
+#endif
+EXPORT void checkpoint_unit(struct checkpoint *cp, uintmax_t unit);
+EXPORT void checkpoint_update(struct checkpoint *cp);
+EXPORT int checkpoint_interrupted(void);
+EXPORT void checkpoint_stop(struct checkpoint *cp);
+
+/* the unit is hashed, or was in the run we resume */
+#define checkpoint_done(cp, unit) \
+	(atomic_load_explicit(&(cp)->left[unit], memory_order_acquire) == 0)
+
+/* the hashes of the unit are copied once the others are done */
+#define checkpoint_copied(cp, unit) \
+	((cp)->copied && ((cp)->copied[(unit) / 8] & 1 << (unit) % 8))
+
+/* the unit isn't read */
+#define checkpoint_skipped(cp, unit) \
+	(checkpoint_done(cp, unit) || checkpoint_copied(cp, unit))
+
+#endif /* MKTORRENT_CHECKPOINT_H */
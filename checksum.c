@@ -0,0 +1,237 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* malloc(), free() */
+#include <stddef.h>       /* offsetof() */
+#include <stdio.h>        /* fopen(), fprintf() etc. */
+#include <string.h>       /* strlen(), strrchr(), memcpy() */
+#include <errno.h>        /* errno */
+
+#include "export.h"
+#include "mktorrent.h"
+#include "checksum.h"
+#include "msg.h"
+#include "ll.h"
+
+
+/*
+ * the manifest written next to the metainfo file for every checksum,
+ * in the format of md5sum, sha1sum and sha256sum
+ */
+static const struct {
+	int which;
+	const char *suffix;
+	size_t offset;
+	size_t len;
+} manifests[] = {
+	{ CHECKSUM_MD5, ".md5", offsetof(struct file_sums, md5),
+		MD5_DIGEST_LENGTH },
+	{ CHECKSUM_SHA1, ".sha1", offsetof(struct file_sums, sha1),
+		SHA_DIGEST_LENGTH },
+	{ CHECKSUM_SHA256, ".sha256", offsetof(struct file_sums, sha256),
+		SHA256_DIGEST_LENGTH }
+};
+
+
+static void start_file(struct checksum *c)
+{
+	if (c->which & CHECKSUM_MD5)
+		MD5_Init(&c->md5);
+	if (c->which & CHECKSUM_SHA1)
+		SHA1_Init(&c->sha1);
+	if (c->which & CHECKSUM_SHA256)
+		SHA256_Init(&c->sha256);
+}
+
+static void end_file(struct checksum *c)
+{
+	struct file_sums *sums = malloc(sizeof(*sums));
+
+	FATAL_IF0(sums == NULL, "out of memory\n");
+
+	if (c->which & CHECKSUM_MD5)
+		MD5_Final(sums->md5, &c->md5);
+	if (c->which & CHECKSUM_SHA1)
+		SHA1_Final(sums->sha1, &c->sha1);
+	if (c->which & CHECKSUM_SHA256)
+		SHA256_Final(sums->sha256, &c->sha256);
+
+	c->f->sums = sums;
+}
+
+/*
+ * start summing the data of the files from the beginning of the given one
+ */
+EXPORT void checksum_init(struct checksum *c, int which,
+		struct ll_node *file_node)
+{
+	c->which = which;
+	c->f = NULL;
+	c->next = file_node;
+	c->left = 0;
+}
+
+/*
+ * feed the data to the file it is part of, and the files after it
+ */
+EXPORT void checksum_update(struct checksum *c, const unsigned char *data,
+		size_t len)
+{
+	while (len) {
+		size_t n = len;
+
+		/* the last file is done, go on with the next with any data */
+		while (c->left == 0) {
+			FATAL_IF0(c->next == NULL,
+				"more data than the files hold to sum\n");
+
+			c->f = LL_DATA_AS(c->next, struct file_data*);
+			c->next = LL_NEXT(c->next);
+			c->left = c->f->size;
+			if (c->left)
+				start_file(c);
+		}
+
+		if (n > c->left)
+			n = c->left;
+
+		if (c->which & CHECKSUM_MD5)
+			MD5_Update(&c->md5, data, n);
+		if (c->which & CHECKSUM_SHA1)
+			SHA1_Update(&c->sha1, data, n);
+		if (c->which & CHECKSUM_SHA256)
+			SHA256_Update(&c->sha256, data, n);
+
+		data += n;
+		len -= n;
+		c->left -= n;
+		if (c->left == 0)
+			end_file(c);
+	}
+}
+
+/*
+ * sum the empty files, and take the checksums of the duplicates
+ * that weren't read from the first copy
+ */
+EXPORT void checksum_files(struct metafile *m)
+{
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+
+		if (f->sums)
+			continue;
+
+		if (f->size == 0) {
+			struct checksum c;
+
+			checksum_init(&c, m->checksums, NULL);
+			c.f = f;
+			start_file(&c);
+			end_file(&c);
+		} else if (f->dup && f->dup->sums) {
+			f->sums = malloc(sizeof(*f->sums));
+			FATAL_IF0(f->sums == NULL, "out of memory\n");
+			memcpy(f->sums, f->dup->sums, sizeof(*f->sums));
+		}
+	}
+}
+
+/*
+ * write a line of the manifest, a name with a backslash or a line
+ * break is escaped and the line starts with a backslash, as md5sum
+ * and the others do
+ */
+static void write_line(FILE *f, const unsigned char *sum, size_t len,
+		const char *path)
+{
+	if (strpbrk(path, "\\\n\r"))
+		fputc('\\', f);
+
+	for (size_t i = 0; i < len; i++)
+		fprintf(f, "%02x", sum[i]);
+	fputs("  ", f);
+
+	for (; *path; path++)
+		switch (*path) {
+		case '\\':
+			fputs("\\\\", f);
+			break;
+		case '\n':
+			fputs("\\n", f);
+			break;
+		case '\r':
+			fputs("\\r", f);
+			break;
+		default:
+			fputc(*path, f);
+		}
+
+	fputc('\n', f);
+}
+
+/*
+ * write the manifest of every checksum asked for next to the metainfo
+ * file, the files are listed by their path in the directory, or by
+ * the name of a single file, so they're checked from there
+ */
+EXPORT void write_checksums(struct metafile *m)
+{
+	for (size_t i = 0; i < sizeof(manifests) / sizeof(manifests[0]); i++) {
+		char *path;
+		FILE *f;
+		int ok;
+
+		if (!(m->checksums & manifests[i].which))
+			continue;
+
+		path = malloc(strlen(m->metainfo_file_path)
+			+ strlen(manifests[i].suffix) + 1);
+		FATAL_IF0(path == NULL, "out of memory\n");
+		sprintf(path, "%s%s", m->metainfo_file_path, manifests[i].suffix);
+
+		f = fopen(path, "wb");
+		if (f == NULL) {
+			fprintf(stderr, "warning: cannot create '%s': %s\n",
+				path, strerror(errno));
+			free(path);
+			continue;
+		}
+
+		LL_FOR(file_node, m->file_list) {
+			struct file_data *fd = LL_DATA_AS(file_node, struct file_data*);
+			const char *name = fd->path;
+
+			if (!m->target_is_directory && strrchr(name, DIRSEP_CHAR))
+				name = strrchr(name, DIRSEP_CHAR) + 1;
+
+			write_line(f, (const unsigned char *) fd->sums
+				+ manifests[i].offset, manifests[i].len, name);
+		}
+
+		ok = !ferror(f);
+		if (fclose(f))
+			ok = 0;
+		if (!ok)
+			fprintf(stderr, "warning: cannot write '%s': %s\n",
+				path, strerror(errno));
+
+		free(path);
+	}
+}
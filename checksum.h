@@ -0,0 +1,51 @@
+#ifndef MKTORRENT_CHECKSUM_H
+#define MKTORRENT_CHECKSUM_H
+
+#include <stddef.h>      /* size_t */
+#include <stdint.h>      /* uintmax_t */
+
+#ifdef USE_OPENSSL
+#include <openssl/md5.h> /* MD5_CTX */
+#include <openssl/sha.h> /* SHA_CTX, SHA256_CTX */
+#else
+#include "md5.h"
+#include "sha1.h"
+#include "sha256.h"
+#endif
+
+#include "export.h"      /* EXPORT */
+#include "mktorrent.h"   /* struct metafile, struct file_data */
+#include "ll.h"          /* struct ll_node */
+
+/*
+ * the checksums of a file, those not asked for are left unset
+ */
+struct file_sums {
+	unsigned char md5[MD5_DIGEST_LENGTH];
+	unsigned char sha1[SHA_DIGEST_LENGTH];
+	unsigned char sha256[SHA256_DIGEST_LENGTH];
+};
+
+/*
+ * summing the files the data is read from one after the other, every
+ * file is done when all of its data is. empty files are skipped,
+ * checksum_files() does them
+ */
+struct checksum {
+	int which;               /* the CHECKSUM_ flags */
+	struct file_data *f;     /* file being summed */
+	struct ll_node *next;    /* file the data goes on with */
+	uintmax_t left;          /* bytes of the file still to come */
+	MD5_CTX md5;
+	SHA_CTX sha1;
+	SHA256_CTX sha256;
+};
+
+EXPORT void checksum_init(struct checksum *c, int which,
+		struct ll_node *file_node);
+EXPORT void checksum_update(struct checksum *c, const unsigned char *data,
+		size_t len);
+EXPORT void checksum_files(struct metafile *m);
+EXPORT void write_checksums(struct metafile *m);
+
+#endif /* MKTORRENT_CHECKSUM_H */
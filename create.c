@@ -0,0 +1,449 @@
+/*
+This file is part of mktorrent
+Copyright (C) 2007, 2009 Emil Renner Berthing
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>      /* exit(), srandom() */
+#include <errno.h>       /* errno */
+#include <string.h>      /* strerror() */
+#include <stdio.h>       /* printf() etc. */
+#include <sys/stat.h>    /* S_IRUSR, S_IWUSR, S_IRGRP, S_IROTH */
+#include <fcntl.h>       /* open() */
+#include <time.h>        /* clock_gettime() */
+#include <dirent.h>      /* opendir(), readdir() etc. */
+
+#ifdef USE_OPENSSL
+#include <openssl/sha.h> /* SHA_DIGEST_LENGTH */
+#else
+#include "sha1.h"
+#include "sha256.h"
+#endif
+
+#include "export.h"
+#include "mktorrent.h"
+#include "batch.h"
+#include "bencode.h"
+#include "checksum.h"
+#include "create.h"
+#include "init.h"
+#include "hash.h"
+#include "output.h"
+#include "resume.h"
+#include "server.h"
+#include "update.h"
+#include "msg.h"
+#include "ll.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef S_IRGRP
+#define S_IRGRP 0
+#endif
+
+#ifndef S_IROTH
+#define S_IROTH 0
+#endif
+
+
+/*
+ * create and open the metainfo file for writing and create a stream for it
+ * we don't want to overwrite anything, so abort if the file is already there
+ * and force is false
+ */
+static FILE *open_file(const char *path, int force)
+{
+	int fd;  /* file descriptor */
+	FILE *f; /* file stream */
+
+	/* a file overwritten may be longer than the one we write */
+	int flags = O_WRONLY | O_BINARY | O_CREAT | O_TRUNC;
+	if (!force)
+		flags |= O_EXCL;
+
+	/* open and create the file if it doesn't exist already */
+	fd = open(path, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	FATAL_IF(fd < 0, "cannot create '%s': %s\n", path, strerror(errno));
+
+	/* create the stream from this filedescriptor */
+	f = fdopen(fd, "wb");
+	FATAL_IF(f == NULL, "cannot create stream for '%s': %s\n",
+		path, strerror(errno));
+
+	return f;
+}
+
+/*
+ * close the metainfo file
+ */
+static void close_file(FILE *f)
+{
+	/* close the metainfo file */
+	FATAL_IF(fclose(f), "cannot close stream: %s\n", strerror(errno));
+}
+
+/*
+ * when several piece lengths are given, the piece length is added
+ * to the file name of every metainfo file, so foo.torrent becomes
+ * foo.l<n>.torrent where the piece length is 2^n
+ */
+static char *piece_length_file_path(const char *path, unsigned int piece_length)
+{
+	const char *suffix = ".torrent";
+	size_t len = strlen(path);
+	size_t suffix_len = strlen(suffix);
+	unsigned int n = 0;
+	char *r;
+
+	while ((1U << n) < piece_length)
+		n++;
+
+	if (len < suffix_len || strcmp(path + len - suffix_len, suffix))
+		suffix_len = 0;
+
+	r = malloc(len + 5);
+	FATAL_IF0(r == NULL, "out of memory\n");
+
+	sprintf(r, "%.*s.l%u%s", (int) (len - suffix_len), path, n,
+		path + len - suffix_len);
+
+	return r;
+}
+
+/*
+ * override the options of a metainfo file with those set by a variant
+ */
+static void apply_variant(struct metafile *t, struct variant *v)
+{
+	if (v->announce_list)
+		t->announce_list = v->announce_list;
+	if (v->comment)
+		t->comment = v->comment;
+	if (v->source)
+		t->source = v->source;
+	if (v->private >= 0)
+		t->private = v->private;
+	if (v->cross_seed >= 0)
+		t->cross_seed = v->cross_seed;
+
+	t->metainfo_file_path = v->metainfo_file_path;
+}
+
+/*
+ * edit a metainfo file, the new one is written next to it and
+ * then put in its place. returns 0 if it isn't a metainfo file
+ */
+static int edit_file(struct metafile *m, const char *path)
+{
+	struct bencode *root;
+	char *buf, *tmp;
+	size_t len;
+	FILE *f;
+
+	buf = bencode_read_file(path, &len);
+	root = bencode_parse(buf, len);
+	if (bencode_get(root, "info", BENCODE_DICT) == NULL) {
+		fprintf(stderr, "warning: '%s' is not a valid metainfo file, "
+			"skipping\n", path);
+		bencode_free(root);
+		free(buf);
+		return 0;
+	}
+
+	tmp = malloc(strlen(path) + 5);
+	FATAL_IF0(tmp == NULL, "out of memory\n");
+	sprintf(tmp, "%s.tmp", path);
+
+	f = open_file(tmp, 1);
+	edit_metainfo(f, m, root);
+	close_file(f);
+
+	FATAL_IF(rename(tmp, path), "cannot replace '%s': %s\n",
+		path, strerror(errno));
+
+	if (!m->machine_readable)
+		printf("edited %s\n", path);
+
+	bencode_free(root);
+	free(buf);
+	free(tmp);
+
+	return 1;
+}
+
+/*
+ * edit a metainfo file, or every .torrent file in a directory.
+ * returns 0 if any of them isn't a metainfo file
+ */
+static int edit_target(struct metafile *m, const char *path)
+{
+	const char *suffix = ".torrent";
+	struct dirent *de;
+	struct ll *list;
+	int r = 1;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (dir == NULL)
+		return edit_file(m, path);
+
+	list = ll_new();
+	FATAL_IF0(list == NULL, "out of memory\n");
+
+	/* the files are listed first, as the ones we replace
+	   may show up again */
+	while ((de = readdir(dir)) != NULL) {
+		size_t len = strlen(de->d_name);
+		char *p;
+
+		if (len <= strlen(suffix)
+				|| strcmp(de->d_name + len - strlen(suffix), suffix))
+			continue;
+
+		p = malloc(strlen(path) + len + 2);
+		FATAL_IF0(p == NULL || ll_append(list, p, 0) == NULL,
+			"out of memory\n");
+		sprintf(p, "%s" DIRSEP "%s", path, de->d_name);
+	}
+
+	closedir(dir);
+
+	LL_FOR(node, list)
+		if (!edit_file(m, LL_DATA_AS(node, const char*)))
+			r = 0;
+
+	ll_free(list, free);
+
+	return r;
+}
+
+/*
+ * create the torrents of a command line, returns the exit status
+ */
+EXPORT int create_torrents(int argc, char *argv[])
+{
+	FILE **files;                   /* streams for writing to the metainfo files */
+	struct metafile *torrents;      /* one for every piece length and variant */
+	unsigned char info_hash[SHA_DIGEST_LENGTH];
+	unsigned char info_hash_v2[SHA256_DIGEST_LENGTH];
+	unsigned int i;
+	struct metafile m = {
+		/* options */
+		0,    /* piece_length, 0 by default indicates length should be calculated automatically */
+		{ 0 },/* piece_lengths */
+		0,    /* piece_length_count */
+		0,    /* min_pieces */
+		0,    /* max_pieces */
+		0,    /* max_metainfo */
+		NULL, /* announce_list */
+		NULL, /* torrent_name */
+		NULL, /* metainfo_file_path */
+		NULL, /* web_seed_url */
+		NULL, /* comment */
+		0,    /* target_is_directory  */
+		META_V1, /* meta_version */
+		0,    /* pad_files */
+		0,    /* no_creation_date */
+		0,    /* private */
+		NULL, /* source string */
+		0,    /* cross_seed */
+		0,    /* verbose */
+		0,    /* force_overwrite */
+		0,    /* print_info_hash */
+		0,    /* print_magnet */
+		0,    /* machine_readable */
+		0,    /* progress */
+		NULL, /* exclude_list */
+		NULL, /* include_list */
+		NULL, /* variant_list */
+		0,    /* max_read_rate */
+		0,    /* idle */
+		0,    /* max_pressure */
+		0,    /* resume */
+		NULL, /* cache_path */
+		NULL, /* update_path */
+		NULL, /* edit_list */
+		NULL, /* verify_path */
+		0,    /* sample */
+		0,    /* stop_at_mismatch */
+		0,    /* fast_resume */
+		NULL, /* save_path */
+		0,    /* checksums */
+		NULL, /* batch_path */
+		NULL, /* socket_path */
+		NULL, /* batch_args */
+#ifdef USE_PTHREADS
+		0,    /* threads, initialised by init() */
+		0,    /* readers */
+		0,    /* memory */
+		NULL, /* cpus */
+		0,    /* cpu_count */
+		0,    /* numa */
+		0,    /* adaptive */
+#endif
+
+		/* information calculated by read_dir() */
+		0,    /* size */
+		NULL, /* file_list */
+		0,    /* pieces */
+		0     /* v2_pieces */
+	};
+
+	/* seed PRNG with current time */
+	struct timespec ts;
+	FATAL_IF(clock_gettime(CLOCK_REALTIME, &ts) == -1,
+		"failed to get time: %s\n", strerror(errno));
+	srandom(ts.tv_nsec ^ ts.tv_sec);
+
+	/* process options */
+	init(&m, argc, argv);
+
+	/* run every job of the job file like a command line of its own */
+	if (m.batch_path) {
+		int r = run_batch(&m, argv[0], create_torrents);
+
+		cleanup_metafile(&m);
+		return r;
+	}
+
+	/* or of every line clients send to the socket */
+	if (m.socket_path) {
+		int r = run_server(&m, argv[0], create_torrents);
+
+		cleanup_metafile(&m);
+		return r;
+	}
+
+	/* edit the metainfo files given instead of creating one */
+	if (m.edit_list) {
+		int r = EXIT_SUCCESS;
+
+		LL_FOR(edit_node, m.edit_list)
+			if (!edit_target(&m, LL_DATA_AS(edit_node, const char*)))
+				r = EXIT_FAILURE;
+
+		cleanup_metafile(&m);
+		return r;
+	}
+
+	/* check the content against a metainfo file instead of creating
+	   one, make_hash() exits if it doesn't match */
+	if (m.verify_path) {
+		free(make_hash(&m));
+		cleanup_metafile(&m);
+		return EXIT_SUCCESS;
+	}
+
+	/* a metainfo file is written for every piece length,
+	   and for every variant if any */
+	unsigned int variants = 0;
+	LL_FOR(variant_node, m.variant_list)
+		variants++;
+
+	unsigned int per_length = variants ? variants : 1;
+	unsigned int count = m.piece_length_count * per_length;
+
+	torrents = malloc(count * sizeof(*torrents));
+	files = malloc(count * sizeof(*files));
+	FATAL_IF0(torrents == NULL || files == NULL, "out of memory\n");
+
+	for (i = 0; i < count; i++) {
+		struct metafile *t = &torrents[i];
+		unsigned int piece_length = m.piece_lengths[i / per_length];
+
+		*t = m;
+		t->piece_length = piece_length;
+		if (m.pad_files)
+			t->pieces = m.pieces;
+		else
+			t->pieces = (m.size + piece_length - 1) / piece_length;
+
+		if (variants) {
+			struct ll_node *variant_node = LL_HEAD(m.variant_list);
+
+			for (unsigned int j = 0; j < i % per_length; j++)
+				LL_STEP(variant_node);
+
+			apply_variant(t, LL_DATA_AS(variant_node, struct variant*));
+		}
+
+		if (m.piece_length_count > 1)
+			t->metainfo_file_path = piece_length_file_path(
+				t->metainfo_file_path, piece_length);
+		else
+			t->metainfo_file_path = strdup(t->metainfo_file_path);
+		FATAL_IF0(t->metainfo_file_path == NULL, "out of memory\n");
+
+		/* open the file stream now, so we don't have to abort
+		   _after_ we did all the hashing in case we fail.
+		   the run we resume left its files behind */
+		files[i] = open_file(t->metainfo_file_path,
+			m.force_overwrite || m.resume);
+	}
+
+	/* calculate hash strings... */
+	unsigned char *hash = make_hash(&m);
+	unsigned char *pos = hash;
+	unsigned char *layers = hash;
+
+	/* the v2 piece hashes follow the v1 hash strings */
+	if (m.meta_version & META_V1)
+		for (i = 0; i < count; i += per_length)
+			layers += torrents[i].pieces * SHA_DIGEST_LENGTH;
+
+	for (i = 0; i < count; i++) {
+		/* the variants share the hash string of their piece length */
+		if (i > 0 && i % per_length == 0)
+			pos += torrents[i - 1].pieces * SHA_DIGEST_LENGTH;
+
+		/* and write the metainfo to file */
+		write_metainfo(files[i], &torrents[i], pos, layers,
+			info_hash, info_hash_v2);
+
+		/* close the file stream */
+		close_file(files[i]);
+
+		/* so the next update can tell which files changed */
+		if (m.update_path)
+			update_write_times(&torrents[i]);
+
+		/* so clients seed without checking the content again */
+		if (m.fast_resume)
+			write_fast_resume(&torrents[i], info_hash, info_hash_v2);
+
+		/* and the manifests of the checksums of the files */
+		if (m.checksums)
+			write_checksums(&torrents[i]);
+
+		/* tell the info hash and magnet URI if asked to */
+		print_result(&torrents[i], info_hash, info_hash_v2);
+
+		free(torrents[i].metainfo_file_path);
+	}
+
+	free(torrents);
+	free(files);
+
+	/* free allocated memory */
+	cleanup_metafile(&m);
+	free(hash);
+
+	/* yeih! everything seemed to go as planned */
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,8 @@
+#ifndef MKTORRENT_CREATE_H
+#define MKTORRENT_CREATE_H
+
+#include "export.h"      /* EXPORT */
+
+EXPORT int create_torrents(int argc, char *argv[]);
+
+#endif /* MKTORRENT_CREATE_H */
@@ -0,0 +1,344 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* malloc(), qsort() */
+#include <string.h>       /* memcpy(), memcmp() */
+#include <stdio.h>        /* printf() */
+#include <fcntl.h>        /* open() */
+#include <unistd.h>       /* close() */
+
+#ifdef __linux__
+#include <sys/ioctl.h>    /* ioctl() */
+#include <linux/fs.h>     /* FS_IOC_FIEMAP */
+#include <linux/fiemap.h> /* struct fiemap */
+#endif
+
+#ifdef USE_OPENSSL
+#include <openssl/sha.h>  /* SHA1() */
+#else
+#include "sha1.h"
+#include "sha256.h"
+#endif
+
+#include "export.h"
+#include "mktorrent.h"
+#include "dedup.h"
+#include "checkpoint.h"
+#include "msg.h"
+#include "ll.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+
+/*
+ * a file of the list while looking for duplicates
+ */
+struct entry {
+	struct file_data *f;
+	unsigned long index;     /* position in the file list */
+	int extents;             /* 1 if digest holds the extent map */
+	unsigned char digest[SHA_DIGEST_LENGTH];
+};
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct entry *x = a, *y = b;
+
+	if (x->f->size != y->f->size)
+		return x->f->size < y->f->size ? -1 : 1;
+	if (x->f->dev != y->f->dev)
+		return x->f->dev < y->f->dev ? -1 : 1;
+	if (x->f->ino != y->f->ino)
+		return x->f->ino < y->f->ino ? -1 : 1;
+	if (x->index != y->index)
+		return x->index < y->index ? -1 : 1;
+	return 0;
+}
+
+#ifdef __linux__
+/* number of extents to get at a time */
+#define EXTENTS 64
+
+/*
+ * hash the map of the physical extents of a file, two files with the
+ * same map on the same device share all their data, eg. reflinks.
+ * returns 0 on success and -1 if the map is unknown or some extent
+ * isn't plain shared data
+ */
+static int extent_digest(const char *path, unsigned char *digest)
+{
+	size_t size = sizeof(struct fiemap) + EXTENTS * sizeof(struct fiemap_extent);
+	struct fiemap *fm;
+	SHA_CTX c;
+	uint64_t start = 0;
+	int fd;
+	int last = 0;
+	int found = 0;
+
+	fm = malloc(size);
+	FATAL_IF0(fm == NULL, "out of memory\n");
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		free(fm);
+		return -1;
+	}
+
+	SHA1_Init(&c);
+
+	while (!last) {
+		memset(fm, 0, size);
+		fm->fm_start = start;
+		fm->fm_length = FIEMAP_MAX_OFFSET - start;
+		fm->fm_extent_count = EXTENTS;
+
+		if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0 || fm->fm_mapped_extents == 0)
+			break;
+
+		for (unsigned int i = 0; i < fm->fm_mapped_extents; i++) {
+			struct fiemap_extent *e = &fm->fm_extents[i];
+
+			/* only data known to be shared with another file */
+			if (!(e->fe_flags & FIEMAP_EXTENT_SHARED)
+					|| (e->fe_flags & ~(FIEMAP_EXTENT_SHARED
+						| FIEMAP_EXTENT_MERGED
+						| FIEMAP_EXTENT_LAST))) {
+				last = found = 0;
+				goto out;
+			}
+
+			SHA1_Update(&c, (const unsigned char *) &e->fe_logical,
+				sizeof(e->fe_logical));
+			SHA1_Update(&c, (const unsigned char *) &e->fe_physical,
+				sizeof(e->fe_physical));
+			SHA1_Update(&c, (const unsigned char *) &e->fe_length,
+				sizeof(e->fe_length));
+
+			start = e->fe_logical + e->fe_length;
+			last = e->fe_flags & FIEMAP_EXTENT_LAST;
+			found = 1;
+		}
+	}
+
+out:
+	close(fd);
+	free(fm);
+	SHA1_Final(digest, &c);
+
+	return last && found ? 0 : -1;
+}
+#else
+static int extent_digest(const char *path, unsigned char *digest)
+{
+	(void) path;
+	(void) digest;
+	return -1;
+}
+#endif /* __linux__ */
+
+/*
+ * mark every file in the list with the same content as a file before
+ * it as a duplicate of that file, that is hardlinks to the same inode
+ * and files sharing all their extents on the same device. where every
+ * file starts in the stream of all of them is noted too
+ */
+EXPORT void find_duplicates(struct metafile *m)
+{
+	struct entry *e;
+	unsigned long n = 0;
+	uintmax_t offset = 0;
+
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+
+		f->offset = offset;
+		offset += f->size;
+		n++;
+	}
+
+	if (n < 2)
+		return;
+
+	e = malloc(n * sizeof(*e));
+	FATAL_IF0(e == NULL, "out of memory\n");
+
+	n = 0;
+	LL_FOR(file_node, m->file_list) {
+		e[n].f = LL_DATA_AS(file_node, struct file_data*);
+		e[n].index = n;
+		e[n].extents = 0;
+		n++;
+	}
+
+	qsort(e, n, sizeof(*e), entry_cmp);
+
+	for (unsigned long i = 0; i < n; ) {
+		unsigned long end = i + 1;
+
+		/* files of the same size follow each other,
+		   the links to an inode in the order of the list */
+		while (end < n && e[end].f->size == e[i].f->size)
+			end++;
+
+		/* there is nothing to read in empty files */
+		if (e[i].f->size == 0 || end - i < 2) {
+			i = end;
+			continue;
+		}
+
+		for (unsigned long j = i + 1; j < end; j++)
+			if (e[j].f->dev == e[j - 1].f->dev
+					&& e[j].f->ino == e[j - 1].f->ino)
+				e[j].f->dup = e[j - 1].f->dup ?
+					e[j - 1].f->dup : e[j - 1].f;
+
+		/* compare the extents of the first link to every inode */
+		for (unsigned long j = i; j < end; j++)
+			if (e[j].f->dup == NULL)
+				e[j].extents =
+					extent_digest(e[j].f->path, e[j].digest) == 0;
+
+		for (unsigned long j = i; j < end; j++) {
+			struct entry *first = &e[j];
+
+			if (!e[j].extents)
+				continue;
+
+			/* the first file in the list with the same extents */
+			for (unsigned long k = i; k < end; k++)
+				if (e[k].extents && e[k].index < first->index
+						&& e[k].f->dev == e[j].f->dev
+						&& !memcmp(e[k].digest, e[j].digest,
+							SHA_DIGEST_LENGTH))
+					first = &e[k];
+
+			if (first == &e[j])
+				continue;
+
+			/* the inode and its other links are duplicates of it */
+			for (unsigned long k = i; k < end; k++)
+				if (e[k].f == e[j].f || e[k].f->dup == e[j].f)
+					e[k].f->dup = first->f;
+		}
+
+		i = end;
+	}
+
+	free(e);
+
+	if (m->verbose) {
+		LL_FOR(file_node, m->file_list) {
+			struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+
+			if (f->dup)
+				printf("%s is the same as %s\n", f->path, f->dup->path);
+		}
+	}
+}
+
+/*
+ * when every file starts a new piece, the hashes of a duplicate are
+ * those of the first copy, so it doesn't have to be read at all.
+ * only the last file may end in a shorter piece, which isn't padded
+ * like the pieces of the first copy
+ */
+EXPORT int is_duplicate(struct metafile *m, struct ll_node *file_node)
+{
+	struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+
+	if (f->dup == NULL || !m->pad_files)
+		return 0;
+
+	if (LL_NEXT(file_node) == NULL && (m->meta_version & META_V1)
+			&& f->size % m->piece_length)
+		return 0;
+
+	return 1;
+}
+
+/*
+ * the units of a duplicate whose hashes are those of units of its
+ * first copy, from the given ones on. when every file starts a new
+ * piece those are all of its pieces. otherwise they are its whole
+ * units, if both copies start on a unit boundary, but for when the
+ * files are summed while they are read.
+ * returns their number
+ */
+static uintmax_t copied_units(struct metafile *m, struct checkpoint *cp,
+		struct ll_node *file_node, uintmax_t *unit, uintmax_t *from)
+{
+	struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+
+	if (m->pad_files) {
+		if (!is_duplicate(m, file_node))
+			return 0;
+
+		*unit = f->piece;
+		*from = f->dup->piece;
+		return (f->size + m->piece_length - 1) / m->piece_length;
+	}
+
+	if (f->dup == NULL || m->checksums || f->offset % cp->unit_len
+			|| f->dup->offset % cp->unit_len)
+		return 0;
+
+	*unit = f->offset / cp->unit_len;
+	*from = f->dup->offset / cp->unit_len;
+	return f->size / cp->unit_len;
+}
+
+/*
+ * mark the units of the duplicates that aren't read, as their
+ * hashes are copied from those of the first copy
+ */
+EXPORT void find_copied_units(struct metafile *m, struct checkpoint *cp)
+{
+	LL_FOR(file_node, m->file_list) {
+		uintmax_t unit, from;
+		uintmax_t n = copied_units(m, cp, file_node, &unit, &from);
+
+		if (n && cp->copied == NULL) {
+			cp->copied = calloc(cp->units / 8 + 1, 1);
+			FATAL_IF0(cp->copied == NULL, "out of memory\n");
+		}
+
+		for (; n > 0; n--, unit++)
+			cp->copied[unit / 8] |= 1 << unit % 8;
+	}
+}
+
+/*
+ * copy the hashes of the first copy of every duplicate
+ * to the units that weren't read
+ */
+EXPORT void copy_duplicate_hashes(struct metafile *m, struct checkpoint *cp)
+{
+	LL_FOR(file_node, m->file_list) {
+		uintmax_t unit, from;
+		uintmax_t n = copied_units(m, cp, file_node, &unit, &from);
+
+		for (; n > 0; n--, unit++, from++)
+			for (unsigned int set = 0; set <= CHECKPOINT_V2; set++)
+				memcpy(checkpoint_hash(cp, unit, set),
+					checkpoint_hash(cp, from, set),
+					checkpoint_pieces(cp, unit, set) * cp->digest[set]);
+	}
+}
@@ -0,0 +1,14 @@
+#ifndef MKTORRENT_DEDUP_H
+#define MKTORRENT_DEDUP_H
+
+#include "export.h"      /* EXPORT */
+#include "mktorrent.h"   /* struct metafile */
+#include "ll.h"          /* struct ll_node */
+#include "checkpoint.h"  /* struct checkpoint */
+
+EXPORT void find_duplicates(struct metafile *m);
+EXPORT int is_duplicate(struct metafile *m, struct ll_node *file_node);
+EXPORT void find_copied_units(struct metafile *m, struct checkpoint *cp);
+EXPORT void copy_duplicate_hashes(struct metafile *m, struct checkpoint *cp);
+
+#endif /* MKTORRENT_DEDUP_H */
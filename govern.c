@@ -0,0 +1,275 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* strtod() etc. */
+#include <stdio.h>        /* fopen(), fprintf() etc. */
+#include <string.h>       /* strncmp(), strerror() */
+#include <errno.h>        /* errno */
+#include <unistd.h>       /* sysconf() */
+#include <time.h>         /* clock_gettime(), nanosleep() */
+#include <sched.h>        /* sched_setscheduler() */
+#include <stdint.h>       /* uint64_t */
+#include <stdatomic.h>    /* atomic_load() etc. */
+
+#ifdef __linux__
+#include <sys/syscall.h>  /* SYS_ioprio_set etc. */
+#endif
+
+#include "export.h"
+#include "mktorrent.h"
+#include "govern.h"
+
+/* the reading may run ahead of the rate by this many nanoseconds,
+   so the first reads aren't held back */
+#define BURST 100000000ULL
+
+/* nanoseconds between reading the pressure */
+#define PRESSURE_PERIOD 1000000000ULL
+
+/* nanoseconds to sleep while the system is under pressure */
+#define PRESSURE_SLEEP 100000000ULL
+
+#ifdef __linux__
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#endif
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+	struct timespec t;
+
+	t.tv_sec = ns / 1000000000ULL;
+	t.tv_nsec = ns % 1000000000ULL;
+	while (nanosleep(&t, &t) && errno == EINTR)
+		;
+}
+
+EXPORT void governor_init(struct governor *g, struct metafile *m)
+{
+	g->ns_per_mib = m->max_read_rate ?
+		1000000000ULL / m->max_read_rate : 0;
+	atomic_init(&g->next, 0);
+	g->max_pressure = m->max_pressure;
+	atomic_init(&g->checked, 0);
+	atomic_init(&g->stalled, 0);
+}
+
+/*
+ * the highest share of time in percent some tasks were stalled on
+ * I/O or CPU over the last 10 seconds, 0 if the system doesn't tell
+ */
+static double pressure(void)
+{
+	static const char *files[] = {
+		"/proc/pressure/io", "/proc/pressure/cpu"
+	};
+	double r = 0;
+
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		FILE *f = fopen(files[i], "r");
+		double avg10;
+
+		if (f == NULL)
+			continue;
+
+		if (fscanf(f, "some avg10=%lf", &avg10) == 1 && avg10 > r)
+			r = avg10;
+
+		fclose(f);
+	}
+
+	return r;
+}
+
+/*
+ * called after reading len bytes, sleeps to keep the reading within
+ * the rate given, and while the system is under pressure.
+ * the rate is kept as the time the reading may go on, every read
+ * moves it on by the time it should take at the rate given
+ */
+EXPORT void govern_read(struct governor *g, size_t len)
+{
+	uint64_t now;
+
+	if (g->ns_per_mib == 0 && g->max_pressure == 0)
+		return;
+
+	now = now_ns();
+
+	if (g->ns_per_mib) {
+		uint64_t cost = (uint64_t) ((double) len * g->ns_per_mib / ONEMEG);
+		uint64_t prev = atomic_load(&g->next);
+		uint64_t start;
+
+		/* time the readers were idle isn't saved up */
+		do {
+			start = prev < now ? now : prev;
+		} while (!atomic_compare_exchange_weak(&g->next, &prev,
+				start + cost));
+
+		if (start + cost > now + BURST)
+			sleep_ns(start + cost - now - BURST);
+	}
+
+	if (g->max_pressure) {
+		uint64_t checked = atomic_load(&g->checked);
+
+		/* one reader reads the pressure now and then, and
+		   holds everyone back while it is too high */
+		if (now - checked >= PRESSURE_PERIOD &&
+				atomic_compare_exchange_strong(&g->checked,
+					&checked, now)) {
+			while (pressure() > g->max_pressure) {
+				atomic_store(&g->stalled, 1);
+				sleep_ns(PRESSURE_PERIOD);
+			}
+			atomic_store(&g->stalled, 0);
+		}
+
+		while (atomic_load(&g->stalled))
+			sleep_ns(PRESSURE_SLEEP);
+	}
+}
+
+#ifdef USE_PTHREADS
+/*
+ * read the CPU quota of our cgroup, returns the number of CPUs
+ * it amounts to, or 0 if there is none
+ */
+static long cgroup_cpus(void)
+{
+#ifdef __linux__
+	char line[4096];
+	char path[4200];
+	long long quota = 0;
+	long long period = 0;
+	FILE *f;
+
+	/* cgroup v2, where our cgroup is listed as 0::<path> */
+	path[0] = '\0';
+	f = fopen("/proc/self/cgroup", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f))
+			if (strncmp(line, "0::", 3) == 0) {
+				line[strcspn(line, "\n")] = '\0';
+				snprintf(path, sizeof(path),
+					"/sys/fs/cgroup%s/cpu.max", line + 3);
+				break;
+			}
+		fclose(f);
+	}
+
+	if (path[0] == '\0' || (f = fopen(path, "r")) == NULL)
+		f = fopen("/sys/fs/cgroup/cpu.max", "r");
+	if (f) {
+		if (fscanf(f, "%lld %lld", &quota, &period) != 2)
+			quota = 0;
+		fclose(f);
+	} else {
+		/* cgroup v1 */
+		f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+		if (f) {
+			if (fscanf(f, "%lld", &quota) != 1)
+				quota = 0;
+			fclose(f);
+		}
+		f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+		if (f) {
+			if (fscanf(f, "%lld", &period) != 1)
+				period = 0;
+			fclose(f);
+		}
+	}
+
+	if (quota > 0 && period > 0)
+		return (quota + period - 1) / period;
+#endif
+	return 0;
+}
+
+/*
+ * the number of CPUs we may use, that is those we may run on,
+ * but no more than the CPU quota of our cgroup
+ */
+EXPORT long available_cpus(void)
+{
+	long n = 0;
+	long quota = cgroup_cpus();
+
+#ifdef __linux__
+	unsigned long mask[64];
+	long r = syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask);
+
+	for (long i = 0; i < r * 8; i++)
+		if (mask[i / (8 * sizeof(unsigned long))]
+				& (1UL << i % (8 * sizeof(unsigned long))))
+			n++;
+#endif
+
+#ifdef _SC_NPROCESSORS_ONLN
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	if (quota > 0 && (n <= 0 || quota < n))
+		n = quota;
+
+	return n;
+}
+#endif /* USE_PTHREADS */
+
+/*
+ * run at idle CPU and I/O priority, so we only use what others leave,
+ * the threads started after this inherit it
+ */
+EXPORT void set_idle_priority(void)
+{
+#ifdef __linux__
+	struct sched_param param;
+
+	memset(&param, 0, sizeof(param));
+	if (sched_setscheduler(0, SCHED_IDLE, &param))
+		fprintf(stderr, "warning: cannot set idle CPU priority: %s\n",
+			strerror(errno));
+
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+			IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT))
+		fprintf(stderr, "warning: cannot set idle I/O priority: %s\n",
+			strerror(errno));
+#else
+	/* the best we can do elsewhere */
+	errno = 0;
+	if (nice(19) == -1 && errno)
+		fprintf(stderr, "warning: cannot lower the priority: %s\n",
+			strerror(errno));
+#endif
+}
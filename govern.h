@@ -0,0 +1,29 @@
+#ifndef MKTORRENT_GOVERN_H
+#define MKTORRENT_GOVERN_H
+
+#include <stddef.h>      /* size_t */
+#include <stdint.h>      /* uint64_t */
+#include <stdatomic.h>   /* atomic_uint_fast64_t etc. */
+
+#include "export.h"      /* EXPORT */
+#include "mktorrent.h"   /* struct metafile */
+
+/*
+ * keeps the reading within the limits given, shared by all readers
+ */
+struct governor {
+	uint64_t ns_per_mib;           /* time to read a MiB, 0 for no limit */
+	atomic_uint_fast64_t next;     /* when the reading may go on */
+	unsigned int max_pressure;     /* 0 for no back-off */
+	atomic_uint_fast64_t checked;  /* when the pressure was read */
+	atomic_int stalled;            /* the system is under pressure */
+};
+
+EXPORT void governor_init(struct governor *g, struct metafile *m);
+EXPORT void govern_read(struct governor *g, size_t len);
+#ifdef USE_PTHREADS
+EXPORT long available_cpus(void);
+#endif
+EXPORT void set_idle_priority(void);
+
+#endif /* MKTORRENT_GOVERN_H */
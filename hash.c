@@ -23,18 +23,28 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include <string.h>       /* strerror() */
 #include <stdio.h>        /* printf() etc. */
 #include <fcntl.h>        /* open() */
-#include <unistd.h>       /* read(), close() */
+#include <unistd.h>       /* read(), lseek(), close() */
 #include <inttypes.h>     /* PRId64 etc. */
+#include <time.h>         /* time() */
 
 #ifdef USE_OPENSSL
 #include <openssl/sha.h>  /* SHA1() */
 #else
 #include "sha1.h"
+#include "sha256.h"
 #endif
 
 #include "export.h"
 #include "mktorrent.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "checksum.h"
+#include "dedup.h"
+#include "govern.h"
 #include "hash.h"
+#include "merkle.h"
+#include "update.h"
+#include "verify.h"
 #include "msg.h"
 #include "ll.h"
 
@@ -49,85 +59,290 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #endif
 
 
+/*
+ * hash the 16 KiB blocks of data, the last block may be shorter,
+ * and store the root of the tree of the given height of which
+ * they are the leftmost leaves
+ */
+static void hash_v2_piece(unsigned char *dest, const unsigned char *data,
+		size_t len, unsigned int height)
+{
+	struct merkle t;
+
+	merkle_init(&t);
+	merkle_add_blocks(&t, data, len);
+	merkle_root(&t, dest, height);
+}
+
+/*
+ * print the number of pieces of the largest length hashed so far
+ * as JSON with -g, once a second at most
+ */
+static void print_progress(uintmax_t hashed, uintmax_t pieces)
+{
+	static time_t last;
+	time_t now = time(NULL);
+
+	if (now == last)
+		return;
+	last = now;
+
+	printf("{\"hashed\": %" PRIuMAX ", \"pieces\": %" PRIuMAX "}\n",
+		hashed, pieces);
+	fflush(stdout);
+}
+
+/*
+ * hash the contents of the read buffer with every piece length,
+ * the buffer is as long as the largest piece length, so it holds
+ * a whole number of pieces of every other length.
+ * only the last buffer may be shorter and end in an irregular piece
+ */
+static void hash_buffer(struct metafile *m, unsigned char *read_buf,
+		size_t len, unsigned char **pos)
+{
+	SHA_CTX c;                      /* SHA1 hashing context */
+
+	/* there are no v1 pieces in a v2 only torrent */
+	if (!(m->meta_version & META_V1))
+		return;
+
+	for (unsigned int i = 0; i < m->piece_length_count; i++) {
+		size_t off;
+
+		for (off = 0; off < len; off += m->piece_lengths[i]) {
+			size_t n = len - off;
+
+			if (n > m->piece_lengths[i])
+				n = m->piece_lengths[i];
+
+			SHA1_Init(&c);
+			SHA1_Update(&c, read_buf + off, n);
+			SHA1_Final(pos[i], &c);
+			pos[i] += SHA_DIGEST_LENGTH;
+		}
+	}
+}
+
 /*
  * go through the files in file_list, split their contents into pieces
  * of size piece_length and create the hash string, which is the
  * concatenation of the (20 byte) SHA1 hash of every piece
- * last piece may be shorter
+ * last piece may be shorter.
+ * this is done for every piece length at once, the hash strings
+ * are returned one after the other in the order of piece_lengths.
+ * for v2 torrents every file is split into pieces of its own and
+ * the (32 byte) root of the merkle tree of every piece follows
  */
 EXPORT unsigned char *make_hash(struct metafile *m)
 {
 	unsigned char *hash_string;     /* the hash string */
-	unsigned char *pos;             /* position in the hash string */
+	unsigned char *pos[MAX_PIECE_LENGTHS]; /* position in the hash string
+	                                   of every piece length */
+	unsigned char *pos_v2;          /* position of the v2 piece hashes */
 	unsigned char *read_buf;        /* read buffer */
+	size_t buf_len = 0;             /* size of the read buffer */
+	uintmax_t pieces = 0;           /* number of pieces of all lengths */
 	int fd;                         /* file descriptor */
+	struct governor g;              /* keeps the reading within limits */
+	struct checkpoint cp;           /* the pieces done so far */
+	struct cache cache;             /* hashes of the files hashed before */
+	struct update update;           /* hashes of the torrent we update */
+	struct verify verify;           /* the torrent we check against */
+	struct checksum sums;           /* checksums of the file read */
+	uintmax_t unit = 0;             /* piece of the largest length read */
+	uintmax_t offset = 0;           /* offset in the stream of all files */
+	uintmax_t skip = 0;             /* bytes of pieces done to skip */
 	size_t r;                       /* number of bytes read from file(s) into
 	                                   the read buffer */
-	SHA_CTX c;                      /* SHA1 hashing context */
 #ifndef NO_HASH_CHECK
 	uintmax_t counter = 0;          /* number of bytes hashed
 	                                   should match size when done */
 #endif
 
+	for (unsigned int i = 0; i < m->piece_length_count; i++) {
+		/* pad files add to the pieces of every file but the last */
+		if (m->meta_version & META_V1)
+			pieces += m->pad_files ? m->pieces :
+				(m->size + m->piece_lengths[i] - 1) / m->piece_lengths[i];
+		if (m->piece_lengths[i] > buf_len)
+			buf_len = m->piece_lengths[i];
+	}
+
 	/* allocate memory for the hash string
-	   every SHA1 hash is SHA_DIGEST_LENGTH (20) bytes long */
-	hash_string = malloc(m->pieces * SHA_DIGEST_LENGTH);
-	/* allocate memory for the read buffer to store 1 piece */
-	read_buf = malloc(m->piece_length);
+	   every SHA1 hash is SHA_DIGEST_LENGTH (20) bytes long
+	   and every v2 hash is SHA256_DIGEST_LENGTH (32) bytes long */
+	hash_string = malloc(pieces * SHA_DIGEST_LENGTH
+		+ (uintmax_t) m->v2_pieces * SHA256_DIGEST_LENGTH + 1);
+	/* allocate memory for the read buffer to store 1 piece
+	   of the largest piece length */
+	read_buf = malloc(buf_len);
 
 	/* check if we've run out of memory */
 	FATAL_IF0(hash_string == NULL || read_buf == NULL, "out of memory\n");
 
-	/* initiate pos to point to the beginning of hash_string */
-	pos = hash_string;
+	/* initiate pos to point to the beginning of the hash string
+	   of every piece length */
+	pos[0] = hash_string;
+	for (unsigned int i = 1; i < m->piece_length_count; i++)
+		pos[i] = pos[i - 1] + SHA_DIGEST_LENGTH *
+			((m->size + m->piece_lengths[i - 1] - 1) / m->piece_lengths[i - 1]);
+	pos_v2 = hash_string + pieces * SHA_DIGEST_LENGTH;
+	governor_init(&g, m);
+	checkpoint_open(&cp, m, hash_string);
+	find_copied_units(m, &cp);
+	cache_open(&cache, m);
+	cache_fill(&cache, &cp);
+	update_open(&update, m);
+	update_fill(&update, &cp);
+	verify_open(&verify, m, &cp);
 	/* and initiate r to 0 since we haven't read anything yet */
 	r = 0;
 	/* go through all the files in the file list */
 	LL_FOR(file_node, m->file_list) {
 		struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+		unsigned int height = merkle_piece_height(m, f->size);
+		/* read the first copy of a duplicate, it may still be cached */
+		const char *path = f->dup ? f->dup->path : f->path;
+		uintmax_t off = 0;      /* offset in the file */
+
+		/* the hashes of a duplicate are copied when we're done */
+		if (is_duplicate(m, file_node)) {
+			uintmax_t n = (f->size + buf_len - 1) / buf_len;
+
+			if (m->meta_version & META_V1)
+				pos[0] += n * SHA_DIGEST_LENGTH;
+			if (m->meta_version & META_V2)
+				pos_v2 += n * SHA256_DIGEST_LENGTH;
+#ifndef NO_HASH_CHECK
+			counter += f->size;
+#endif
+			continue;
+		}
 
 		/* open the current file for reading */
-		FATAL_IF((fd = open(f->path, OPENFLAGS)) == -1,
-			"cannot open '%s' for reading: %s\n", f->path, strerror(errno));
-		printf("hashing %s\n", f->path);
-		fflush(stdout);
+		FATAL_IF((fd = open(path, OPENFLAGS)) == -1,
+			"cannot open '%s' for reading: %s\n", path, strerror(errno));
+		if (m->checksums)
+			checksum_init(&sums, m->checksums, file_node);
+		if (!m->machine_readable) {
+			printf("hashing %s\n", f->path);
+			fflush(stdout);
+		}
 
 		/* fill the read buffer with the contents of the file and append
-		   the SHA1 hash of it to the hash string when the buffer is full.
-		   repeat until we can't fill the read buffer and we've thus come
-		   to the end of the file */
+		   the SHA1 hashes of it to the hash strings when the buffer is
+		   full. repeat until we can't fill the read buffer and we've
+		   thus come to the end of the file */
 		while (1) {
-			ssize_t d = read(fd, read_buf + r, m->piece_length - r);
+			ssize_t d;
+
+			/* a new piece of the largest length starts,
+			   skip it if it is done */
+			if (r == 0 && skip == 0 && off < f->size) {
+				if (checkpoint_interrupted())
+					checkpoint_stop(&cp);
+
+				unit = m->pad_files ? f->piece + off / buf_len :
+					offset / buf_len;
+				if (checkpoint_skipped(&cp, unit)) {
+					skip = m->pad_files ? f->size - off :
+						m->size - offset;
+					if (skip > buf_len)
+						skip = buf_len;
+
+					for (unsigned int i = 0; i < m->piece_length_count; i++)
+						pos[i] += checkpoint_pieces(&cp, unit, i)
+							* SHA_DIGEST_LENGTH;
+					if (m->meta_version & META_V2)
+						pos_v2 += SHA256_DIGEST_LENGTH;
+				}
+			}
+
+			/* the piece may go on in the next file */
+			if (skip) {
+				uintmax_t n = f->size - off < skip ?
+					f->size - off : skip;
+
+				FATAL_IF(lseek(fd, n, SEEK_CUR) == (off_t) -1,
+					"cannot seek in '%s': %s\n",
+					path, strerror(errno));
+				off += n;
+				offset += n;
+				skip -= n;
+#ifndef NO_HASH_CHECK
+				counter += n;
+#endif
+				if (off == f->size)
+					break;
+				continue;
+			}
+
+			d = read(fd, read_buf + r, buf_len - r);
 			FATAL_IF(d < 0, "cannot read from '%s': %s\n",
-				f->path, strerror(errno));
+				path, strerror(errno));
 
 			if (d == 0) /* end of file */
 				break;
 
+			if (m->checksums)
+				checksum_update(&sums, read_buf + r, d);
+
 			r += d;
+			off += d;
+			offset += d;
+			govern_read(&g, d);
 
-			if (r == m->piece_length) {
-				SHA1_Init(&c);
-				SHA1_Update(&c, read_buf, m->piece_length);
-				SHA1_Final(pos, &c);
-				pos += SHA_DIGEST_LENGTH;
+			if (r == buf_len) {
+				hash_buffer(m, read_buf, r, pos);
+				if (m->meta_version & META_V2) {
+					hash_v2_piece(pos_v2, read_buf, r, height);
+					pos_v2 += SHA256_DIGEST_LENGTH;
+				}
 #ifndef NO_HASH_CHECK
-				counter += r;	/* r == piece_length */
+				counter += r;	/* r == buf_len */
 #endif
 				r = 0;
+				checkpoint_unit(&cp, unit);
+				checkpoint_update(&cp);
+				if (m->progress)
+					print_progress(unit + 1, cp.units);
 			}
 		}
 
 		/* now close the file */
 		FATAL_IF(close(fd), "cannot close '%s': %s\n",
-			f->path, strerror(errno));
+			path, strerror(errno));
+
+		/* when every file starts a new piece the last piece of
+		   the file is hashed on its own. in v1 it is followed by
+		   a pad file of zeros, unless it is the last file */
+		if (m->pad_files && r) {
+			size_t len = r;
+
+			if (LL_NEXT(file_node)) {
+				memset(read_buf + r, 0, buf_len - r);
+				len = buf_len;
+			}
+
+			hash_buffer(m, read_buf, len, pos);
+			if (m->meta_version & META_V2) {
+				hash_v2_piece(pos_v2, read_buf, r, height);
+				pos_v2 += SHA256_DIGEST_LENGTH;
+			}
+#ifndef NO_HASH_CHECK
+			counter += r;
+#endif
+			r = 0;
+			checkpoint_unit(&cp, unit);
+		}
 	}
 
-	/* finally append the hash of the last irregular piece to the hash string */
+	/* finally append the hashes of the last irregular pieces
+	   to the hash strings */
 	if (r) {
-		SHA1_Init(&c);
-		SHA1_Update(&c, read_buf, r);
-		SHA1_Final(pos, &c);
+		hash_buffer(m, read_buf, r, pos);
+		checkpoint_unit(&cp, unit);
 	}
 
 #ifndef NO_HASH_CHECK
@@ -138,6 +353,19 @@ EXPORT unsigned char *make_hash(struct metafile *m)
 			m->size, counter);
 #endif
 
+	copy_duplicate_hashes(m, &cp);
+	if (m->checksums)
+		checksum_files(m);
+
+	cache_close(&cache, &cp);
+	update_close(&update);
+	verify_close(&verify, &cp);
+	checkpoint_close(&cp);
+
+	/* the v2 piece hashes are done, now find the root of every file */
+	if (m->meta_version & META_V2)
+		merkle_file_roots(m, hash_string + pieces * SHA_DIGEST_LENGTH);
+
 	/* free the read buffer before we return */
 	free(read_buf);
 
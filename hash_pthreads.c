@@ -27,23 +27,71 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include <unistd.h>       /* read(), close() */
 #include <inttypes.h>     /* PRId64 etc. */
 #include <pthread.h>
+#include <sched.h>        /* sched_yield() */
+#include <stdatomic.h>    /* atomic_load() etc. */
 #include <time.h>         /* nanosleep() */
 
 #ifdef USE_OPENSSL
 #include <openssl/sha.h>  /* SHA1() */
 #else
 #include "sha1.h"
+#include "sha256.h"
 #endif
 
 #include "export.h"
 #include "mktorrent.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "checksum.h"
+#include "dedup.h"
+#include "govern.h"
 #include "hash.h"
+#include "merkle.h"
+#include "update.h"
+#include "verify.h"
 #include "msg.h"
+#include "ll.h"
+#include "numa.h"
+#include "queue.h"
 
 #ifndef PROGRESS_PERIOD
 #define PROGRESS_PERIOD 200000
 #endif
 
+/* microseconds between the changes of the tuner */
+#ifndef TUNE_PERIOD
+#define TUNE_PERIOD 500000
+#endif
+
+/* the tuner uses at least 1/2^BUFFER_SHIFT_MAX of the chunks */
+#define BUFFER_SHIFT_MAX 4
+
+/* number of files read at the same time by default when
+   every file starts a new piece */
+#ifndef MAX_READERS
+#define MAX_READERS 4
+#endif
+
+/* when the files are read as one stream by several readers, they
+   take turns reading segments of this size, rounded up to a whole
+   number of the largest pieces, so the segments share no piece */
+#ifndef SEGMENT_SIZE
+#define SEGMENT_SIZE 67108864
+#endif
+
+/* the content is read and hashed in chunks of this size, so the data
+   is hashed while it is still in the cache, whatever the piece length.
+   it must be a power of two and a multiple of V2_BLOCK_SIZE */
+#ifndef CHUNK_SIZE
+#define CHUNK_SIZE 262144
+#endif
+
+/* the most jobs waiting for a worker, when its ring is full
+   the readers yield until it has caught up */
+#ifndef MAX_JOBS
+#define MAX_JOBS 4096
+#endif
+
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
@@ -54,113 +102,273 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #define OPENFLAGS (O_RDONLY | O_BINARY)
 #endif
 
+/* the set of the v2 pieces, after those of the piece lengths, and the
+   checksums of the files, which are summed as a single piece */
+#define SET_V2 MAX_PIECE_LENGTHS
+#define SET_SUMS (MAX_PIECE_LENGTHS + 1)
+#define SETS (MAX_PIECE_LENGTHS + 2)
+
 
-struct piece {
-	struct piece *next;
-	unsigned char *dest;
+struct chunk;
+struct pool;
+struct queue;
+
+/*
+ * hashing a piece with one of the piece lengths or v2, the chunks of
+ * the piece are hashed into the same context one after the other.
+ * they are queued for the worker the piece is given to, but an idle
+ * worker may steal them, so they are numbered to keep them in order
+ */
+struct state {
+	union {
+		SHA_CTX c;       /* SHA1 context of a v1 piece */
+		struct merkle t; /* merkle tree of a v2 piece */
+		struct checksum s; /* checksums of the files of a stream */
+	} u;
+	struct pool *pool;       /* the state is reused in */
+	unsigned char *dest;     /* where the hash of the piece goes */
+	uintmax_t unit;          /* piece of the largest length it is in */
+	unsigned int height;     /* height of the merkle tree of a v2 piece */
+	unsigned int worker;     /* the worker the piece is given to */
+	unsigned int queued;     /* number of chunks queued */
+	atomic_uint next;        /* number of the next chunk to hash */
+};
+
+/*
+ * hashing the data of a chunk into the piece of one of the sets,
+ * every chunk is part of a single piece of every set
+ */
+struct job {
+	struct chunk *chunk;
+	struct state *state;
+	unsigned int set;        /* index into piece_lengths, SET_V2
+	                            or SET_SUMS */
+	unsigned int seq;        /* number of the chunk in the piece */
+	unsigned long pad;       /* zeros after the chunk, in a pad file */
+	int last;                /* the piece ends with this chunk */
+};
+
+struct chunk {
+	struct pool *pool;       /* the chunk belongs to */
 	unsigned long len;
+	atomic_uint jobs_left;   /* jobs not yet done with this chunk */
+	struct job jobs[SETS];
 	unsigned char data[1];
 };
 
+/*
+ * the jobs given to a worker in the order they were queued,
+ * the worker sleeps in its parking when the ring is empty
+ * and there is nothing to steal from the others
+ */
+struct worker_queue {
+	struct queue *q;
+	struct pool *pool;       /* of the node the worker runs on */
+	unsigned int index;      /* of the worker in the queue */
+	unsigned int rank;       /* of the worker in its pool */
+	int cpu;                 /* the worker is pinned to, or -1 */
+	struct ring jobs;
+	struct parking parking;
+	atomic_int done;
+};
+
+/*
+ * the chunks and hashing states used on a NUMA node, or by everyone
+ * when we don't care. the chunks are allocated up front, so nothing
+ * is allocated while hashing. the readers sleep in the parking
+ * when all the chunks are being hashed
+ */
+struct pool {
+	struct ring free;        /* free chunks */
+	struct parking parking;
+	struct ring states;      /* states to reuse */
+	unsigned char *mem;      /* memory of the chunks */
+	size_t mem_len;
+	unsigned int buffers;    /* number of chunks */
+	unsigned int *cpus;      /* CPUs of the node, NULL if not pinned */
+	unsigned int cpu_count;
+	unsigned int node;
+	unsigned int *workers;   /* the workers on the node */
+	unsigned int worker_count;
+	atomic_uint next_worker; /* worker the next piece is given to */
+	/* what the tuner changes */
+	atomic_uint active;      /* workers given new pieces */
+	atomic_uint limit;       /* chunks the readers may use */
+	atomic_uint used;        /* chunks in use */
+	unsigned int min_buffers;/* one for every reader and one more */
+};
+
 struct queue {
-	struct piece *free;
-	struct piece *full;
-	unsigned int buffers_max;
-	unsigned int buffers;
-	pthread_mutex_t mutex_free;
-	pthread_mutex_t mutex_full;
-	pthread_cond_t cond_empty;
-	pthread_cond_t cond_full;
-	unsigned int done;
+	size_t chunk_len;
+	struct pool *pools;
+	unsigned int pool_count;
+	struct worker_queue *workers;
+	unsigned int worker_count;
 	unsigned int pieces;
-	unsigned int pieces_hashed;
+	atomic_uint pieces_hashed;
+	int json_progress;       /* print the progress as JSON lines */
+	atomic_ullong bytes_read;
+	struct governor governor;
+	struct checkpoint *cp;
+	/* the readers after the active ones wait in the parking */
+	unsigned int reader_count;
+	atomic_uint active_readers;
+	struct parking reader_parking;
+	atomic_int reading_done;
 };
 
-static struct piece *get_free(struct queue *q, size_t piece_length)
+/* fed to the SHA1 contexts in place of pad files */
+static const unsigned char zeros[V2_BLOCK_SIZE];
+
+/*
+ * take a free chunk from the pool, waiting for one if they are all
+ * being hashed
+ */
+static struct chunk *get_free(struct pool *p)
 {
-	struct piece *r;
+	struct chunk *r;
+
+	while (1) {
+		unsigned int epoch;
 
-	pthread_mutex_lock(&q->mutex_free);
-	if (q->free) {
-		r = q->free;
-		q->free = r->next;
-	} else if (q->buffers < q->buffers_max) {
-		r = malloc(sizeof(struct piece) - 1 + piece_length);
-		FATAL_IF0(r == NULL, "out of memory\n");
+		/* we may take a chunk if the pool uses fewer than
+		   the limit set by the tuner */
+		if (atomic_fetch_add(&p->used, 1) < atomic_load(&p->limit))
+			break;
 
+		atomic_fetch_sub(&p->used, 1);
+		park_wake(&p->parking);
 
-		q->buffers++;
-	} else {
-		while (q->free == NULL) {
-			pthread_cond_wait(&q->cond_full, &q->mutex_free);
+		epoch = park_prepare(&p->parking);
+		if (atomic_load(&p->used) < atomic_load(&p->limit)) {
+			park_cancel(&p->parking);
+			continue;
 		}
-
-		r = q->free;
-		q->free = r->next;
+		park_wait(&p->parking, epoch);
 	}
-	pthread_mutex_unlock(&q->mutex_free);
 
-	return r;
-}
+	while (1) {
+		unsigned int epoch;
 
-static struct piece *get_full(struct queue *q)
-{
-	struct piece *r;
+		r = ring_pop(&p->free);
+		if (r)
+			return r;
 
-	pthread_mutex_lock(&q->mutex_full);
-again:
-	if (q->full) {
-		r = q->full;
-		q->full = r->next;
-	} else if (q->done) {
-		r = NULL;
-	} else {
-		pthread_cond_wait(&q->cond_empty, &q->mutex_full);
-		goto again;
+		/* wait for a chunk to be freed, but look once more
+		   after saying so in case one was freed meanwhile */
+		epoch = park_prepare(&p->parking);
+		r = ring_pop(&p->free);
+		if (r) {
+			park_cancel(&p->parking);
+			return r;
+		}
+		park_wait(&p->parking, epoch);
 	}
-	pthread_mutex_unlock(&q->mutex_full);
+}
 
-	return r;
+/*
+ * give a chunk without jobs back to be reused
+ */
+static void free_chunk(struct chunk *c)
+{
+	/* there are never more chunks than the ring holds */
+	ring_push(&c->pool->free, c);
+	atomic_fetch_sub(&c->pool->used, 1);
+	park_wake(&c->pool->parking);
 }
 
-static void put_free(struct queue *q, struct piece *p, unsigned int hashed)
+/*
+ * mark one job on the chunk as done, the chunk is reused
+ * when all of its jobs are done
+ */
+static void put_free(struct queue *q, struct chunk *c, unsigned int hashed)
 {
-	pthread_mutex_lock(&q->mutex_free);
-	p->next = q->free;
-	q->free = p;
-	q->pieces_hashed += hashed;
-	pthread_mutex_unlock(&q->mutex_free);
-	pthread_cond_signal(&q->cond_full);
+	if (hashed)
+		atomic_fetch_add(&q->pieces_hashed, hashed);
+	if (atomic_fetch_sub(&c->jobs_left, 1) == 1)
+		free_chunk(c);
 }
 
-static void put_full(struct queue *q, struct piece *p)
+/*
+ * give a job to the worker hashing its piece, the worker is only
+ * woken if it sleeps
+ */
+static void put_job(struct queue *q, struct job *j)
 {
-	pthread_mutex_lock(&q->mutex_full);
-	p->next = q->full;
-	q->full = p;
-	pthread_mutex_unlock(&q->mutex_full);
-	pthread_cond_signal(&q->cond_empty);
+	struct worker_queue *wq = &q->workers[j->state->worker];
+
+	while (!ring_push(&wq->jobs, j))
+		sched_yield();
+	park_wake(&wq->parking);
 }
 
-static void set_done(struct queue *q)
+/*
+ * take a job from the ring of another worker, those on the same
+ * node first, starting with the next
+ */
+static struct job *steal_job(struct worker_queue *wq)
 {
-	pthread_mutex_lock(&q->mutex_full);
-	q->done = 1;
-	pthread_mutex_unlock(&q->mutex_full);
-	pthread_cond_broadcast(&q->cond_empty);
+	struct queue *q = wq->q;
+
+	/* a worker parked by the tuner only does its own jobs */
+	if (wq->rank >= atomic_load(&wq->pool->active))
+		return NULL;
+
+	for (int near = 1; near >= 0; near--)
+		for (unsigned int i = 1; i < q->worker_count; i++) {
+			struct worker_queue *other =
+				&q->workers[(wq->index + i) % q->worker_count];
+			struct job *r;
+
+			if ((other->pool == wq->pool) != near)
+				continue;
+
+			r = ring_pop(&other->jobs);
+			if (r)
+				return r;
+		}
+
+	return NULL;
 }
 
-static void free_buffers(struct queue *q)
+/*
+ * take the next job of a worker, or steal one when its ring is empty.
+ * it only sleeps when there is nothing left to do.
+ * returns NULL when we're done
+ */
+static struct job *get_job(struct worker_queue *wq)
 {
-	struct piece *first = q->free;
+	struct job *r;
+
+	while (1) {
+		unsigned int epoch;
+		int done;
+
+		r = ring_pop(&wq->jobs);
+		if (r == NULL)
+			r = steal_job(wq);
+		if (r)
+			return r;
 
-	while (first) {
-		struct piece *p = first;
-		first = p->next;
-		free(p);
+		epoch = park_prepare(&wq->parking);
+		done = atomic_load(&wq->done);
+		r = ring_pop(&wq->jobs);
+		if (r || done) {
+			park_cancel(&wq->parking);
+			return r;
+		}
+		park_wait(&wq->parking, epoch);
 	}
+}
+
+static void set_done(struct queue *q)
+{
+	for (unsigned int i = 0; i < q->worker_count; i++) {
+		struct worker_queue *wq = &q->workers[i];
 
-	q->free = NULL;
+		atomic_store(&wq->done, 1);
+		park_wake(&wq->parking);
+	}
 }
 
 /*
@@ -180,7 +388,12 @@ static void *print_progress(void *data)
 
 	while (1) {
 		/* print progress and flush the buffer immediately */
-		printf("\rHashed %u of %u pieces.", q->pieces_hashed, q->pieces);
+		if (q->json_progress)
+			printf("{\"hashed\": %u, \"pieces\": %u}\n",
+				atomic_load(&q->pieces_hashed), q->pieces);
+		else
+			printf("\rHashed %u of %u pieces.",
+				atomic_load(&q->pieces_hashed), q->pieces);
 		fflush(stdout);
 		/* now sleep for PROGRESS_PERIOD microseconds */
 		nanosleep(&t, NULL);
@@ -191,124 +404,1082 @@ static void *print_progress(void *data)
 
 static void *worker(void *data)
 {
-	struct queue *q = data;
-	struct piece *p;
-	SHA_CTX c;
+	struct worker_queue *wq = data;
+	struct job *j;
+
+	if (wq->cpu >= 0) {
+		unsigned int cpu = wq->cpu;
 
-	while ((p = get_full(q))) {
-		SHA1_Init(&c);
-		SHA1_Update(&c, p->data, p->len);
-		SHA1_Final(p->dest, &c);
-		put_free(q, p, 1);
+		pin_thread(&cpu, 1);
+	}
+
+	while ((j = get_job(wq))) {
+		struct chunk *c = j->chunk;
+		struct state *s = j->state;
+		int last = j->last;
+		int piece = j->set != SET_SUMS;
+
+		/* the chunk before this one is taken from the same ring
+		   first, but it may still be hashed by another worker */
+		while (atomic_load_explicit(&s->next, memory_order_acquire)
+				!= j->seq)
+			sched_yield();
+
+		if (j->set == SET_V2) {
+			merkle_add_blocks(&s->u.t, c->data, c->len);
+			if (last)
+				merkle_root(&s->u.t, s->dest, s->height);
+		} else if (j->set == SET_SUMS)
+			checksum_update(&s->u.s, c->data, c->len);
+		else {
+			SHA1_Update(&s->u.c, c->data, c->len);
+
+			for (unsigned long pad = j->pad; pad > 0; ) {
+				unsigned long n = pad < sizeof(zeros) ? pad : sizeof(zeros);
+
+				SHA1_Update(&s->u.c, zeros, n);
+				pad -= n;
+			}
+
+			if (last)
+				SHA1_Final(s->dest, &s->u.c);
+		}
+
+		/* keep the state for another piece */
+		if (last) {
+			if (piece)
+				checkpoint_piece(wq->q->cp, s->unit);
+			if (!ring_push(&s->pool->states, s))
+				free(s);
+		} else
+			atomic_store_explicit(&s->next, j->seq + 1,
+				memory_order_release);
+
+		put_free(wq->q, c, last && piece ? 1 : 0);
 	}
 
 	return NULL;
 }
 
-static void read_files(struct metafile *m, struct queue *q, unsigned char *pos)
+/*
+ * the chunks read one after the other, either from a segment of all
+ * the files or from a single file starting a new piece
+ */
+struct stream {
+	struct metafile *m;
+	struct queue *q;
+	struct pool *pool;          /* of the node the reader runs on */
+	struct state *state[SETS];  /* piece being hashed in every set */
+	unsigned char *pos[SETS];   /* where the next piece hash goes */
+	uintmax_t offset;           /* offset of the next chunk */
+	uintmax_t unit;             /* piece of the largest length it starts */
+	unsigned int height;        /* height of the trees of the v2 pieces */
+	struct ll_node *sum_node;   /* file the checksums start with */
+	struct chunk *c;            /* chunk being read into */
+	size_t r;                   /* number of bytes in the chunk */
+	uintmax_t counter;          /* number of bytes read */
+};
+
+/*
+ * start hashing the next piece of a set, the pieces are given
+ * to the workers on the node of the reader in turn
+ */
+static struct state *new_state(struct stream *s, unsigned int set)
 {
+	struct pool *p = s->pool;
+	struct state *st = ring_pop(&p->states);
+
+	if (st == NULL) {
+		st = malloc(sizeof(*st));
+		FATAL_IF0(st == NULL, "out of memory\n");
+		st->pool = p;
+	}
+
+	st->dest = s->pos[set];
+	st->unit = s->unit + s->offset / s->q->cp->unit_len;
+	if (set == SET_V2) {
+		merkle_init(&st->u.t);
+		st->height = s->height;
+		s->pos[set] += SHA256_DIGEST_LENGTH;
+	} else if (set == SET_SUMS)
+		checksum_init(&st->u.s, s->m->checksums, s->sum_node);
+	else {
+		SHA1_Init(&st->u.c);
+		s->pos[set] += SHA_DIGEST_LENGTH;
+	}
+	st->worker = p->workers[atomic_fetch_add(&p->next_worker, 1)
+		% atomic_load(&p->active)];
+	st->queued = 0;
+	atomic_init(&st->next, 0);
+
+	return st;
+}
+
+/*
+ * queue a job for the chunk in every set, when the stream ends with
+ * it the pieces end too, and the v1 pieces are followed by pad zeros.
+ * the files of the stream are summed from its first chunk to its end
+ */
+static void queue_chunk(struct stream *s, struct chunk *c, size_t len,
+		int end, unsigned long pad)
+{
+	struct metafile *m = s->m;
+	struct job *jobs[SETS];
+	unsigned int n = 0;
+
+	c->len = len;
+
+	for (unsigned int i = 0; i < SETS; i++) {
+		struct job *j = &c->jobs[i];
+		unsigned long piece_length;
+		int starts, ends;
+
+		if (i == SET_SUMS) {
+			if (!m->checksums)
+				continue;
+			starts = s->offset == 0;
+			ends = end;
+		} else {
+			if (i == SET_V2) {
+				if (!(m->meta_version & META_V2))
+					continue;
+				piece_length = m->piece_length;
+			} else {
+				if (!(m->meta_version & META_V1)
+						|| i >= m->piece_length_count)
+					continue;
+				piece_length = m->piece_lengths[i];
+			}
+			starts = s->offset % piece_length == 0;
+			ends = end || (s->offset + len) % piece_length == 0;
+		}
+
+		/* the chunk starts a new piece, unless there is no data */
+		if (starts) {
+			if (len == 0)
+				continue;
+			s->state[i] = new_state(s, i);
+		}
+
+		j->state = s->state[i];
+		j->seq = j->state->queued++;
+		j->last = ends;
+		j->pad = (i < SET_V2 && j->last) ? pad : 0;
+		jobs[n++] = j;
+	}
+
+	s->offset += len;
+	atomic_fetch_add(&s->q->bytes_read, len);
+
+	if (n == 0) {
+		free_chunk(c);
+		return;
+	}
+
+	atomic_store(&c->jobs_left, n);
+	for (unsigned int i = 0; i < n; i++)
+		put_job(s->q, jobs[i]);
+}
+
+/*
+ * read len bytes of a file from the given offset into the chunks
+ * of the stream, queueing them as they are filled
+ */
+static void read_range(struct stream *s, const char *path,
+		uintmax_t from, uintmax_t len)
+{
+	struct queue *q = s->q;
 	int fd;                /* file descriptor */
-	size_t r = 0;          /* number of bytes read from file(s)
-	                          into the read buffer */
-#ifndef NO_HASH_CHECK
-	uintmax_t counter = 0; /* number of bytes hashed
-	                          should match size when done */
-#endif
-	struct piece *p = get_free(q, m->piece_length);
 
-	/* go through all the files in the file list */
+	/* open the file for reading */
+	FATAL_IF((fd = open(path, OPENFLAGS)) == -1,
+		"cannot open '%s' for reading: %s\n", path, strerror(errno));
+	FATAL_IF(from && lseek(fd, from, SEEK_SET) == (off_t) -1,
+		"cannot seek in '%s': %s\n", path, strerror(errno));
+
+	while (len && !checkpoint_interrupted()) {
+		size_t n = q->chunk_len - s->r;
+		ssize_t d;
+
+		if (n > len)
+			n = len;
+
+		d = read(fd, s->c->data + s->r, n);
+		FATAL_IF(d < 0, "cannot read from '%s': %s\n",
+			path, strerror(errno));
+
+		if (d == 0) /* end of file */
+			break;
+
+		s->r += d;
+		s->counter += d;
+		len -= d;
+		govern_read(&q->governor, d);
+
+		if (s->r == q->chunk_len) {
+			queue_chunk(s, s->c, s->r, 0, 0);
+			s->r = 0;
+			s->c = get_free(s->pool);
+			checkpoint_update(q->cp);
+		}
+	}
+
+	/* now close the file */
+	FATAL_IF(close(fd), "cannot close '%s': %s\n",
+		path, strerror(errno));
+}
+
+static void init_stream(struct stream *s, struct metafile *m,
+		struct queue *q, struct pool *p)
+{
+	memset(s, 0, sizeof(*s));
+	s->m = m;
+	s->q = q;
+	s->pool = p;
+	s->c = get_free(p);
+}
+
+/*
+ * end the last pieces of a stream with what is left in its chunk,
+ * unless we've been interrupted and the pieces are left unfinished
+ */
+static void end_stream(struct stream *s, int end, unsigned long pad)
+{
+	if (checkpoint_interrupted())
+		free_chunk(s->c);
+	else
+		queue_chunk(s, s->c, s->r, end, pad);
+}
+
+/*
+ * read pieces of the files as one stream of chunks, a piece may
+ * span the end of one file and the beginning of the next.
+ * the range starts on a piece boundary of every piece length
+ * and ends on one too, unless it ends the content.
+ * returns the number of bytes read
+ */
+static uintmax_t read_pieces(struct metafile *m, struct queue *q,
+		struct pool *p, unsigned char **pos, uintmax_t start, uintmax_t end)
+{
+	struct stream s;
+	uintmax_t file_start = 0;
+
+	init_stream(&s, m, q, p);
+	s.unit = start / q->cp->unit_len;
+	for (unsigned int i = 0; i < m->piece_length_count; i++)
+		s.pos[i] = pos[i] + start / m->piece_lengths[i] * SHA_DIGEST_LENGTH;
+
+	/* go through the files in the segment */
 	LL_FOR(file_node, m->file_list) {
 		struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+		uintmax_t file_end = file_start + f->size;
+		/* read the first copy of a duplicate, it may still be cached */
+		const char *path = f->dup ? f->dup->path : f->path;
 
-		/* open the current file for reading */
-		FATAL_IF((fd = open(f->path, OPENFLAGS)) == -1,
-			"cannot open '%s' for reading: %s\n", f->path, strerror(errno));
+		if (file_start >= end)
+			break;
 
-		while (1) {
-			ssize_t d = read(fd, p->data + r, m->piece_length - r);
+		if (file_end > start) {
+			uintmax_t from = start > file_start ? start - file_start : 0;
+			uintmax_t to = (end < file_end ? end : file_end) - file_start;
 
-			FATAL_IF(d < 0, "cannot read from '%s': %s\n",
-				f->path, strerror(errno));
+			/* the files are only summed when the stream
+			   starts at the beginning of one */
+			if (s.sum_node == NULL)
+				s.sum_node = file_node;
+			read_range(&s, path, from, to - from);
+		}
 
-			if (d == 0) /* end of file */
-				break;
+		file_start = file_end;
+	}
 
-			r += d;
+	/* finally end the last pieces with what is left */
+	end_stream(&s, end == m->size, 0);
 
-			if (r == m->piece_length) {
-				p->dest = pos;
-				p->len = m->piece_length;
-				put_full(q, p);
-				pos += SHA_DIGEST_LENGTH;
-#ifndef NO_HASH_CHECK
-				counter += r;
-#endif
-				r = 0;
-				p = get_free(q, m->piece_length);
-			}
+	return s.counter;
+}
+
+/*
+ * skip the pieces done before we resumed, or copied from a duplicate,
+ * they are counted as hashed from the start. returns the number of bytes
+ * up to the next piece to read
+ */
+static uintmax_t skip_done(struct queue *q, uintmax_t unit, uintmax_t len)
+{
+	struct checkpoint *cp = q->cp;
+	uintmax_t r = 0;
+
+	while (r < len && checkpoint_skipped(cp, unit)) {
+		r += cp->unit_len;
+		unit++;
+	}
+
+	return r < len ? r : len;
+}
+
+/*
+ * the length of the pieces to read before the next one skipped,
+ * starting with the given one
+ */
+static uintmax_t pieces_to_read(struct checkpoint *cp, uintmax_t unit,
+		uintmax_t len)
+{
+	uintmax_t r = 0;
+
+	while (r < len && !checkpoint_skipped(cp, unit)) {
+		r += cp->unit_len;
+		unit++;
+	}
+
+	return r < len ? r : len;
+}
+
+/*
+ * read a segment of the stream of all the files, but for the pieces
+ * done before we resumed. the segment starts on a piece boundary
+ * of every piece length and ends on one too, unless it ends the
+ * content. returns the number of bytes read
+ */
+static uintmax_t read_segment(struct metafile *m, struct queue *q,
+		struct pool *p, unsigned char **pos, uintmax_t start, uintmax_t end)
+{
+	uintmax_t unit_len = q->cp->unit_len;
+	uintmax_t counter = 0;
+
+	while (start < end && !checkpoint_interrupted()) {
+		uintmax_t n = skip_done(q, start / unit_len, end - start);
+
+		counter += n;
+		start += n;
+		if (start == end)
+			break;
+
+		n = pieces_to_read(q->cp, start / unit_len, end - start);
+		counter += read_pieces(m, q, p, pos, start, start + n);
+		start += n;
+	}
+
+	return counter;
+}
+
+/*
+ * read pieces of a file starting on a piece boundary, the last piece
+ * of the file is hashed on its own. in v1 it is followed by a pad
+ * file of zeros, unless it is the last file.
+ * returns the number of bytes read
+ */
+static uintmax_t read_file_pieces(struct metafile *m, struct queue *q,
+		struct pool *p, struct ll_node *file_node,
+		unsigned char *hash_v1, unsigned char *hash_v2,
+		uintmax_t from, uintmax_t to)
+{
+	struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+	struct stream s;
+	uintmax_t piece = f->piece + from / m->piece_length;
+	unsigned long pad = 0; /* length of the pad file after the file */
+
+	init_stream(&s, m, q, p);
+	s.unit = piece;
+	s.pos[0] = hash_v1 + piece * SHA_DIGEST_LENGTH;
+	s.pos[SET_V2] = hash_v2 + piece * SHA256_DIGEST_LENGTH;
+	s.height = merkle_piece_height(m, f->size);
+	s.sum_node = file_node;
+
+	read_range(&s, f->path, from, to - from);
+
+	if (LL_NEXT(file_node) && f->size % m->piece_length)
+		pad = m->piece_length - f->size % m->piece_length;
+
+	if (to == f->size)
+		end_stream(&s, 1, pad);
+	else
+		end_stream(&s, 0, 0);
+
+	return s.counter;
+}
+
+/*
+ * read a file starting on a piece boundary, but for the pieces
+ * done before we resumed. returns the number of bytes read
+ */
+static uintmax_t read_file(struct metafile *m, struct queue *q,
+		struct pool *p, struct ll_node *file_node,
+		unsigned char *hash_v1, unsigned char *hash_v2)
+{
+	struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+	uintmax_t counter = 0;
+	uintmax_t from = 0;
+
+	while (from < f->size && !checkpoint_interrupted()) {
+		uintmax_t n = skip_done(q, f->piece + from / m->piece_length,
+			f->size - from);
+
+		counter += n;
+		from += n;
+		if (from == f->size)
+			break;
+
+		n = pieces_to_read(q->cp, f->piece + from / m->piece_length,
+			f->size - from);
+		counter += read_file_pieces(m, q, p, file_node,
+			hash_v1, hash_v2, from, from + n);
+		from += n;
+	}
+
+	return counter;
+}
+
+/*
+ * the readers take the next segment of the content to read, or when
+ * every file starts a new piece, the next file from the list.
+ * the hashes of a segment or file go after those before it,
+ * and those of a duplicate are copied when all are done
+ */
+struct readers {
+	struct metafile *m;
+	struct queue *q;
+	unsigned char **pos;     /* hash strings and v2 piece hashes */
+	uintmax_t segment;       /* size of the segments */
+	pthread_mutex_t mutex;
+	struct ll_node *next;    /* next file to read */
+	uintmax_t offset;        /* start of the next segment */
+	uintmax_t counter;       /* number of bytes read */
+};
+
+/*
+ * a reader reads into the chunks of the node it runs on
+ */
+struct reader {
+	struct readers *rd;
+	struct pool *pool;
+	unsigned int index;
+	pthread_t thread;
+};
+
+/*
+ * wait while the tuner doesn't want the reader to read,
+ * returns 0 when there is nothing left to read, or we've
+ * been interrupted
+ */
+static int reader_turn(struct reader *r)
+{
+	struct queue *q = r->rd->q;
+
+	while (1) {
+		unsigned int epoch;
+
+		if (atomic_load(&q->reading_done) || checkpoint_interrupted())
+			return 0;
+		if (r->index < atomic_load(&q->active_readers))
+			return 1;
+
+		epoch = park_prepare(&q->reader_parking);
+		if (atomic_load(&q->reading_done) ||
+				r->index < atomic_load(&q->active_readers)) {
+			park_cancel(&q->reader_parking);
+			continue;
 		}
+		park_wait(&q->reader_parking, epoch);
+	}
+}
+
+/*
+ * read the next file when every file starts a new piece,
+ * returns 0 when there are no more
+ */
+static int read_next_file(struct reader *r, uintmax_t *counter)
+{
+	struct readers *rd = r->rd;
+	struct metafile *m = rd->m;
+	struct ll_node *file_node;
+	struct file_data *f;
+
+	pthread_mutex_lock(&rd->mutex);
+	file_node = rd->next;
+	if (file_node)
+		rd->next = LL_NEXT(file_node);
+	pthread_mutex_unlock(&rd->mutex);
+
+	if (file_node == NULL)
+		return 0;
+
+	f = LL_DATA_AS(file_node, struct file_data*);
+
+	/* its pieces are copied, and counted from the start */
+	if (is_duplicate(m, file_node))
+		*counter = f->size;
+	else
+		*counter = read_file(m, rd->q, r->pool, file_node,
+			rd->pos[0], rd->pos[SET_V2]);
+
+	return 1;
+}
+
+/*
+ * read the next segment of the stream of all the files,
+ * returns 0 when there are no more
+ */
+static int read_next_segment(struct reader *r, uintmax_t *counter)
+{
+	struct readers *rd = r->rd;
+	struct metafile *m = rd->m;
+	uintmax_t start;
+	uintmax_t end;
+
+	pthread_mutex_lock(&rd->mutex);
+	start = rd->offset;
+	rd->offset += rd->segment;
+	pthread_mutex_unlock(&rd->mutex);
+
+	if (start >= m->size)
+		return 0;
+
+	end = m->size - start > rd->segment ? start + rd->segment : m->size;
+	*counter = read_segment(m, rd->q, r->pool, rd->pos, start, end);
+
+	return 1;
+}
 
-		/* now close the file */
-		FATAL_IF(close(fd), "cannot close '%s': %s\n",
-			f->path, strerror(errno));
+static void *reader(void *data)
+{
+	struct reader *r = data;
+	struct readers *rd = r->rd;
+	uintmax_t counter;
+
+	if (r->pool->cpus)
+		pin_thread(r->pool->cpus, r->pool->cpu_count);
+
+	while (reader_turn(r) && (rd->m->pad_files ?
+			read_next_file(r, &counter) :
+			read_next_segment(r, &counter))) {
+		pthread_mutex_lock(&rd->mutex);
+		rd->counter += counter;
+		pthread_mutex_unlock(&rd->mutex);
 	}
 
-	/* finally append the hash of the last irregular piece to the hash string */
-	if (r) {
-		p->dest = pos;
-		p->len = r;
-		put_full(q, p);
-	} else
-		put_free(q, p, 0);
+	/* let the readers waiting for their turn know we're done */
+	atomic_store(&rd->q->reading_done, 1);
+	park_wake(&rd->q->reader_parking);
+
+	return NULL;
+}
+
+static void read_files(struct metafile *m, struct queue *q,
+		unsigned char **pos, long n)
+{
+	struct readers rd = {
+		m, q, pos, SEGMENT_SIZE,
+		PTHREAD_MUTEX_INITIALIZER,
+		LL_HEAD(m->file_list), 0, 0
+	};
+	struct reader *readers;
+	long i;
+	int err;
+
+	/* the segments hold whole pieces of every piece length, a single
+	   reader reads the stream in one go */
+	for (unsigned int j = 0; j < m->piece_length_count; j++)
+		if (rd.segment % m->piece_lengths[j])
+			rd.segment += m->piece_lengths[j]
+				- rd.segment % m->piece_lengths[j];
+	if (n == 1)
+		rd.segment = m->size ? m->size : 1;
+
+	readers = malloc(n * sizeof(struct reader));
+	FATAL_IF0(readers == NULL, "out of memory\n");
+
+	/* the readers are spread over the nodes */
+	for (i = 0; i < n; i++) {
+		readers[i].rd = &rd;
+		readers[i].pool = &q->pools[i % q->pool_count];
+		readers[i].index = i;
+
+		err = pthread_create(&readers[i].thread, NULL, reader,
+			&readers[i]);
+		FATAL_IF(err, "cannot create thread: %s\n", strerror(err));
+	}
+
+	for (i = 0; i < n; i++) {
+		err = pthread_join(readers[i].thread, NULL);
+		FATAL_IF(err, "cannot join thread: %s\n", strerror(err));
+	}
+
+	free(readers);
+	pthread_mutex_destroy(&rd.mutex);
 
 #ifndef NO_HASH_CHECK
-	counter += r;
-	FATAL_IF(counter != m->size,
+	FATAL_IF(rd.counter != m->size && !checkpoint_interrupted(),
 		"counted %" PRIuMAX " bytes, but hashed %" PRIuMAX " bytes; "
 		"something is wrong...\n",
-			m->size, counter);
+			m->size, rd.counter);
 #endif
 }
 
+/*
+ * set up a pool for every NUMA node the workers run on, or a single
+ * pool unless asked to care. the buffers are shared out by the number
+ * of workers on the node, but every reader needs one to read into
+ * while the others are hashed
+ */
+static void init_pools(struct metafile *m, struct queue *q,
+		uintmax_t buffers_max, unsigned int sets, long readers)
+{
+	size_t stride = (sizeof(struct chunk) - 1 + q->chunk_len
+		+ CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+	unsigned int *nodes = NULL;      /* node of every CPU given */
+	unsigned int *worker_pool;       /* pool of every worker */
+	unsigned int i;
+
+	if (m->cpus && m->numa)
+		nodes = cpu_nodes(m->cpus, m->cpu_count);
+
+	q->pools = calloc(q->worker_count, sizeof(struct pool));
+	worker_pool = malloc(q->worker_count * sizeof(*worker_pool));
+	FATAL_IF0(q->pools == NULL || worker_pool == NULL, "out of memory\n");
+
+	/* the workers are pinned to the CPUs given in turn */
+	for (i = 0; i < q->worker_count; i++) {
+		struct worker_queue *wq = &q->workers[i];
+		unsigned int node = nodes ? nodes[i % m->cpu_count] : 0;
+		unsigned int j;
+
+		wq->cpu = m->cpus ? (int) m->cpus[i % m->cpu_count] : -1;
+
+		for (j = 0; j < q->pool_count; j++)
+			if (q->pools[j].node == node)
+				break;
+		if (j == q->pool_count)
+			q->pools[q->pool_count++].node = node;
+
+		worker_pool[i] = j;
+		q->pools[j].worker_count++;
+	}
+
+	for (unsigned int j = 0; j < q->pool_count; j++) {
+		struct pool *p = &q->pools[j];
+		long pool_readers = readers / q->pool_count
+			+ ((long) j < readers % q->pool_count);
+		size_t states_max;
+
+		p->workers = malloc(p->worker_count * sizeof(*p->workers));
+		FATAL_IF0(p->workers == NULL, "out of memory\n");
+		p->worker_count = 0;
+		for (i = 0; i < q->worker_count; i++)
+			if (worker_pool[i] == j) {
+				q->workers[i].pool = p;
+				q->workers[i].rank = p->worker_count;
+				p->workers[p->worker_count++] = i;
+			}
+		atomic_init(&p->next_worker, 0);
+		atomic_init(&p->active, p->worker_count);
+
+		/* the readers of the node run on all of its CPUs */
+		if (m->cpus) {
+			p->cpus = malloc(m->cpu_count * sizeof(*p->cpus));
+			FATAL_IF0(p->cpus == NULL, "out of memory\n");
+			for (i = 0; i < m->cpu_count; i++)
+				if (nodes == NULL || nodes[i] == p->node)
+					p->cpus[p->cpu_count++] = m->cpus[i];
+		}
+
+		p->min_buffers = pool_readers + 1;
+		p->buffers = buffers_max * p->worker_count / q->worker_count;
+		if (p->buffers < p->min_buffers)
+			p->buffers = p->min_buffers;
+		atomic_init(&p->limit, p->buffers);
+		atomic_init(&p->used, 0);
+
+		p->mem_len = stride * p->buffers;
+		p->mem = pool_alloc(&p->mem_len, p->cpus, p->cpu_count);
+
+		ring_init(&p->free, p->buffers);
+		parking_init(&p->parking);
+		for (i = 0; i < p->buffers; i++) {
+			struct chunk *c = (struct chunk *) (p->mem + i * stride);
+
+			c->pool = p;
+			for (unsigned int k = 0; k < SETS; k++) {
+				c->jobs[k].chunk = c;
+				c->jobs[k].set = k;
+			}
+			ring_push(&p->free, c);
+		}
+
+		/* a state lives until the last chunk of its piece
+		   is hashed, and every reader has one for every set */
+		states_max = (size_t) (p->buffers + pool_readers) * sets;
+		ring_init(&p->states, states_max < MAX_JOBS ? states_max : MAX_JOBS);
+	}
+
+	free(worker_pool);
+	free(nodes);
+}
+
+static void free_pools(struct queue *q)
+{
+	for (unsigned int j = 0; j < q->pool_count; j++) {
+		struct pool *p = &q->pools[j];
+		struct state *st;
+
+		while ((st = ring_pop(&p->states)))
+			free(st);
+
+		ring_destroy(&p->states);
+		ring_destroy(&p->free);
+		parking_destroy(&p->parking);
+		pool_free(p->mem, p->mem_len);
+		free(p->workers);
+		free(p->cpus);
+	}
+
+	free(q->pools);
+}
+
+/*
+ * the tuner measures how fast the content is read while hashing, and
+ * climbs towards the number of workers, readers and chunks in use
+ * that reads it the fastest. whether the readers wait for chunks or
+ * the workers for jobs tells what to try next
+ */
+struct tuner {
+	struct queue *q;
+	unsigned int workers;    /* number of active workers */
+	unsigned int readers;    /* number of active readers */
+	unsigned int shift;      /* the pools use 1/2^shift of their chunks */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stop;
+	pthread_t thread;
+};
+
+enum tune_move { MOVE_NONE, MORE_WORKERS, FEWER_WORKERS, MORE_READERS,
+	MORE_BUFFERS, FEWER_BUFFERS };
+
+/*
+ * make the changes of the tuner, or undo them
+ */
+static int tune(struct tuner *t, enum tune_move move, int undo)
+{
+	struct queue *q = t->q;
+	int d = undo ? -1 : 1;
+
+	switch (move) {
+	case MORE_WORKERS:
+	case FEWER_WORKERS:
+		if (move == FEWER_WORKERS)
+			d = -d;
+		if (t->workers + d < 1 || t->workers + d > q->worker_count)
+			return 0;
+		t->workers += d;
+		break;
+	case MORE_READERS:
+		if (t->readers + d < 1 || t->readers + d > q->reader_count)
+			return 0;
+		t->readers += d;
+		atomic_store(&q->active_readers, t->readers);
+		park_wake(&q->reader_parking);
+		return 1;
+	case MORE_BUFFERS:
+	case FEWER_BUFFERS:
+		if (move == MORE_BUFFERS)
+			d = -d;
+		if (t->shift + d > BUFFER_SHIFT_MAX)
+			return 0;
+		t->shift += d;
+		break;
+	case MOVE_NONE:
+		return 0;
+	}
+
+	/* share the workers and chunks out over the pools */
+	for (unsigned int j = 0; j < q->pool_count; j++) {
+		struct pool *p = &q->pools[j];
+		unsigned int active = (p->worker_count * t->workers
+			+ q->worker_count - 1) / q->worker_count;
+		unsigned int limit = p->buffers >> t->shift;
+
+		atomic_store(&p->active, active ? active : 1);
+		atomic_store(&p->limit,
+			limit > p->min_buffers ? limit : p->min_buffers);
+		park_wake(&p->parking);
+	}
+
+	return 1;
+}
+
+/*
+ * the number of chunks the pools may use
+ */
+static size_t tuned_buffers(struct queue *q)
+{
+	size_t r = 0;
+
+	for (unsigned int j = 0; j < q->pool_count; j++)
+		r += atomic_load(&q->pools[j].limit);
+
+	return r;
+}
+
+static void *tuner(void *data)
+{
+	struct tuner *t = data;
+	struct queue *q = t->q;
+	enum tune_move move = MOVE_NONE;  /* the change being measured */
+	enum tune_move next = MOVE_NONE;  /* the change to try again */
+	double best = 0;                  /* the rate before the change */
+	unsigned long long last = 0;
+	struct timespec then;
+	unsigned int turn = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &then);
+
+	pthread_mutex_lock(&t->mutex);
+	while (!t->stop) {
+		struct timespec now;
+		struct timespec until;
+		unsigned long long bytes;
+		unsigned int starved = 0;   /* readers waiting for chunks */
+		unsigned int idle = 0;      /* workers waiting for jobs */
+		double rate;
+
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += TUNE_PERIOD % 1000000 * 1000;
+		until.tv_sec += TUNE_PERIOD / 1000000
+			+ until.tv_nsec / 1000000000;
+		until.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&t->cond, &t->mutex, &until);
+		if (t->stop)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		bytes = atomic_load(&q->bytes_read);
+		rate = (bytes - last) / ((now.tv_sec - then.tv_sec)
+			+ (now.tv_nsec - then.tv_nsec) / 1e9);
+		last = bytes;
+		then = now;
+
+		for (unsigned int j = 0; j < q->pool_count; j++)
+			starved += atomic_load(&q->pools[j].parking.waiting);
+		for (unsigned int i = 0; i < q->worker_count; i++)
+			idle += atomic_load(&q->workers[i].parking.waiting);
+
+		/* keep a change that made us faster, or one that parked
+		   something without making us slower */
+		if (move != MOVE_NONE) {
+			int better = (move == FEWER_WORKERS || move == FEWER_BUFFERS) ?
+				rate >= best * 0.95 : rate > best * 1.05;
+
+			if (!better) {
+				tune(t, move, 1);
+				move = next = MOVE_NONE;
+				/* measure the rate without it first */
+				continue;
+			}
+			next = move;
+		}
+		best = rate;
+
+		/* try the same again, or what the waiting suggests,
+		   or every now and then whether we can do with less */
+		move = next;
+		if (move == MOVE_NONE) {
+			if (starved && idle == 0)
+				move = MORE_WORKERS;
+			else if (idle && !starved)
+				move = t->readers < q->reader_count ?
+					MORE_READERS : MORE_BUFFERS;
+			else
+				move = turn++ % 2 ? FEWER_BUFFERS : FEWER_WORKERS;
+		}
+
+		if (!tune(t, move, 0))
+			move = next = MOVE_NONE;
+	}
+	pthread_mutex_unlock(&t->mutex);
+
+	return NULL;
+}
+
+/*
+ * hash the content with every piece length in a single read,
+ * the hash strings are returned one after the other in the
+ * order of piece_lengths, followed by the v2 piece hashes
+ */
 EXPORT unsigned char *make_hash(struct metafile *m)
 {
-	struct queue q = {
-		NULL, NULL, 0, 0,
-		PTHREAD_MUTEX_INITIALIZER,
-		PTHREAD_MUTEX_INITIALIZER,
-		PTHREAD_COND_INITIALIZER,
-		PTHREAD_COND_INITIALIZER,
-		0, 0, 0
-	};
+	struct queue q;
+	struct checkpoint cp;			/* the pieces done so far */
+	struct cache cache;			/* hashes of the files
+						   hashed before */
+	struct update update;			/* hashes of the torrent
+						   we update */
+	struct verify verify;			/* the torrent we check
+						   against */
 	pthread_t print_progress_thread;	/* progress printer thread */
 	pthread_t *workers;
 	unsigned char *hash_string;		/* the hash string */
+	unsigned char *pos[SETS] = { NULL };	/* position in the hash string
+						   of every piece length
+						   and of the v2 pieces */
+	uintmax_t v1_pieces = 0;		/* number of v1 pieces */
+	long readers = m->readers;		/* number of reader threads */
+	long active_readers;			/* number of them reading */
+	struct tuner t;				/* the tuner, if any */
+	size_t tuned_chunks = 0;		/* chunks it ended up using */
+	unsigned int sets = 0;			/* number of sets hashed */
+	uintmax_t buffers_max;			/* number of chunks */
+	size_t jobs_max;			/* size of the job rings */
 	int i;
 	int err;
 
+	memset(&q, 0, sizeof(q));
+	q.chunk_len = CHUNK_SIZE;
+	atomic_init(&q.pieces_hashed, 0);
+	q.json_progress = m->machine_readable;
+	atomic_init(&q.bytes_read, 0);
+	governor_init(&q.governor, m);
+	atomic_init(&q.reading_done, 0);
+	parking_init(&q.reader_parking);
+
+	/* a chunk is never larger than a piece, so it is part of
+	   a single piece of every piece length */
+	for (unsigned int j = 0; j < m->piece_length_count; j++) {
+		/* pad files add to the pieces of every file but the last */
+		if (m->meta_version & META_V1) {
+			v1_pieces += m->pad_files ? m->pieces :
+				(m->size + m->piece_lengths[j] - 1) / m->piece_lengths[j];
+			sets++;
+		}
+		if (m->piece_lengths[j] < q.chunk_len)
+			q.chunk_len = m->piece_lengths[j];
+	}
+	q.pieces = v1_pieces + m->v2_pieces;
+	if (m->meta_version & META_V2)
+		sets++;
+	if (m->checksums)
+		sets++;
+
+	/* by default the stream of all the files is read by one reader,
+	   and several files are read at the same time when every file
+	   starts a new piece */
+	if (readers == 0)
+		readers = m->pad_files && m->threads > 1 ?
+			(m->threads < MAX_READERS ? m->threads : MAX_READERS) : 1;
+
+	/* the tuner starts there, but may use up to MAX_READERS
+	   unless told otherwise */
+	active_readers = readers;
+	if (m->adaptive && m->readers == 0 && readers < MAX_READERS)
+		readers = MAX_READERS;
+	q.reader_count = readers;
+	atomic_init(&q.active_readers, active_readers);
+
 	workers = malloc(m->threads * sizeof(pthread_t));
-	hash_string = malloc(m->pieces * SHA_DIGEST_LENGTH);
-	FATAL_IF0(workers == NULL || hash_string == NULL, "out of memory\n");
+	q.workers = malloc(m->threads * sizeof(struct worker_queue));
+	hash_string = malloc((size_t) v1_pieces * SHA_DIGEST_LENGTH
+		+ (size_t) m->v2_pieces * SHA256_DIGEST_LENGTH + 1);
+	FATAL_IF0(workers == NULL || q.workers == NULL || hash_string == NULL,
+		"out of memory\n");
+
+	/* the hash strings of the piece lengths follow each other */
+	pos[0] = hash_string;
+	for (unsigned int j = 1; j < m->piece_length_count; j++)
+		pos[j] = pos[j - 1] + SHA_DIGEST_LENGTH *
+			((m->size + m->piece_lengths[j - 1] - 1) / m->piece_lengths[j - 1]);
+	pos[SET_V2] = hash_string + v1_pieces * SHA_DIGEST_LENGTH;
+
+	/* take the pieces done from the run we resume,
+	   and those of unchanged files from the cache */
+	checkpoint_open(&cp, m, hash_string);
+	find_copied_units(m, &cp);
+	cache_open(&cache, m);
+	cache_fill(&cache, &cp);
+	update_open(&update, m);
+	update_fill(&update, &cp);
+	verify_open(&verify, m, &cp);
+	q.cp = &cp;
+
+	/* the progress starts with the pieces we don't hash again */
+	atomic_store(&q.pieces_hashed, checkpoint_pieces_done(&cp));
+
+	/* the chunks may use the memory given, but no more than
+	   it takes to hold the content */
+	buffers_max = (uintmax_t) (m->memory ? m->memory : m->threads)
+		* ONEMEG / q.chunk_len;
+	if (buffers_max > m->size / q.chunk_len + readers)
+		buffers_max = m->size / q.chunk_len + readers;
+
+	/* every chunk may have a job for every set waiting
+	   for the same worker */
+	jobs_max = (size_t) buffers_max * sets;
+	if (jobs_max > MAX_JOBS)
+		jobs_max = MAX_JOBS;
+
+	/* set up the rings of all the workers before any of them
+	   may steal from the others */
+	q.worker_count = m->threads;
+	for (i = 0; i < m->threads; i++) {
+		struct worker_queue *wq = &q.workers[i];
+
+		wq->q = &q;
+		wq->index = i;
+		ring_init(&wq->jobs, jobs_max);
+		parking_init(&wq->parking);
+		atomic_init(&wq->done, 0);
+	}
 
-	q.pieces = m->pieces;
-	q.buffers_max = 3*m->threads;
+	init_pools(m, &q, buffers_max, sets, readers);
 
 	/* create worker threads */
 	for (i = 0; i < m->threads; i++) {
-		err = pthread_create(&workers[i], NULL, worker, &q);
+		err = pthread_create(&workers[i], NULL, worker, &q.workers[i]);
 		FATAL_IF(err, "cannot create thread: %s\n", strerror(err));
 	}
 
 	/* now set off the progress printer */
-	err = pthread_create(&print_progress_thread, NULL, print_progress, &q);
-	FATAL_IF(err, "cannot create thread: %s\n", strerror(err));
+	if (!m->machine_readable || m->progress) {
+		err = pthread_create(&print_progress_thread, NULL,
+			print_progress, &q);
+		FATAL_IF(err, "cannot create thread: %s\n", strerror(err));
+	}
+
+	/* start with half the chunks, and let the tuner
+	   find what is best while we go */
+	if (m->adaptive) {
+		memset(&t, 0, sizeof(t));
+		t.q = &q;
+		t.workers = q.worker_count;
+		t.readers = active_readers;
+		pthread_mutex_init(&t.mutex, NULL);
+		pthread_cond_init(&t.cond, NULL);
+		tune(&t, FEWER_BUFFERS, 0);
+
+		err = pthread_create(&t.thread, NULL, tuner, &t);
+		FATAL_IF(err, "cannot create thread: %s\n", strerror(err));
+	}
+
+	/* read files and feed chunks to the workers */
+	read_files(m, &q, pos, readers);
+
+	/* there is nothing left to tune */
+	if (m->adaptive) {
+		pthread_mutex_lock(&t.mutex);
+		t.stop = 1;
+		pthread_cond_signal(&t.cond);
+		pthread_mutex_unlock(&t.mutex);
 
-	/* read files and feed pieces to the workers */
-	read_files(m, &q, hash_string);
+		err = pthread_join(t.thread, NULL);
+		FATAL_IF(err, "cannot join thread: %s\n", strerror(err));
+
+		pthread_mutex_destroy(&t.mutex);
+		pthread_cond_destroy(&t.cond);
+	}
 
 	/* we're done so stop printing our progress. */
-	err = pthread_cancel(print_progress_thread);
-	FATAL_IF(err, "cannot cancel thread: %s\n", strerror(err));
+	if (!m->machine_readable || m->progress) {
+		err = pthread_cancel(print_progress_thread);
+		FATAL_IF(err, "cannot cancel thread: %s\n", strerror(err));
+	}
 
 	/* inform workers we're done */
 	set_done(&q);
@@ -319,23 +1490,58 @@ EXPORT unsigned char *make_hash(struct metafile *m)
 		FATAL_IF(err, "cannot join thread: %s\n", strerror(err));
 	}
 
+	/* the workers steal from each other until the last is done */
+	for (i = 0; i < m->threads; i++) {
+		ring_destroy(&q.workers[i].jobs);
+		parking_destroy(&q.workers[i].parking);
+	}
+
 	free(workers);
+	free(q.workers);
 
 	/* the progress printer should be done by now too */
-	err = pthread_join(print_progress_thread, NULL);
-	FATAL_IF(err, "cannot join thread: %s\n", strerror(err));
+	if (!m->machine_readable || m->progress) {
+		err = pthread_join(print_progress_thread, NULL);
+		FATAL_IF(err, "cannot join thread: %s\n", strerror(err));
+	}
+
+	/* the pieces being hashed are done, save them all */
+	if (checkpoint_interrupted()) {
+		if (!m->machine_readable)
+			printf("\n");
+		checkpoint_stop(&cp);
+	}
+
+	/* free buffers, but remember how many the tuner used */
+	if (m->adaptive)
+		tuned_chunks = tuned_buffers(&q);
+	free_pools(&q);
+	parking_destroy(&q.reader_parking);
+
+	/* ok, let the user know we're done, before what we
+	   verify against is checked */
+	if (!m->machine_readable) {
+		printf("\rhashed %u of %u pieces\n",
+			atomic_load(&q.pieces_hashed), q.pieces);
+		if (m->adaptive)
+			printf("tuned to %u hashing threads, %u readers and "
+				"%zu KiB of read buffers\n",
+				t.workers, t.readers,
+				tuned_chunks * q.chunk_len / 1024);
+	}
 
-	/* destroy mutexes and condition variables */
-	pthread_mutex_destroy(&q.mutex_full);
-	pthread_mutex_destroy(&q.mutex_free);
-	pthread_cond_destroy(&q.cond_empty);
-	pthread_cond_destroy(&q.cond_full);
+	copy_duplicate_hashes(m, &cp);
+	if (m->checksums)
+		checksum_files(m);
 
-	/* free buffers */
-	free_buffers(&q);
+	cache_close(&cache, &cp);
+	update_close(&update);
+	verify_close(&verify, &cp);
+	checkpoint_close(&cp);
 
-	/* ok, let the user know we're done too */
-	printf("\rhashed %u of %u pieces\n", q.pieces_hashed, q.pieces);
+	/* the v2 piece hashes are done, now find the root of every file */
+	if (m->meta_version & META_V2)
+		merkle_file_roots(m, hash_string + v1_pieces * SHA_DIGEST_LENGTH);
 
 	return hash_string;
 }
@@ -24,10 +24,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include <string.h>       /* strerror() */
 #include <stdio.h>        /* perror(), printf() etc. */
 #include <sys/stat.h>     /* the stat structure */
-#include <unistd.h>       /* getopt(), getcwd(), sysconf() */
+#include <unistd.h>       /* getopt(), getcwd() */
 #include <string.h>       /* strcmp(), strlen(), strncpy() */
 #include <strings.h>      /* strcasecmp() */
 #include <inttypes.h>     /* PRId64 etc. */
+#include <limits.h>       /* UINT_MAX */
+#include <fnmatch.h>      /* fnmatch() */
 
 #ifdef USE_LONG_OPTIONS
 #include <getopt.h>       /* getopt_long() */
@@ -35,8 +37,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 
 #include "export.h"
 #include "mktorrent.h"
+#include "dedup.h"
 #include "ftw.h"
+#include "govern.h"
 #include "msg.h"
+#include "update.h"
+#include "verify.h"
+#ifdef USE_PTHREADS
+#include "numa.h"
+#endif
 
 #ifndef MAX_OPENFD
 #define MAX_OPENFD 100	/* Maximum number of file descriptors
@@ -69,21 +78,26 @@ static const char *basename(const char *s)
 	return r;
 }
 
-static void set_absolute_file_path(struct metafile *m)
+/*
+ * return the absolute path of the metainfo file, which is file_path
+ * or <torrent name>.torrent if it's NULL, relative to the working dir
+ */
+static char *get_absolute_file_path(const char *file_path,
+		const char *torrent_name)
 {
 	char *string;		/* string to return */
 	size_t length = 32;	/* length of the string */
 
 	/* if the file_path is already an absolute path just
 	   return that */
-	if (m->metainfo_file_path && *m->metainfo_file_path == DIRSEP_CHAR) {
+	if (file_path && *file_path == DIRSEP_CHAR) {
 		/* we need to reallocate the string, because we want to be able to
 		 * free() it in cleanup_metafile(), and that would not be possible
-		 * if m->metainfo_file_path pointed to a string from argv[]
+		 * if file_path pointed to a string from argv[]
 		 */
-		m->metainfo_file_path = strdup(m->metainfo_file_path);
-		FATAL_IF0(m->metainfo_file_path == NULL, "out of memory\n");
-		return;
+		string = strdup(file_path);
+		FATAL_IF0(string == NULL, "out of memory\n");
+		return string;
 	}
 
 	/* first get the current working directory
@@ -106,22 +120,22 @@ static void set_absolute_file_path(struct metafile *m)
 	/* now set length to the proper length of the working dir */
 	length = strlen(string);
 	/* if the metainfo file path isn't set */
-	if (m->metainfo_file_path == NULL) {
+	if (file_path == NULL) {
 		/* append <torrent name>.torrent to the working dir */
 		string =
-		    realloc(string, length + strlen(m->torrent_name) + 10);
+		    realloc(string, length + strlen(torrent_name) + 10);
 		FATAL_IF0(string == NULL, "out of memory\n");
-		sprintf(string + length, DIRSEP "%s.torrent", m->torrent_name);
+		sprintf(string + length, DIRSEP "%s.torrent", torrent_name);
 	} else {
 		/* otherwise append the torrent path to the working dir */
 		string =
 		    realloc(string,
-			    length + strlen(m->metainfo_file_path) + 2);
+			    length + strlen(file_path) + 2);
 		FATAL_IF0(string == NULL, "out of memory\n");
-		sprintf(string + length, DIRSEP "%s", m->metainfo_file_path);
+		sprintf(string + length, DIRSEP "%s", file_path);
 	}
 
-	m->metainfo_file_path = string;
+	return string;
 }
 
 /*
@@ -155,6 +169,240 @@ static struct ll *get_slist(char *s)
 	return list;
 }
 
+/*
+ * split a comma separated list of patterns, a comma escaped with
+ * a backslash stays in its pattern, where fnmatch() takes it as it is
+ */
+static struct ll *get_patterns(char *s)
+{
+	struct ll *list = ll_new();
+	char *p;
+
+	FATAL_IF0(list == NULL, "out of memory\n");
+
+	for (p = s; *p; p++) {
+		if (*p == '\\' && p[1])
+			p++;
+		else if (*p == ',') {
+			*p = '\0';
+			FATAL_IF0(ll_append(list, s, 0) == NULL, "out of memory\n");
+			s = p + 1;
+		}
+	}
+
+	FATAL_IF0(ll_append(list, s, 0) == NULL, "out of memory\n");
+
+	return list;
+}
+
+/*
+ * parse the value of a yes/no key of a variant,
+ * a key without a value means yes
+ */
+static int get_variant_flag(const char *key, const char *value)
+{
+	if (value == NULL || strcmp(value, "1") == 0)
+		return 1;
+
+	FATAL_IF(strcmp(value, "0"),
+		"the value of '%s' in a variant must be 0 or 1\n", key);
+
+	return 0;
+}
+
+/*
+ * parse a variant <key>=<value>[,<key>=<value>]* and
+ * add it to the list of variants
+ */
+static void add_variant(struct metafile *m, char *s)
+{
+	struct variant v = { NULL, NULL, NULL, -1, -1, NULL };
+	struct ll *list = get_slist(s);
+
+	LL_FOR(node, list) {
+		char *key = LL_DATA(node);
+		char *value = strchr(key, '=');
+
+		if (value)
+			*value++ = '\0';
+
+		if (strcmp(key, "private") == 0) {
+			v.private = get_variant_flag(key, value);
+			continue;
+		} else if (strcmp(key, "cross-seed") == 0) {
+			v.cross_seed = get_variant_flag(key, value);
+			continue;
+		}
+
+		FATAL_IF(value == NULL,
+			"'%s' in a variant needs a value, use -h for help\n", key);
+
+		if (strcmp(key, "announce") == 0) {
+			/* every announce URL is a tier of its own */
+			if (v.announce_list == NULL) {
+				v.announce_list = ll_new();
+				FATAL_IF0(v.announce_list == NULL, "out of memory\n");
+			}
+
+			FATAL_IF0(
+				ll_append(v.announce_list, get_slist(value), 0) == NULL,
+				"out of memory\n");
+		} else if (strcmp(key, "comment") == 0)
+			v.comment = value;
+		else if (strcmp(key, "source") == 0)
+			v.source = value;
+		else if (strcmp(key, "output") == 0)
+			v.metainfo_file_path = value;
+		else
+			fatal("unknown key '%s' in variant, use -h for help\n", key);
+	}
+
+	ll_free(list, NULL);
+
+	FATAL_IF0(ll_append(m->variant_list, &v, sizeof(v)) == NULL,
+		"out of memory\n");
+}
+
+/*
+ * parse the clients to write fast resume data for,
+ * <client>[,<client>]*
+ */
+static int get_fast_resume(char *s)
+{
+	struct ll *list = get_slist(s);
+	int r = 0;
+
+	LL_FOR(node, list) {
+		const char *client = LL_DATA(node);
+
+		if (strcmp(client, "libtorrent") == 0)
+			r |= RESUME_LIBTORRENT;
+		else if (strcmp(client, "rtorrent") == 0)
+			r |= RESUME_RTORRENT;
+		else
+			fatal("unknown client '%s' for fast resume data, "
+				"use -h for help\n", client);
+	}
+
+	ll_free(list, NULL);
+
+	return r;
+}
+
+/*
+ * parse the checksums to compute of every file,
+ * <algorithm>[,<algorithm>]*
+ */
+static int get_checksums(char *s)
+{
+	struct ll *list = get_slist(s);
+	int r = 0;
+
+	LL_FOR(node, list) {
+		const char *algorithm = LL_DATA(node);
+
+		if (strcmp(algorithm, "md5") == 0)
+			r |= CHECKSUM_MD5;
+		else if (strcmp(algorithm, "sha1") == 0)
+			r |= CHECKSUM_SHA1;
+		else if (strcmp(algorithm, "sha256") == 0)
+			r |= CHECKSUM_SHA256;
+		else
+			fatal("unknown checksum '%s', use -h for help\n", algorithm);
+	}
+
+	ll_free(list, NULL);
+
+	return r;
+}
+
+/*
+ * parse a number of pieces of the piece policy
+ */
+static unsigned int get_policy_pieces(const char *s)
+{
+	unsigned long n;
+	char *end;
+
+	errno = 0;
+	n = strtoul(s, &end, 10);
+	FATAL_IF0(*s < '0' || *s > '9' || *end,
+		"invalid number of pieces in the piece policy\n");
+	FATAL_IF0(errno == ERANGE || n > UINT_MAX,
+		"the number of pieces in the piece policy is too large\n");
+
+	return n;
+}
+
+/*
+ * parse the policy the piece length is chosen by,
+ * <key>=<value>[,<key>=<value>]*
+ */
+static void get_piece_policy(struct metafile *m, char *s)
+{
+	struct ll *list = get_slist(s);
+
+	LL_FOR(node, list) {
+		char *key = LL_DATA(node);
+		char *value = strchr(key, '=');
+		char *dash, *end;
+		uintmax_t unit = 1;
+
+		FATAL_IF(value == NULL, "the piece policy '%s' needs a value\n",
+			key);
+		*value++ = '\0';
+
+		if (strcmp(key, "pieces") == 0) {
+			/* [<min>-]<max>, about half of <max> by default */
+			dash = strchr(value, '-');
+			if (dash) {
+				*dash = '\0';
+				m->min_pieces = get_policy_pieces(value);
+				value = dash + 1;
+			}
+			m->max_pieces = get_policy_pieces(value);
+			FATAL_IF0(m->max_pieces == 0 || m->min_pieces > m->max_pieces,
+				"invalid number of pieces in the piece policy\n");
+			if (dash == NULL)
+				m->min_pieces = m->max_pieces / 2;
+		} else if (strcmp(key, "metainfo") == 0) {
+			errno = 0;
+			m->max_metainfo = strtoumax(value, &end, 10);
+			if (*end == 'K' || *end == 'k') {
+				unit = 1024;
+				end++;
+			} else if (*end == 'M' || *end == 'm') {
+				unit = ONEMEG;
+				end++;
+			}
+			FATAL_IF0(*value < '0' || *value > '9' || *end
+				|| m->max_metainfo == 0,
+				"invalid metainfo size in the piece policy\n");
+			FATAL_IF0(errno == ERANGE || m->max_metainfo > UINTMAX_MAX / unit,
+				"the metainfo size in the piece policy is too large\n");
+			m->max_metainfo *= unit;
+		} else
+			fatal("unknown piece policy '%s', use -h for help\n", key);
+	}
+
+	ll_free(list, NULL);
+}
+
+/*
+ * the modification time of a file in nanoseconds
+ */
+static int64_t mtime_ns(const struct stat *s)
+{
+#if defined __APPLE__
+	return (int64_t) s->st_mtimespec.tv_sec * 1000000000
+		+ s->st_mtimespec.tv_nsec;
+#elif defined _WIN32
+	return (int64_t) s->st_mtime * 1000000000;
+#else
+	return (int64_t) s->st_mtim.tv_sec * 1000000000 + s->st_mtim.tv_nsec;
+#endif
+}
+
 /*
  * checks if target is a directory
  * sets the file_list and size if it isn't
@@ -182,7 +430,15 @@ static int is_dir(struct metafile *m, char *target)
 	   already stat'ed it, we might as well set the file list */
 	struct file_data fd = {
 		strdup(target),
-		(uintmax_t) s.st_size
+		(uintmax_t) s.st_size,
+		{ 0 },
+		(uintmax_t) s.st_dev,
+		(uintmax_t) s.st_ino,
+		mtime_ns(&s),
+		0,
+		0,
+		NULL,
+		NULL
 	};
 
 	FATAL_IF0(
@@ -196,6 +452,85 @@ static int is_dir(struct metafile *m, char *target)
 	return 0;
 }
 
+/*
+ * take the files of the metainfo file we verify against instead of
+ * those in the target, exits if any is missing or of another size
+ */
+static void verify_target(struct metafile *m)
+{
+	struct ll *expected = verify_files(m);
+	unsigned int bad = 0;
+
+	LL_FOR(expected_node, expected) {
+		struct file_data *fd = LL_DATA_AS(expected_node, struct file_data*);
+		struct stat s;
+
+		/* a single file is the target, which is stat'ed already */
+		if (!m->target_is_directory) {
+			if (m->size != fd->size) {
+				fprintf(stderr, "'%s' has %" PRIuMAX " bytes instead "
+					"of %" PRIuMAX "\n", LL_DATA_AS(LL_HEAD(
+						m->file_list), struct file_data*)->path,
+					m->size, fd->size);
+				bad++;
+			}
+			free(fd->path);
+			continue;
+		}
+
+		if (stat(fd->path, &s) || !S_ISREG(s.st_mode)) {
+			fprintf(stderr, "'%s' is missing\n", fd->path);
+		} else if ((uintmax_t) s.st_size != fd->size) {
+			fprintf(stderr, "'%s' has %" PRIuMAX " bytes instead of %"
+				PRIuMAX "\n", fd->path, (uintmax_t) s.st_size, fd->size);
+		} else {
+			fd->dev = s.st_dev;
+			fd->ino = s.st_ino;
+			fd->mtime = mtime_ns(&s);
+			FATAL_IF0(ll_append(m->file_list, fd, sizeof(*fd)) == NULL,
+				"out of memory\n");
+			m->size += fd->size;
+			continue;
+		}
+
+		free(fd->path);
+		bad++;
+	}
+
+	ll_free(expected, NULL);
+
+	FATAL_IF(bad, "%u of the files of '%s' are missing or of another size\n",
+		bad, m->verify_path);
+}
+
+/*
+ * a file is included if there are no include patterns, or one of them
+ * matches its path or the path of a directory it is in
+ */
+static int is_included(struct metafile *m, const char *path)
+{
+	char *s, *p;
+	int r = 0;
+
+	if (LL_IS_EMPTY(m->include_list))
+		return 1;
+
+	s = strdup(path);
+	FATAL_IF0(s == NULL, "out of memory\n");
+
+	/* try the whole path, then cut off one name at a time */
+	for (p = s + strlen(s); p && !r; p = strrchr(s, DIRSEP_CHAR)) {
+		*p = '\0';
+		LL_FOR(include_node, m->include_list)
+			if (fnmatch(LL_DATA(include_node), s, 0) == 0)
+				r = 1;
+	}
+
+	free(s);
+
+	return r;
+}
+
 /*
  * called by file_tree_walk() on every file and directory in the subtree
  * counts the number of (readable) files, their commulative size and adds
@@ -212,6 +547,9 @@ static int process_node(const char *path, const struct stat *sb, void *data)
 	/* ignore the leading "./" */
 	path += 2;
 
+	if (!is_included(m, path))
+		return 0;
+
 	/* now path should be readable otherwise
 	 * display a warning and skip it */
 	if (access(path, R_OK)) {
@@ -233,7 +571,15 @@ static int process_node(const char *path, const struct stat *sb, void *data)
 	/* create a new file list node for the file */
 	struct file_data fd = {
 		strdup(path),
-		(uintmax_t) sb->st_size
+		(uintmax_t) sb->st_size,
+		{ 0 },
+		(uintmax_t) sb->st_dev,
+		(uintmax_t) sb->st_ino,
+		mtime_ns(sb),
+		0,
+		0,
+		NULL,
+		NULL
 	};
 
 	if (fd.path == NULL || ll_append(m->file_list, &fd, sizeof(fd)) == NULL) {
@@ -244,64 +590,385 @@ static int process_node(const char *path, const struct stat *sb, void *data)
 	return 0;
 }
 
+/* the options of getopt() */
+#ifdef USE_PTHREADS
+#define OPT_STRING "2a:AB:c:C:e:EdD:fF:ghHiIjkK:l:L:mM:n:No:pPQr:R:s:S:t:T:U:vV:w:xy:Y:Z:"
+#else
+#define OPT_STRING "2a:B:c:e:EdD:fF:ghHiIjkK:l:L:mn:o:pPQR:s:S:T:U:vV:w:xy:Y:Z:"
+#endif
+
+#ifdef USE_LONG_OPTIONS
+/* the option structure to pass to getopt_long() */
+static const struct option long_options[] = {
+	{"v2", 0, NULL, '2'},
+	{"announce", 1, NULL, 'a'},
+#ifdef USE_PTHREADS
+	{"adaptive", 0, NULL, 'A'},
+#endif
+	{"batch", 1, NULL, 'B'},
+	{"comment", 1, NULL, 'c'},
+#ifdef USE_PTHREADS
+	{"cpus", 1, NULL, 'C'},
+#endif
+	{"no-date", 0, NULL, 'd'},
+	{"checksum", 1, NULL, 'D'},
+	{"exclude", 1, NULL, 'e'},
+	{"edit", 0, NULL, 'E'},
+	{"force", 0, NULL, 'f'},
+	{"include", 1, NULL, 'F'},
+	{"progress", 0, NULL, 'g'},
+	{"help", 0, NULL, 'h'},
+	{"hybrid", 0, NULL, 'H'},
+	{"print-infohash", 0, NULL, 'i'},
+	{"idle", 0, NULL, 'I'},
+	{"json", 0, NULL, 'j'},
+	{"resume", 0, NULL, 'k'},
+	{"cache", 1, NULL, 'K'},
+	{"piece-length", 1, NULL, 'l'},
+	{"piece-policy", 1, NULL, 'T'},
+	{"listen", 1, NULL, 'L'},
+	{"magnet", 0, NULL, 'm'},
+#ifdef USE_PTHREADS
+	{"memory", 1, NULL, 'M'},
+#endif
+	{"name", 1, NULL, 'n'},
+#ifdef USE_PTHREADS
+	{"numa", 0, NULL, 'N'},
+#endif
+	{"output", 1, NULL, 'o'},
+	{"private", 0, NULL, 'p'},
+	{"pad-files", 0, NULL, 'P'},
+	{"stop-at-mismatch", 0, NULL, 'Q'},
+	{"max-read-rate", 1, NULL, 'R'},
+#ifdef USE_PTHREADS
+	{"readers", 1, NULL, 'r'},
+#endif
+	{"source", 1, NULL, 's'},
+	{"max-pressure", 1, NULL, 'S'},
+#ifdef USE_PTHREADS
+	{"threads", 1, NULL, 't'},
+#endif
+	{"update-from", 1, NULL, 'U'},
+	{"verbose", 0, NULL, 'v'},
+	{"variant", 1, NULL, 'V'},
+	{"web-seed", 1, NULL, 'w'},
+	{"cross-seed", 0, NULL, 'x'},
+	{"verify", 1, NULL, 'y'},
+	{"sample", 1, NULL, 'Y'},
+	{"fast-resume", 1, NULL, 'Z'},
+	{NULL, 0, NULL, 0}
+};
+#endif
+
+/*
+ * the first option of a job that a job cannot take, as it would run
+ * jobs or do something else than create a torrent, 0 if there is none
+ */
+EXPORT int job_option_refused(int argc, char *argv[])
+{
+	char **args = malloc((argc + 1) * sizeof(*args));
+	int c, r = 0;
+
+	/* getopt() may reorder the arguments, and is left at their end
+	   to parse others from the start */
+	FATAL_IF0(args == NULL, "out of memory\n");
+	memcpy(args, argv, (argc + 1) * sizeof(*args));
+
+	opterr = 0;
+	optind = 1;
+#ifdef USE_LONG_OPTIONS
+	while ((c = getopt_long(argc, args, OPT_STRING,
+				long_options, NULL)) != -1)
+#else
+	while ((c = getopt(argc, args, OPT_STRING)) != -1)
+#endif
+		if (r == 0 && (c == 'B' || c == 'E' || c == 'h' || c == 'L'
+				|| c == 'y'))
+			r = c;
+	opterr = 1;
+	optind = 1;
+
+	free(args);
+	return r;
+}
+
+/*
+ * print who we are
+ */
+static void print_banner()
+{
+	printf("mktorrent " VERSION " (c) 2007, 2009 Emil Renner Berthing\n\n");
+}
+
 /*
  * 'elp!
  */
 static void print_help()
 {
+	print_banner();
 	printf(
 	  "Usage: mktorrent [OPTIONS] <target directory or filename>\n\n"
 	  "Options:\n"
 #ifdef USE_LONG_OPTIONS
+	  "-2, --v2                      : create a v2 (BEP 52) torrent\n"
 	  "-a, --announce=<url>[,<url>]* : specify the full announce URLs\n"
 	  "                                additional -a adds backup trackers\n"
+#ifdef USE_PTHREADS
+	  "-A, --adaptive                : tune the number of hashing threads, readers\n"
+	  "                                and read buffers in use while hashing,\n"
+	  "                                -t, -r and -M give the most it may use\n"
+#endif
+	  "-B, --batch=<file>            : create a torrent for every line of <file>,\n"
+	  "                                its options and target follow the other\n"
+	  "                                options given, the torrents of targets on\n"
+	  "                                the same device are made one at a time\n"
 	  "-c, --comment=<comment>       : add a comment to the metainfo\n"
+#ifdef USE_PTHREADS
+	  "-C, --cpus=<list>             : run the hashing threads on the CPUs in\n"
+	  "                                <list>, like 0-7,16-23, one thread on each\n"
+	  "                                by default (Linux only)\n"
+#endif
 	  "-d, --no-date                 : don't write the creation date\n"
+	  "-D, --checksum=<algorithm>[,<algorithm>]*\n"
+	  "                              : compute the md5, sha1 or sha256 checksum\n"
+	  "                                of every file while hashing and write them\n"
+	  "                                to <output>.md5, .sha1 and .sha256 to check\n"
+	  "                                with md5sum -c and the like, md5 and sha1\n"
+	  "                                are also put in the v1 file list\n"
 	  "-e, --exclude=<pat>[,<pat>]*  : exclude files whose name matches the pattern <pat>\n"
-	  "                                see the man page glob(7)\n"
+	  "                                see the man page glob(7), a comma in <pat>\n"
+	  "                                is escaped with a backslash\n"
+	  "-E, --edit                    : edit the metainfo files given, and the\n"
+	  "                                .torrent files in the directories given,\n"
+	  "                                setting what -a, -c and -w give and removing\n"
+	  "                                the creation date with -d, the info hash\n"
+	  "                                stays the same. an empty comment removes it\n"
 	  "-f, --force                   : overwrite output file if it exists\n"
+	  "-F, --include=<pat>[,<pat>]*  : include only the files whose path, or the path\n"
+	  "                                of a directory they are in, matches <pat>,\n"
+	  "                                a comma in <pat> is escaped with a backslash\n"
+	  "-g, --progress                : with -j, also print the pieces hashed so far\n"
+	  "                                as JSON objects while hashing\n"
 	  "-h, --help                    : show this help screen\n"
+	  "-H, --hybrid                  : create a hybrid v1 and v2 torrent\n"
+	  "-i, --print-infohash          : print the info hash when done\n"
+	  "-I, --idle                    : run at idle CPU and I/O priority\n"
+	  "-j, --json                    : print the result as a JSON object on a single\n"
+	  "                                line and nothing else on standard output\n"
+	  "-k, --resume                  : take the hashes done from the checkpoint\n"
+	  "                                <output>.checkpoint written by a run that\n"
+	  "                                was interrupted, and overwrite its output\n"
+	  "-K, --cache=<file>            : keep the piece hashes of the files in <file>\n"
+	  "                                and take those of unchanged files from it\n"
 	  "-l, --piece-length=<n>        : set the piece length to 2^n bytes,\n"
 	  "                                default is calculated from the total size\n"
+	  "                                additional -l writes a torrent for every\n"
+	  "                                piece length with a single read of the content,\n"
+	  "                                .l<n> is added to their file names\n"
+	  "-L, --listen=<socket>         : run as a daemon creating a torrent for every\n"
+	  "                                line of options and target a client sends\n"
+	  "                                to the Unix <socket>, after the other\n"
+	  "                                options given, and tell it how the job goes\n"
+	  "                                as JSON events until it is done\n");
+	printf(
+	  "-m, --magnet                  : print the magnet URI when done\n"
+#ifdef USE_PTHREADS
+	  "-M, --memory=<n>              : use at most <n> MiB for the read buffers,\n"
+	  "                                default is 1 MiB for every thread\n"
+#endif
 	  "-n, --name=<name>             : set the name of the torrent\n"
 	  "                                default is the basename of the target\n"
+#ifdef USE_PTHREADS
+	  "-N, --numa                    : keep the read buffers and the threads\n"
+	  "                                using them on the same NUMA node\n"
+	  "                                (Linux only)\n"
+#endif
 	  "-o, --output=<filename>       : set the path and filename of the created file\n"
 	  "                                default is <name>.torrent\n"
 	  "-p, --private                 : set the private flag\n"
+	  "-P, --pad-files               : start every file on a piece boundary by\n"
+	  "                                adding BEP 47 pad files, so files are\n"
+	  "                                hashed independently of each other\n"
+	  "-Q, --stop-at-mismatch        : stop at the first piece that doesn't match\n");
+	printf(
+	  "-R, --max-read-rate=<n>       : read at most <n> MiB per second\n"
+#ifdef USE_PTHREADS
+	  "-r, --readers=<n>             : use <n> threads for reading the content,\n"
+	  "                                default is 1, or up to 4 when every file\n"
+	  "                                starts a new piece\n"
+#endif
 	  "-s, --source=<source>         : add source string embedded in infohash\n"
+	  "-S, --max-pressure=<n>        : pause the reading while the I/O or CPU\n"
+	  "                                pressure is above <n> percent (Linux only)\n"
 #ifdef USE_PTHREADS
 	  "-t, --threads=<n>             : use <n> threads for calculating hashes\n"
-	  "                                default is the number of CPU cores\n"
+	  "                                default is the number of CPUs available\n"
 #endif
+	  "-T, --piece-policy=<key>=<value>[,<key>=<value>]*\n"
+	  "                              : choose the piece length from 2^15 to 2^28 by\n"
+	  "                                the pieces of every file instead of by the\n"
+	  "                                total size, by which it is at most 2^23.\n"
+	  "                                pieces=[<min>-]<max> gives at most <max>\n"
+	  "                                pieces and at least <min> if it can,\n"
+	  "                                metainfo=<n>[K|M] a metainfo file of at\n"
+	  "                                most about <n> bytes\n"
+	  "-U, --update-from=<file>      : take the hashes of the pieces of unchanged\n"
+	  "                                files from the metainfo file <file>, whose\n"
+	  "                                piece length is the default. files of the\n"
+	  "                                same path and size are unchanged, and of the\n"
+	  "                                same mtime if there is <file>.mtimes, which\n"
+	  "                                is written next to every output of -U\n"
 	  "-v, --verbose                 : be verbose\n"
+	  "-V, --variant=<key>=<value>[,<key>=<value>]*\n"
+	  "                              : write another metainfo file from the same\n"
+	  "                                hashes, the keys announce, comment, source,\n"
+	  "                                private, cross-seed and output override\n"
+	  "                                -a, -c, -s, -p, -x and -o, every variant\n"
+	  "                                needs an output, additional -V adds more\n"
 	  "-w, --web-seed=<url>[,<url>]* : add web seed URLs\n"
 	  "                                additional -w adds more URLs\n"
 	  "-x, --cross-seed              : ensure info hash is unique for easier cross-seeding\n"
+	  "-y, --verify=<file>           : check the content against the metainfo file\n"
+	  "                                <file> instead of creating one, the exit\n"
+	  "                                status tells if it matches\n"
+	  "-Y, --sample=<n>              : check <n> percent of the pieces chosen at\n"
+	  "                                random, and tell how sure that is\n"
+	  "-Z, --fast-resume=<client>[,<client>]*\n"
+	  "                              : write the fast resume data of the clients,\n"
+	  "                                libtorrent to <output>.fastresume and\n"
+	  "                                rtorrent to <output>.rtorrent, a copy of\n"
+	  "                                the metainfo file to load instead, so they\n"
+	  "                                seed without checking the content again\n"
 #else
+	  "-2                : create a v2 (BEP 52) torrent\n"
 	  "-a <url>[,<url>]* : specify the full announce URLs\n"
 	  "                    additional -a adds backup trackers\n"
+#ifdef USE_PTHREADS
+	  "-A                : tune the number of hashing threads, readers\n"
+	  "                    and read buffers in use while hashing,\n"
+	  "                    -t, -r and -M give the most it may use\n"
+#endif
+	  "-B <file>         : create a torrent for every line of <file>,\n"
+	  "                    its options and target follow the other\n"
+	  "                    options given, the torrents of targets on\n"
+	  "                    the same device are made one at a time\n"
 	  "-c <comment>      : add a comment to the metainfo\n"
+#ifdef USE_PTHREADS
+	  "-C <list>         : run the hashing threads on the CPUs in\n"
+	  "                    <list>, like 0-7,16-23, one thread on each\n"
+	  "                    by default (Linux only)\n"
+#endif
 	  "-d                : don't write the creation date\n"
+	  "-D <algorithm>[,<algorithm>]*\n"
+	  "                  : compute the md5, sha1 or sha256 checksum\n"
+	  "                    of every file while hashing and write them\n"
+	  "                    to <output>.md5, .sha1 and .sha256 to check\n"
+	  "                    with md5sum -c and the like, md5 and sha1\n"
+	  "                    are also put in the v1 file list\n"
 	  "-e <pat>[,<pat>]* : exclude files whose name matches the pattern <pat>\n"
-	  "                    see the man page glob(7)\n"
+	  "                    see the man page glob(7), a comma in <pat>\n"
+	  "                    is escaped with a backslash\n"
+	  "-E                : edit the metainfo files given, and the\n"
+	  "                    .torrent files in the directories given,\n"
+	  "                    setting what -a, -c and -w give and removing\n"
+	  "                    the creation date with -d, the info hash\n"
+	  "                    stays the same. an empty comment removes it\n"
 	  "-f                : overwrite output file if it exists\n"
+	  "-F <pat>[,<pat>]* : include only the files whose path, or the path\n"
+	  "                    of a directory they are in, matches <pat>,\n"
+	  "                    a comma in <pat> is escaped with a backslash\n"
+	  "-g                : with -j, also print the pieces hashed so far\n"
+	  "                    as JSON objects while hashing\n"
 	  "-h                : show this help screen\n"
+	  "-H                : create a hybrid v1 and v2 torrent\n"
+	  "-i                : print the info hash when done\n"
+	  "-I                : run at idle CPU and I/O priority\n"
+	  "-j                : print the result as a JSON object on a single\n"
+	  "                    line and nothing else on standard output\n"
+	  "-k                : take the hashes done from the checkpoint\n"
+	  "                    <output>.checkpoint written by a run that\n"
+	  "                    was interrupted, and overwrite its output\n"
+	  "-K <file>         : keep the piece hashes of the files in <file>\n"
+	  "                    and take those of unchanged files from it\n"
 	  "-l <n>            : set the piece length to 2^n bytes,\n"
 	  "                    default is calculated from the total size\n"
+	  "                    additional -l writes a torrent for every\n"
+	  "                    piece length with a single read of the content,\n"
+	  "                    .l<n> is added to their file names\n"
+	  "-L <socket>       : run as a daemon creating a torrent for every\n"
+	  "                    line of options and target a client sends\n"
+	  "                    to the Unix <socket>, after the other\n"
+	  "                    options given, and tell it how the job goes\n"
+	  "                    as JSON events until it is done\n");
+	printf(
+	  "-m                : print the magnet URI when done\n"
+#ifdef USE_PTHREADS
+	  "-M <n>            : use at most <n> MiB for the read buffers,\n"
+	  "                    default is 1 MiB for every thread\n"
+#endif
 	  "-n <name>         : set the name of the torrent,\n"
 	  "                    default is the basename of the target\n"
+#ifdef USE_PTHREADS
+	  "-N                : keep the read buffers and the threads\n"
+	  "                    using them on the same NUMA node\n"
+	  "                    (Linux only)\n"
+#endif
 	  "-o <filename>     : set the path and filename of the created file\n"
 	  "                    default is <name>.torrent\n"
 	  "-p                : set the private flag\n"
+	  "-P                : start every file on a piece boundary by\n"
+	  "                    adding BEP 47 pad files, so files are\n"
+	  "                    hashed independently of each other\n"
+	  "-Q                : stop at the first piece that doesn't match\n");
+	printf(
+	  "-R <n>            : read at most <n> MiB per second\n"
+#ifdef USE_PTHREADS
+	  "-r <n>            : use <n> threads for reading the content,\n"
+	  "                    default is 1, or up to 4 when every file\n"
+	  "                    starts a new piece\n"
+#endif
 	  "-s                : add source string embedded in infohash\n"
+	  "-S <n>            : pause the reading while the I/O or CPU\n"
+	  "                    pressure is above <n> percent (Linux only)\n"
 #ifdef USE_PTHREADS
 	  "-t <n>            : use <n> threads for calculating hashes\n"
-	  "                    default is the number of CPU cores\n"
+	  "                    default is the number of CPUs available\n"
 #endif
+	  "-T <key>=<value>[,<key>=<value>]*\n"
+	  "                  : choose the piece length from 2^15 to 2^28 by\n"
+	  "                    the pieces of every file instead of by the\n"
+	  "                    total size, by which it is at most 2^23.\n"
+	  "                    pieces=[<min>-]<max> gives at most <max>\n"
+	  "                    pieces and at least <min> if it can,\n"
+	  "                    metainfo=<n>[K|M] a metainfo file of at\n"
+	  "                    most about <n> bytes\n"
+	  "-U <file>         : take the hashes of the pieces of unchanged\n"
+	  "                    files from the metainfo file <file>, whose\n"
+	  "                    piece length is the default. files of the\n"
+	  "                    same path and size are unchanged, and of the\n"
+	  "                    same mtime if there is <file>.mtimes, which\n"
+	  "                    is written next to every output of -U\n"
 	  "-v                : be verbose\n"
+	  "-V <key>=<value>[,<key>=<value>]*\n"
+	  "                  : write another metainfo file from the same\n"
+	  "                    hashes, the keys announce, comment, source,\n"
+	  "                    private, cross-seed and output override\n"
+	  "                    -a, -c, -s, -p, -x and -o, every variant\n"
+	  "                    needs an output, additional -V adds more\n"
 	  "-w <url>[,<url>]* : add web seed URLs\n"
 	  "                    additional -w adds more URLs\n"
 	  "-x                : ensure info hash is unique for easier cross-seeding\n"
+	  "-y <file>         : check the content against the metainfo file\n"
+	  "                    <file> instead of creating one, the exit\n"
+	  "                    status tells if it matches\n"
+	  "-Y <n>            : check <n> percent of the pieces chosen at\n"
+	  "                    random, and tell how sure that is\n"
+	  "-Z <client>[,<client>]*\n"
+	  "                  : write the fast resume data of the clients,\n"
+	  "                    libtorrent to <output>.fastresume and\n"
+	  "                    rtorrent to <output>.rtorrent, a copy of\n"
+	  "                    the metainfo file to load instead, so they\n"
+	  "                    seed without checking the content again\n"
 #endif
 	  "\nPlease send bug reports, patches, feature requests, praise and\n"
 	  "general gossip about the program to: mktorrent@rudde.org\n");
@@ -395,10 +1062,35 @@ static int file_data_cmp_by_name(const void *a, const void *b)
 	return strcmp(x->path, y->path);
 }
 
+/*
+ * compare the paths one directory at a time, this is the order of the
+ * v2 file tree, where eg. "a/b" comes before "a.b"
+ */
+static int file_data_cmp_by_tree(const void *a, const void *b)
+{
+	const struct file_data *x = a, *y = b;
+	const unsigned char *p = (const unsigned char *) x->path;
+	const unsigned char *q = (const unsigned char *) y->path;
+
+	while (*p && *p == *q) {
+		p++;
+		q++;
+	}
+
+	/* a directory separator sorts before any other character */
+	if (*p == DIRSEP_CHAR && *q)
+		return -1;
+	if (*q == DIRSEP_CHAR && *p)
+		return 1;
+
+	return (int) *p - (int) *q;
+}
+
 static void file_data_clear(void *data)
 {
 	struct file_data *fd = data;
 	free(fd->path);
+	free(fd->sums);
 }
 
 static void free_inner_list(void *data)
@@ -407,6 +1099,102 @@ static void free_inner_list(void *data)
 	ll_free(list, NULL);
 }
 
+static void variant_clear(void *data)
+{
+	struct variant *v = data;
+
+	if (v->announce_list)
+		ll_free(v->announce_list, free_inner_list);
+
+	free(v->metainfo_file_path);
+}
+
+/*
+ * the number of pieces with a piece length of 2^n, every file
+ * starts a new piece with pad files and in v2
+ */
+static uintmax_t count_pieces(struct metafile *m, unsigned int n, int pad)
+{
+	uintmax_t len = (uintmax_t) 1 << n;
+	uintmax_t pieces = 0;
+
+	if (!pad)
+		return (m->size + len - 1) / len;
+
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+		pieces += (f->size + len - 1) / len;
+	}
+
+	return pieces;
+}
+
+/*
+ * about the size of the metainfo file with a piece length of 2^n,
+ * the pieces, the file entries and the piece layers of v2
+ */
+static uintmax_t metainfo_size(struct metafile *m, unsigned int n, int pad)
+{
+	uintmax_t len = (uintmax_t) 1 << n;
+	uintmax_t size = 256;
+
+	if (m->meta_version & META_V1)
+		size += count_pieces(m, n, pad) * 20;
+
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+		uintmax_t path = strlen(f->path);
+
+		if (m->meta_version & META_V1) {
+			size += path + 32;
+			/* a pad file follows every file but the last */
+			if (pad && f->size % len && LL_NEXT(file_node))
+				size += 64;
+		}
+
+		if (m->meta_version & META_V2) {
+			size += path + 80;
+			/* the hashes of the pieces of files longer than one */
+			if (f->size > len)
+				size += (f->size + len - 1) / len * 32 + 40;
+		}
+	}
+
+	return size;
+}
+
+/*
+ * choose the piece length by the policy given, the one giving a
+ * number of pieces in the range, or the closest to it, and large
+ * enough for the metainfo file to be no larger than asked
+ */
+static unsigned int policy_piece_length(struct metafile *m)
+{
+	int pad = m->pad_files || (m->meta_version & META_V2);
+	unsigned int n = 15;
+	unsigned int i;
+
+	if (m->max_pieces) {
+		/* the longest one still giving enough pieces,
+		   then longer ones until there are few enough */
+		for (i = 15; i <= 28; i++)
+			if (count_pieces(m, i, pad) >= m->min_pieces)
+				n = i;
+		while (n < 28 && count_pieces(m, n, pad) > m->max_pieces)
+			n++;
+	}
+
+	if (m->max_metainfo) {
+		for (i = 15; i < 28; i++)
+			if (metainfo_size(m, i, pad) <= m->max_metainfo)
+				break;
+		if (i > n)
+			n = i;
+	}
+
+	return n;
+}
+
 /*
  * parse and check the command line options given
  * and fill out the appropriate fields of the
@@ -415,6 +1203,10 @@ static void free_inner_list(void *data)
 EXPORT void init(struct metafile *m, int argc, char *argv[])
 {
 	int c;			/* return value of getopt() */
+	int edit = 0;		/* edit metainfo files instead */
+	int prev = 1;		/* where the option getopt() returns starts */
+	int batch_start = 0;	/* the arguments of -B */
+	int batch_end = 0;
 	const uintmax_t piece_len_maxes[] = {
 		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 		(uintmax_t) BIT15MAX * ONEMEG, (uintmax_t) BIT16MAX * ONEMEG,
@@ -427,30 +1219,6 @@ EXPORT void init(struct metafile *m, int argc, char *argv[])
 	const int num_piece_len_maxes = sizeof(piece_len_maxes) /
 	    sizeof(piece_len_maxes[0]);
 
-#ifdef USE_LONG_OPTIONS
-	/* the option structure to pass to getopt_long() */
-	static struct option long_options[] = {
-		{"announce", 1, NULL, 'a'},
-		{"comment", 1, NULL, 'c'},
-		{"no-date", 0, NULL, 'd'},
-		{"exclude", 1, NULL, 'e'},
-		{"force", 0, NULL, 'f'},
-		{"help", 0, NULL, 'h'},
-		{"piece-length", 1, NULL, 'l'},
-		{"name", 1, NULL, 'n'},
-		{"output", 1, NULL, 'o'},
-		{"private", 0, NULL, 'p'},
-		{"source", 1, NULL, 's'},
-#ifdef USE_PTHREADS
-		{"threads", 1, NULL, 't'},
-#endif
-		{"verbose", 0, NULL, 'v'},
-		{"web-seed", 1, NULL, 'w'},
-		{"cross-seed", 0, NULL, 'x'},
-		{NULL, 0, NULL, 0}
-	};
-#endif
-
 	m->announce_list = ll_new();
 	FATAL_IF0(m->announce_list == NULL, "out of memory\n");
 
@@ -463,42 +1231,95 @@ EXPORT void init(struct metafile *m, int argc, char *argv[])
 	m->exclude_list = ll_new();
 	FATAL_IF0(m->exclude_list == NULL, "out of memory\n");
 
+	m->include_list = ll_new();
+	FATAL_IF0(m->include_list == NULL, "out of memory\n");
+
+	m->variant_list = ll_new();
+	FATAL_IF0(m->variant_list == NULL, "out of memory\n");
+
 	/* now parse the command line options given */
-#ifdef USE_PTHREADS
-#define OPT_STRING "a:c:e:dfhl:n:o:ps:t:vw:x"
-#else
-#define OPT_STRING "a:c:e:dfhl:n:o:ps:vw:x"
-#endif
 #ifdef USE_LONG_OPTIONS
 	while ((c = getopt_long(argc, argv, OPT_STRING,
 				long_options, NULL)) != -1) {
 #else
 	while ((c = getopt(argc, argv, OPT_STRING)) != -1) {
 #endif
-#undef OPT_STRING
 		switch (c) {
+		case '2':
+			m->meta_version = META_V2;
+			break;
 		case 'a':
 			FATAL_IF0(
 				ll_append(m->announce_list, get_slist(optarg), 0) == NULL,
 				"out of memory\n");
 			break;
+		case 'B':
+		case 'L':
+			/* the other options are passed on to the jobs */
+			FATAL_IF(argv[prev][0] != '-' || (argv[prev][1] != c
+				&& argv[prev][1] != '-'),
+				"-%c must be given on its own\n", c);
+			if (c == 'B')
+				m->batch_path = optarg;
+			else
+				m->socket_path = optarg;
+			batch_start = prev;
+			batch_end = optind;
+			break;
 		case 'c':
 			m->comment = optarg;
 			break;
 		case 'd':
 			m->no_creation_date = 1;
 			break;
+		case 'D':
+			m->checksums |= get_checksums(optarg);
+			break;
 		case 'e':
-			ll_extend(m->exclude_list, get_slist(optarg));
+			ll_extend(m->exclude_list, get_patterns(optarg));
+			break;
+		case 'E':
+			edit = 1;
 			break;
 		case 'f':
 			m->force_overwrite = 1;
 			break;
+		case 'F':
+			ll_extend(m->include_list, get_patterns(optarg));
+			break;
+		case 'g':
+			m->progress = 1;
+			break;
+		case 'H':
+			m->meta_version = META_V1 | META_V2;
+			break;
 		case 'h':
 			print_help();
 			exit(EXIT_SUCCESS);
+		case 'i':
+			m->print_info_hash = 1;
+			break;
+		case 'I':
+			m->idle = 1;
+			break;
+		case 'j':
+			m->machine_readable = 1;
+			break;
+		case 'k':
+			m->resume = 1;
+			break;
+		case 'K':
+			m->cache_path = optarg;
+			break;
 		case 'l':
-			m->piece_length = atoi(optarg);
+			FATAL_IF(m->piece_length_count == MAX_PIECE_LENGTHS,
+				"at most %d piece lengths can be given\n",
+				MAX_PIECE_LENGTHS);
+			m->piece_lengths[m->piece_length_count++] = atoi(optarg);
+			m->piece_length = m->piece_lengths[0];
+			break;
+		case 'm':
+			m->print_magnet = 1;
 			break;
 		case 'n':
 			m->torrent_name = optarg;
@@ -509,46 +1330,211 @@ EXPORT void init(struct metafile *m, int argc, char *argv[])
 		case 'p':
 			m->private = 1;
 			break;
+		case 'P':
+			m->pad_files = 1;
+			break;
+		case 'Q':
+			m->stop_at_mismatch = 1;
+			break;
+		case 'R':
+			FATAL_IF0(atol(optarg) <= 0,
+				"the read rate must be a positive number of MiB\n");
+			m->max_read_rate = atol(optarg);
+			break;
 		case 's':
 			m->source = optarg;
 			break;
+		case 'S':
+			FATAL_IF0(atoi(optarg) <= 0 || atoi(optarg) > 100,
+				"the pressure must be a percentage from 1 to 100\n");
+			m->max_pressure = atoi(optarg);
+			break;
 #ifdef USE_PTHREADS
+		case 'A':
+			m->adaptive = 1;
+			break;
+		case 'C':
+			free(m->cpus);
+			m->cpus = parse_cpu_list(optarg, &m->cpu_count);
+			FATAL_IF(m->cpus == NULL, "invalid CPU list '%s'\n", optarg);
+			break;
+		case 'M':
+			m->memory = atol(optarg);
+			FATAL_IF0(m->memory <= 0,
+				"the memory must be a positive number of MiB\n");
+			break;
+		case 'N':
+			m->numa = 1;
+			break;
+		case 'r':
+			m->readers = atoi(optarg);
+			FATAL_IF0(m->readers <= 0,
+				"the number of readers must be positive\n");
+			break;
 		case 't':
 			m->threads = atoi(optarg);
+			FATAL_IF0(m->threads <= 0,
+				"the number of threads must be positive\n");
 			break;
 #endif
+		case 'T':
+			get_piece_policy(m, optarg);
+			break;
+		case 'U':
+			m->update_path = optarg;
+			break;
 		case 'v':
 			m->verbose = 1;
 			break;
+		case 'V':
+			add_variant(m, optarg);
+			break;
 		case 'w':
 			ll_extend(m->web_seed_list, get_slist(optarg));
 			break;
 		case 'x':
 			m->cross_seed = 1;
 			break;
+		case 'y':
+			m->verify_path = optarg;
+			break;
+		case 'Y':
+			FATAL_IF0(atoi(optarg) <= 0 || atoi(optarg) > 100,
+				"the sample must be a percentage from 1 to 100\n");
+			m->sample = atoi(optarg);
+			break;
+		case 'Z':
+			m->fast_resume |= get_fast_resume(optarg);
+			break;
 		case '?':
 			fatal("use -h for help.\n");
 		}
+
+		prev = optind;
 	}
 
-	/* check that the user provided a file or directory from which to create the torrent */
-	FATAL_IF0(optind >= argc,
-		"must specify the contents, use -h for help\n");
+	/* nothing but the result goes to standard output
+	   in machine readable mode, the banner is printed
+	   once the options are checked */
+	if (m->machine_readable)
+		m->verbose = 0;
+
+	FATAL_IF0(m->progress && !m->machine_readable,
+		"-g can only be used with -j\n");
 
 #ifdef USE_PTHREADS
-	/* check the number of threads */
-	if (m->threads) {
-		FATAL_IF0(m->threads > 20,
-			"the number of threads is limited to at most 20\n");
-	} else {
-#ifdef _SC_NPROCESSORS_ONLN
-		m->threads = sysconf(_SC_NPROCESSORS_ONLN);
+	/* spread over the nodes of the CPUs we may run on */
+	if (m->numa && m->cpus == NULL)
+		m->cpus = allowed_cpus(&m->cpu_count);
+
+	/* use a thread for every CPU by default */
+	if (m->threads == 0 && m->cpus)
+		m->threads = m->cpu_count;
+	else if (m->threads == 0) {
+		m->threads = available_cpus();
 		if (m->threads <= 0)
-#endif
 			m->threads = 2; /* some sane default */
 	}
 #endif
 
+	/* every job of the job file or the socket is run with
+	   the other options given, the jobs running at once
+	   hash with the threads of a single run together */
+	if (m->batch_path || m->socket_path) {
+		FATAL_IF0(optind < argc,
+			"the targets are given in the jobs with -B and -L\n");
+		FATAL_IF0(edit || (m->batch_path && m->socket_path),
+			"-B, -E and -L cannot be used together\n");
+
+		m->batch_args = ll_new();
+		FATAL_IF0(m->batch_args == NULL, "out of memory\n");
+
+		for (int i = 1; i < argc; i++)
+			if ((i < batch_start || i >= batch_end)
+					&& strcmp(argv[i], "--"))
+				FATAL_IF0(ll_append(m->batch_args, argv[i], 0) == NULL,
+					"out of memory\n");
+
+		/* the paths given are those of the jobs, not ours to free */
+		m->metainfo_file_path = m->cache_path = NULL;
+		m->update_path = m->verify_path = NULL;
+
+		if (!m->machine_readable)
+			print_banner();
+		return;
+	}
+
+	/* check that the user provided a file or directory from which to create the torrent */
+	FATAL_IF0(optind >= argc,
+		"must specify the contents, use -h for help\n");
+
+	/* the rest are the metainfo files to edit, whose info is kept */
+	if (edit) {
+		FATAL_IF0(m->private || m->source || m->cross_seed,
+			"-p, -s and -x change the info hash, they cannot be "
+			"used with -E\n");
+		FATAL_IF0(m->metainfo_file_path || m->cache_path
+			|| m->update_path || m->verify_path,
+			"-E edits the files in place, -K, -o, -U and -y cannot "
+			"be used with it\n");
+
+		m->edit_list = ll_new();
+		FATAL_IF0(m->edit_list == NULL, "out of memory\n");
+
+		for (; optind < argc; optind++)
+			FATAL_IF0(ll_append(m->edit_list, argv[optind], 0) == NULL,
+				"out of memory\n");
+
+		if (!m->machine_readable)
+			print_banner();
+		return;
+	}
+
+	/* what we hash is taken from the metainfo file we verify against */
+	FATAL_IF0((m->sample || m->stop_at_mismatch) && m->verify_path == NULL,
+		"-Y and -Q can only be used with -y\n");
+	FATAL_IF0(m->verify_path && (m->piece_length_count || m->cache_path
+			|| m->update_path || m->resume
+			|| !LL_IS_EMPTY(m->variant_list)),
+		"-k, -K, -l, -U and -V cannot be used with -y\n");
+
+	FATAL_IF0((m->max_pieces || m->max_metainfo)
+			&& (m->piece_length_count || m->verify_path),
+		"-T cannot be used with -l or -y\n");
+
+	/* every byte of a file is summed, none may be taken from elsewhere */
+	FATAL_IF0(m->checksums && (m->verify_path || m->cache_path
+			|| m->update_path || m->resume),
+		"-D cannot be used with -k, -K, -U and -y\n");
+
+	/* if user did specify piece lengths, verify their validity */
+	for (unsigned int i = 0; i < m->piece_length_count; i++) {
+		FATAL_IF0(m->piece_lengths[i] < 15 || m->piece_lengths[i] > 28,
+			"the piece length must be a number between 15 and 28.\n");
+
+		for (unsigned int j = 0; j < i; j++)
+			FATAL_IF(m->piece_lengths[i] == m->piece_lengths[j],
+				"the piece length %u is given more than once\n",
+				m->piece_lengths[i]);
+	}
+
+	/* every file starts a new piece in v2, and hybrid torrents
+	   pad the files of the v1 file list to match */
+	FATAL_IF0((m->meta_version & META_V2) && m->piece_length_count > 1,
+		"v2 torrents can only be created with one piece length\n");
+	FATAL_IF0(m->pad_files && m->piece_length_count > 1,
+		"pad files can only be used with one piece length\n");
+
+	/* rTorrent doesn't know pad files, it would look for them */
+	FATAL_IF0((m->fast_resume & RESUME_RTORRENT)
+			&& (m->pad_files || (m->meta_version & META_V2)),
+		"rTorrent fast resume data cannot be written with pad files, "
+		"or for v2 and hybrid torrents\n");
+
+	/* the threads started from now on inherit the priority */
+	if (m->idle)
+		set_idle_priority();
+
 	/* strip ending DIRSEP's from target */
 	strip_ending_dirseps(argv[optind]);
 
@@ -557,7 +1543,51 @@ EXPORT void init(struct metafile *m, int argc, char *argv[])
 		m->torrent_name = basename(argv[optind]);
 
 	/* make sure m->metainfo_file_path is the absolute path to the file */
-	set_absolute_file_path(m);
+	FATAL_IF0(m->metainfo_file_path && !LL_IS_EMPTY(m->variant_list),
+		"-o cannot be used with -V, give every variant an output\n");
+
+	m->metainfo_file_path = get_absolute_file_path(m->metainfo_file_path,
+		m->torrent_name);
+
+	/* the cache and the torrents we update and verify against are
+	   found after we change to the target directory */
+	if (m->cache_path)
+		m->cache_path = get_absolute_file_path(m->cache_path, NULL);
+	if (m->update_path)
+		m->update_path = get_absolute_file_path(m->update_path, NULL);
+	if (m->verify_path)
+		m->verify_path = get_absolute_file_path(m->verify_path, NULL);
+
+	/* the fast resume data tells clients the directory the content is
+	   in, where they look for it by the name of the torrent */
+	if (m->fast_resume) {
+		char *p;
+
+		m->save_path = get_absolute_file_path(argv[optind], NULL);
+		p = strrchr(m->save_path, DIRSEP_CHAR);
+		if (p == m->save_path)
+			p++;
+		*p = '\0';
+
+		if (strcmp(basename(argv[optind]), m->torrent_name))
+			fprintf(stderr, "warning: the content isn't named as the "
+				"torrent, clients won't find it in '%s'\n",
+				m->save_path);
+	}
+
+	/* and so are the paths of the variants */
+	LL_FOR(variant_node, m->variant_list) {
+		struct variant *v = LL_DATA_AS(variant_node, struct variant*);
+
+		FATAL_IF0(v->metainfo_file_path == NULL,
+			"every variant needs an output, use -h for help\n");
+
+		v->metainfo_file_path = get_absolute_file_path(
+			v->metainfo_file_path, m->torrent_name);
+	}
+
+	if (!m->machine_readable)
+		print_banner();
 
 	/* if we should be verbose print out all the options
 	   as we have set them */
@@ -571,15 +1601,36 @@ EXPORT void init(struct metafile *m, int argc, char *argv[])
 		FATAL_IF(chdir(argv[optind]), "cannot change directory to '%s': %s\n",
 			argv[optind], strerror(errno));
 
-		if (file_tree_walk("." DIRSEP, MAX_OPENFD, process_node, m))
+		if (m->verify_path == NULL
+				&& file_tree_walk("." DIRSEP, MAX_OPENFD, process_node, m))
 			exit(EXIT_FAILURE);
 	}
 
-	ll_sort(m->file_list, file_data_cmp_by_name);
+	/* the files of the metainfo file we verify against are hashed
+	   in its order */
+	if (m->verify_path)
+		verify_target(m);
+	/* v2 torrents list the files in the order of the file tree,
+	   which hybrid torrents must use for the v1 file list too */
+	else if (m->meta_version & META_V2)
+		ll_sort(m->file_list, file_data_cmp_by_tree);
+	else
+		ll_sort(m->file_list, file_data_cmp_by_name);
+
+	/* take the piece length of the torrent we update, so
+	   its pieces can be used */
+	if (m->piece_length_count == 0 && m->update_path
+			&& m->max_pieces == 0 && m->max_metainfo == 0)
+		m->piece_length = update_piece_length(m->update_path);
+
+	/* or by the policy given */
+	if (m->piece_length_count == 0 && m->piece_length == 0
+			&& (m->max_pieces || m->max_metainfo))
+		m->piece_length = policy_piece_length(m);
 
 	/* determine the piece length based on the torrent size if
 	   it was not user specified. */
-	if (m->piece_length == 0) {
+	if (m->piece_length_count == 0) {
 		int i;
 		for (i = 15; i < num_piece_len_maxes &&
 			m->piece_length == 0; i++)
@@ -587,24 +1638,62 @@ EXPORT void init(struct metafile *m, int argc, char *argv[])
 				m->piece_length = i;
 		if (m->piece_length == 0)
 			m->piece_length = num_piece_len_maxes;
-	} else {
-		/* if user did specify a piece length, verify its validity */
-		FATAL_IF0(m->piece_length < 15 || m->piece_length > 28,
-			"the piece length must be a number between 15 and 28.\n");
+		m->piece_lengths[m->piece_length_count++] = m->piece_length;
 	}
 
-	/* convert the piece length from power of 2 to an integer. */
-	m->piece_length = 1 << m->piece_length;
+	/* convert the piece lengths from power of 2 to an integer. */
+	for (unsigned int i = 0; i < m->piece_length_count; i++)
+		m->piece_lengths[i] = 1 << m->piece_lengths[i];
+	m->piece_length = m->piece_lengths[0];
 
 	/* calculate the number of pieces
 	   pieces = ceil( size / piece_length ) */
 	m->pieces = (m->size + m->piece_length - 1) / m->piece_length;
 
+	/* every file starts a new piece in v2, and hybrid torrents
+	   pad the files of the v1 file list to match */
+	if (m->meta_version & META_V2)
+		m->pad_files = 1;
+
+	if (m->pad_files) {
+		m->pieces = 0;
+		LL_FOR(file_node, m->file_list) {
+			struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+			f->piece = m->pieces;
+			m->pieces += (f->size + m->piece_length - 1) / m->piece_length;
+		}
+
+		if (m->meta_version & META_V2)
+			m->v2_pieces = m->pieces;
+	}
+
+#ifdef USE_PTHREADS
+	/* the files are summed in order, so the stream of all the files
+	   is read by a single reader, while several may still read the
+	   files when every file starts a new piece */
+	if (m->checksums && !m->pad_files) {
+		if (m->readers > 1)
+			fprintf(stderr, "warning: the files are read by a single "
+				"reader with -D, unless every file starts a new piece\n");
+		m->readers = 1;
+	}
+#endif
+
+	/* files with the same content need only be read once */
+	find_duplicates(m);
+
 	/* now print the size and piece count if we should be verbose */
-	if (m->verbose)
-		printf("\n%" PRIuMAX " bytes in all\n"
-			"that's %u pieces of %u bytes each\n\n",
-			m->size, m->pieces, m->piece_length);
+	if (m->verbose) {
+		printf("\n%" PRIuMAX " bytes in all\n", m->size);
+		for (unsigned int i = 0; i < m->piece_length_count; i++) {
+			uintmax_t pieces = m->pad_files ? m->pieces :
+				(m->size + m->piece_lengths[i] - 1) / m->piece_lengths[i];
+
+			printf("that's %" PRIuMAX " pieces of %u bytes each\n",
+				pieces, m->piece_lengths[i]);
+		}
+		printf("\n");
+	}
 }
 
 EXPORT void cleanup_metafile(struct metafile *m)
@@ -617,5 +1706,25 @@ EXPORT void cleanup_metafile(struct metafile *m)
 
 	ll_free(m->exclude_list, NULL);
 
+	ll_free(m->include_list, NULL);
+
+	ll_free(m->edit_list, NULL);
+
+	ll_free(m->batch_args, NULL);
+
+	ll_free(m->variant_list, variant_clear);
+
 	free(m->metainfo_file_path);
+
+	free(m->cache_path);
+
+	free(m->update_path);
+
+	free(m->verify_path);
+
+	free(m->save_path);
+
+#ifdef USE_PTHREADS
+	free(m->cpus);
+#endif
 }
@@ -6,5 +6,6 @@
 
 EXPORT void init(struct metafile *m, int argc, char *argv[]);
 EXPORT void cleanup_metafile(struct metafile *m);
+EXPORT int job_option_refused(int argc, char *argv[]);
 
 #endif /* MKTORRENT_INIT_H */
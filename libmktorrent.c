@@ -0,0 +1,520 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* malloc(), free(), mkdtemp(), getenv() */
+#include <stdio.h>        /* fdopen(), getline(), tmpfile() etc. */
+#include <string.h>       /* strdup(), strchr(), strstr() */
+#include <errno.h>        /* errno */
+#include <signal.h>       /* kill(), sigemptyset() etc. */
+#include <stdatomic.h>    /* atomic_int etc. */
+#include <dirent.h>       /* opendir(), readdir() etc. */
+#include <fcntl.h>        /* fcntl(), O_RDONLY */
+#include <spawn.h>        /* posix_spawnp() etc. */
+#include <sys/types.h>    /* pid_t */
+#include <sys/wait.h>     /* waitpid() */
+#include <unistd.h>       /* pipe(), close(), unlink(), rmdir() */
+
+#include "libmktorrent.h"
+
+/* the mktorrent program the runs start, unless the MKTORRENT
+   environment variable names another. 'make library' sets it to
+   where 'make install' puts it */
+#ifndef MKTORRENT_PROGRAM
+#define MKTORRENT_PROGRAM "mktorrent"
+#endif
+
+/* the options the library takes care of itself, or that don't write
+   a single metainfo file */
+#define RESERVED_OPTIONS "BEghjLoVy"
+
+/* the options that write files next to the metainfo file,
+   which need -o to be kept */
+#define SIDECAR_OPTIONS "DZ"
+
+extern char **environ;
+
+
+struct mktorrent {
+	char **options;          /* the options given, one after the other */
+	int option_count;
+	char *output;            /* the metainfo file to write, or NULL for
+	                            a temporary one */
+	int sidecars;            /* an option writes files next to it */
+	unsigned char *metainfo; /* what was written by the last run */
+	size_t metainfo_len;
+	char info_hash[65];      /* of the last run, in hex */
+	char message[256];       /* why the last run failed */
+	atomic_int pid;          /* of the child running, 0 if none */
+	atomic_int canceled;
+};
+
+
+/*
+ * make a torrent to create, NULL if out of memory
+ */
+struct mktorrent *mktorrent_new(void)
+{
+	struct mktorrent *t = calloc(1, sizeof(*t));
+
+	if (t) {
+		atomic_init(&t->pid, 0);
+		atomic_init(&t->canceled, 0);
+	}
+
+	return t;
+}
+
+void mktorrent_free(struct mktorrent *t)
+{
+	if (t == NULL)
+		return;
+
+	for (int i = 0; i < t->option_count; i++)
+		free(t->options[i]);
+	free(t->options);
+	free(t->output);
+	free(t->metainfo);
+	free(t);
+}
+
+static int add_argument(struct mktorrent *t, const char *s)
+{
+	char **options;
+	char *copy = strdup(s);
+
+	options = realloc(t->options,
+		(t->option_count + 1) * sizeof(*t->options));
+	if (copy == NULL || options == NULL) {
+		free(copy);
+		if (options)
+			t->options = options;
+		return MKTORRENT_ERR_NOMEM;
+	}
+
+	t->options = options;
+	t->options[t->option_count++] = copy;
+
+	return MKTORRENT_OK;
+}
+
+/*
+ * set an option of mktorrent by its letter, with the value given or
+ * NULL if it takes none. the options are checked when the torrent
+ * is created, -o sets the file the metainfo is written to as well
+ */
+int mktorrent_option(struct mktorrent *t, char option, const char *value)
+{
+	char s[3] = { '-', option, '\0' };
+	int r;
+
+	if (option == 'o') {
+		char *output;
+
+		if (value == NULL)
+			return MKTORRENT_ERR_OPTION;
+		output = strdup(value);
+		if (output == NULL)
+			return MKTORRENT_ERR_NOMEM;
+		free(t->output);
+		t->output = output;
+		return MKTORRENT_OK;
+	}
+
+	if (option == '\0' || strchr(RESERVED_OPTIONS, option))
+		return MKTORRENT_ERR_OPTION;
+
+	r = add_argument(t, s);
+	if (r == MKTORRENT_OK && value)
+		r = add_argument(t, value);
+	if (r == MKTORRENT_OK && strchr(SIDECAR_OPTIONS, option))
+		t->sidecars = 1;
+
+	return r;
+}
+
+/*
+ * include a file, or a directory, of the target by its path in it.
+ * every file is included if none is added
+ */
+int mktorrent_add_file(struct mktorrent *t, const char *path)
+{
+	char *pattern = malloc(2 * strlen(path) + 1);
+	char *p = pattern;
+	int r;
+
+	if (pattern == NULL)
+		return MKTORRENT_ERR_NOMEM;
+
+	/* the path is matched as it is, with its wildcards and
+	   the commas the patterns of -F are separated by escaped */
+	for (; *path; path++) {
+		if (strchr("*?[\\,", *path))
+			*p++ = '\\';
+		*p++ = *path;
+	}
+	*p = '\0';
+
+	r = add_argument(t, "-F");
+	if (r == MKTORRENT_OK)
+		r = add_argument(t, pattern);
+	free(pattern);
+
+	return r;
+}
+
+/*
+ * cancel the run going on, from another thread or a signal handler
+ */
+void mktorrent_cancel(struct mktorrent *t)
+{
+	pid_t pid = atomic_load(&t->pid);
+
+	atomic_store(&t->canceled, 1);
+	if (pid > 0)
+		kill(pid, SIGTERM);
+}
+
+const unsigned char *mktorrent_metainfo(const struct mktorrent *t,
+		size_t *len)
+{
+	*len = t->metainfo_len;
+	return t->metainfo;
+}
+
+const char *mktorrent_info_hash(const struct mktorrent *t)
+{
+	return t->info_hash;
+}
+
+const char *mktorrent_message(const struct mktorrent *t)
+{
+	return t->message;
+}
+
+/*
+ * remove the temporary directory of a run and the files in it
+ */
+static void remove_directory(const char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *de;
+
+	if (dir == NULL)
+		return;
+
+	while ((de = readdir(dir)) != NULL) {
+		char *p;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		p = malloc(strlen(path) + strlen(de->d_name) + 2);
+		if (p == NULL)
+			continue;
+		sprintf(p, "%s/%s", path, de->d_name);
+		unlink(p);
+		free(p);
+	}
+
+	closedir(dir);
+	rmdir(path);
+}
+
+/*
+ * read the metainfo file written into memory
+ */
+static int read_metainfo(struct mktorrent *t, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	long len;
+
+	if (f == NULL || fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0
+			|| fseek(f, 0, SEEK_SET)) {
+		snprintf(t->message, sizeof(t->message), "cannot read '%s': %s",
+			path, strerror(errno));
+		if (f)
+			fclose(f);
+		return MKTORRENT_ERR_SYSTEM;
+	}
+
+	t->metainfo = malloc(len ? len : 1);
+	if (t->metainfo == NULL) {
+		fclose(f);
+		return MKTORRENT_ERR_NOMEM;
+	}
+
+	t->metainfo_len = fread(t->metainfo, 1, len, f);
+	fclose(f);
+
+	if (t->metainfo_len != (size_t) len) {
+		snprintf(t->message, sizeof(t->message), "cannot read '%s'", path);
+		return MKTORRENT_ERR_SYSTEM;
+	}
+
+	return MKTORRENT_OK;
+}
+
+/*
+ * take the info hash from the result mktorrent printed,
+ * the v1 one if there is one
+ */
+static void take_info_hash(struct mktorrent *t, const char *line)
+{
+	const char *keys[] = { "\"info_hash\": \"", "\"info_hash_v2\": \"" };
+
+	for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+		const char *s = strstr(line, keys[i]);
+		size_t n = 0;
+
+		if (s == NULL)
+			continue;
+
+		s += strlen(keys[i]);
+		while (n < sizeof(t->info_hash) - 1 && s[n] && s[n] != '"') {
+			t->info_hash[n] = s[n];
+			n++;
+		}
+		t->info_hash[n] = '\0';
+		return;
+	}
+}
+
+/*
+ * start mktorrent with the arguments given, writing its standard output
+ * to a pipe and its standard error to the file given, and reading
+ * nothing. the signals a run is canceled with are left to their
+ * default in it. returns its process id, or -1 with errno set
+ */
+static pid_t spawn(char **argv, int out, int err)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t signals;
+	pid_t pid = -1;
+	int r;
+
+	r = posix_spawn_file_actions_init(&actions);
+	if (r) {
+		errno = r;
+		return -1;
+	}
+	r = posix_spawnattr_init(&attr);
+	if (r) {
+		posix_spawn_file_actions_destroy(&actions);
+		errno = r;
+		return -1;
+	}
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGPIPE);
+	r = posix_spawnattr_setsigdefault(&attr, &signals);
+	if (r == 0) {
+		sigemptyset(&signals);
+		r = posix_spawnattr_setsigmask(&attr, &signals);
+	}
+	if (r == 0)
+		r = posix_spawnattr_setflags(&attr,
+			POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+	if (r == 0)
+		r = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+			"/dev/null", O_RDONLY, 0);
+	if (r == 0)
+		r = posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+	if (r == 0)
+		r = posix_spawn_file_actions_adddup2(&actions, err, STDERR_FILENO);
+
+	if (r == 0)
+		r = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (r) {
+		errno = r;
+		return -1;
+	}
+	return pid;
+}
+
+/*
+ * hash the target and create the torrent, as mktorrent does with the
+ * options given. the progress is passed to the callback, if any.
+ * the metainfo is kept in memory, and in the file set with -o
+ */
+int mktorrent_run(struct mktorrent *t, const char *target,
+		mktorrent_progress progress, void *arg)
+{
+	char tmp[4096] = "";
+	char *output = t->output;
+	const char *program = getenv("MKTORRENT");
+	char **argv;
+	int argc = 0;
+	int fds[2];
+	FILE *out, *err;
+	char *line = NULL;
+	size_t size = 0;
+	int status;
+	pid_t pid, w;
+	int r = MKTORRENT_OK;
+
+	free(t->metainfo);
+	t->metainfo = NULL;
+	t->metainfo_len = 0;
+	t->info_hash[0] = '\0';
+	t->message[0] = '\0';
+	atomic_store(&t->canceled, 0);
+
+	/* what they write would be removed with the temporary file */
+	if (output == NULL && t->sidecars) {
+		snprintf(t->message, sizeof(t->message),
+			"-D and -Z write files next to the metainfo file, "
+			"they need -o");
+		return MKTORRENT_ERR_OPTION;
+	}
+
+	/* without -o the metainfo file is written to a temporary
+	   directory, which is removed after */
+	if (output == NULL) {
+		const char *dir = getenv("TMPDIR");
+
+		snprintf(tmp, sizeof(tmp) - 10, "%s/libmktorrent.XXXXXX",
+			dir && *dir ? dir : "/tmp");
+		if (mkdtemp(tmp) == NULL) {
+			snprintf(t->message, sizeof(t->message),
+				"cannot create a temporary directory: %s",
+				strerror(errno));
+			return MKTORRENT_ERR_SYSTEM;
+		}
+		strcat(tmp, "/torrent");
+		output = tmp;
+	}
+
+	/* mktorrent -j -g <options> -f -o <output> -- <target> NULL */
+	argv = malloc((t->option_count + 9) * sizeof(*argv));
+	if (argv == NULL) {
+		r = MKTORRENT_ERR_NOMEM;
+		goto out;
+	}
+	argv[argc++] = (char *) (program && *program ?
+		program : MKTORRENT_PROGRAM);
+	argv[argc++] = "-j";
+	argv[argc++] = "-g";
+	for (int i = 0; i < t->option_count; i++)
+		argv[argc++] = t->options[i];
+	if (output == tmp)
+		argv[argc++] = "-f";
+	argv[argc++] = "-o";
+	argv[argc++] = output;
+	argv[argc++] = "--";
+	argv[argc++] = (char *) target;
+	argv[argc] = NULL;
+
+	err = tmpfile();
+	if (err == NULL || pipe(fds)) {
+		snprintf(t->message, sizeof(t->message),
+			"cannot create a pipe: %s", strerror(errno));
+		if (err)
+			fclose(err);
+		free(argv);
+		r = MKTORRENT_ERR_SYSTEM;
+		goto out;
+	}
+
+	/* the programs the caller starts meanwhile don't get them */
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	fcntl(fileno(err), F_SETFD, FD_CLOEXEC);
+
+	pid = spawn(argv, fds[1], fileno(err));
+	close(fds[1]);
+	if (pid < 0) {
+		snprintf(t->message, sizeof(t->message),
+			"cannot run '%s': %s", argv[0], strerror(errno));
+		close(fds[0]);
+		fclose(err);
+		free(argv);
+		r = MKTORRENT_ERR_SYSTEM;
+		goto out;
+	}
+	free(argv);
+
+	atomic_store(&t->pid, pid);
+	if (atomic_load(&t->canceled))
+		kill(pid, SIGTERM);
+
+	out = fdopen(fds[0], "r");
+
+	/* the progress until the result */
+	while (out && getline(&line, &size, out) > 0) {
+		unsigned long hashed, pieces;
+
+		if (sscanf(line, "{\"hashed\": %lu, \"pieces\": %lu}",
+				&hashed, &pieces) == 2) {
+			if (progress && progress(arg, hashed, pieces))
+				mktorrent_cancel(t);
+		} else if (t->info_hash[0] == '\0')
+			take_info_hash(t, line);
+	}
+	free(line);
+	if (out)
+		fclose(out);
+	else
+		close(fds[0]);
+
+	while ((w = waitpid(pid, &status, 0)) < 0 && errno == EINTR)
+		;
+	atomic_store(&t->pid, 0);
+
+	/* a run canceled once it was done still succeeds */
+	if (w < 0) {
+		snprintf(t->message, sizeof(t->message),
+			"cannot wait for mktorrent: %s", strerror(errno));
+		r = MKTORRENT_ERR_SYSTEM;
+	} else if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+		r = read_metainfo(t, output);
+	} else if (atomic_load(&t->canceled)) {
+		r = MKTORRENT_ERR_CANCELED;
+	} else {
+		size_t len;
+
+		/* what it wrote to standard error tells why */
+		rewind(err);
+		len = fread(t->message, 1, sizeof(t->message) - 1, err);
+		while (len && t->message[len - 1] == '\n')
+			len--;
+		t->message[len] = '\0';
+		if (len == 0)
+			snprintf(t->message, sizeof(t->message),
+				"mktorrent failed");
+		r = MKTORRENT_ERR_FAILED;
+	}
+
+	fclose(err);
+
+out:
+	if (output == tmp) {
+		*strrchr(tmp, '/') = '\0';
+		remove_directory(tmp);
+	}
+
+	return r;
+}
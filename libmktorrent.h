@@ -0,0 +1,88 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+/*
+ * libmktorrent, built with 'make library', creates torrents from
+ * a program. a torrent is set up with the options of mktorrent and
+ * the files to include, and created with mktorrent_run(), which
+ * returns one of the error codes below instead of exiting.
+ *
+ * every run starts the mktorrent program installed with
+ * 'make install', or the one the MKTORRENT environment variable names,
+ * with posix_spawn(). it creates the torrent as mktorrent -j would,
+ * and the result, the progress and the errors are read back from it.
+ * nothing runs in the caller's process but the library, so it may be
+ * called from a program with threads of its own. the pipe and the
+ * file a run uses are closed on exec, the other files of the caller
+ * are passed on to mktorrent unless they are too.
+ *
+ * without -o the metainfo file is written to a temporary directory
+ * that is removed after, so -D and -Z, which write files next to it,
+ * need -o.
+ */
+
+#ifndef LIBMKTORRENT_H
+#define LIBMKTORRENT_H
+
+#include <stddef.h>       /* size_t */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the error codes */
+#define MKTORRENT_OK           0
+#define MKTORRENT_ERR_NOMEM    1  /* out of memory */
+#define MKTORRENT_ERR_OPTION   2  /* an option the library doesn't take,
+                                     or -D or -Z without -o */
+#define MKTORRENT_ERR_SYSTEM   3  /* cannot run mktorrent, create a pipe
+                                     or read the metainfo file written */
+#define MKTORRENT_ERR_FAILED   4  /* creating the torrent failed, the
+                                     message tells why */
+#define MKTORRENT_ERR_CANCELED 5  /* canceled while hashing */
+
+/* a torrent to create */
+struct mktorrent;
+
+/*
+ * called with the number of pieces hashed so far, now and then while
+ * hashing. returning non-zero cancels the run
+ */
+typedef int (*mktorrent_progress)(void *arg, unsigned long hashed,
+		unsigned long pieces);
+
+struct mktorrent *mktorrent_new(void);
+void mktorrent_free(struct mktorrent *t);
+
+int mktorrent_option(struct mktorrent *t, char option, const char *value);
+int mktorrent_add_file(struct mktorrent *t, const char *path);
+
+int mktorrent_run(struct mktorrent *t, const char *target,
+		mktorrent_progress progress, void *arg);
+void mktorrent_cancel(struct mktorrent *t);
+
+const unsigned char *mktorrent_metainfo(const struct mktorrent *t,
+		size_t *len);
+const char *mktorrent_info_hash(const struct mktorrent *t);
+const char *mktorrent_message(const struct mktorrent *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBMKTORRENT_H */
@@ -0,0 +1,223 @@
+/*
+ * MD5 in C
+ * Written from the description in RFC 1321
+ * for mktorrent
+ * 100% Public Domain
+ */
+
+/* #define MD5_TEST */
+
+
+#ifdef MD5_TEST
+#include <stdio.h>
+#endif
+
+#include <string.h>
+#include <stdint.h>
+
+#include "export.h"
+#include "md5.h"
+
+#define ROTL(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+#define MD5_F(x,y,z) (((x) & (y)) | (~(x) & (z)))
+#define MD5_G(x,y,z) (((x) & (z)) | ((y) & ~(z)))
+#define MD5_H(x,y,z) ((x) ^ (y) ^ (z))
+#define MD5_I(x,y,z) ((y) ^ ((x) | ~(z)))
+
+/* the integer part of 2^32 * abs(sin(i + 1)) */
+static const uint32_t sines[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+	0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+	0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+	0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+/* the rotation of every step of the four rounds */
+static const unsigned int shifts[16] = {
+	7, 12, 17, 22,
+	5,  9, 14, 20,
+	4, 11, 16, 23,
+	6, 10, 15, 21
+};
+
+
+/* Hash a single 512-bit block. This is the core of the algorithm. */
+static void MD5_Transform(uint32_t state[4], const uint8_t buffer[64])
+{
+	uint32_t a, b, c, d, f, t;
+	uint32_t x[16];
+	unsigned int g;
+	int i;
+
+	/* the block is read little endian */
+	for (i = 0; i < 16; i++)
+		x[i] = (uint32_t) buffer[4*i]
+			| (uint32_t) buffer[4*i + 1] << 8
+			| (uint32_t) buffer[4*i + 2] << 16
+			| (uint32_t) buffer[4*i + 3] << 24;
+
+	/* Copy context->state[] to working vars */
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+
+	/* 4 rounds of 16 steps, each taking the words in another order */
+	for (i = 0; i < 64; i++) {
+		switch (i >> 4) {
+		case 0:
+			f = MD5_F(b, c, d);
+			g = i;
+			break;
+		case 1:
+			f = MD5_G(b, c, d);
+			g = (5*i + 1) & 15;
+			break;
+		case 2:
+			f = MD5_H(b, c, d);
+			g = (3*i + 5) & 15;
+			break;
+		default:
+			f = MD5_I(b, c, d);
+			g = (7*i) & 15;
+			break;
+		}
+
+		t = d;
+		d = c;
+		c = b;
+		b = b + ROTL(a + f + sines[i] + x[g], shifts[(i >> 4) * 4 + (i & 3)]);
+		a = t;
+	}
+
+	/* Add the working vars back into context.state[] */
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+/* MD5_Init - Initialize new context */
+EXPORT void MD5_Init(MD5_CTX *context)
+{
+	/* MD5 initialization constants */
+	context->state[0] = 0x67452301;
+	context->state[1] = 0xefcdab89;
+	context->state[2] = 0x98badcfe;
+	context->state[3] = 0x10325476;
+	context->count = 0;
+}
+
+/* Run your data through this. */
+EXPORT void MD5_Update(MD5_CTX *context, const uint8_t *data, unsigned long len)
+{
+	size_t i, j;
+
+	j = context->count & 63;
+	context->count += len;
+
+	if ((j + len) > 63) {
+		memcpy(&context->buffer[j], data, (i = 64-j));
+		MD5_Transform(context->state, context->buffer);
+		for ( ; i + 63 < len; i += 64) {
+			MD5_Transform(context->state, data + i);
+		}
+		j = 0;
+	} else
+		i = 0;
+
+	memcpy(&context->buffer[j], &data[i], len - i);
+}
+
+/* Add padding and return the message digest. */
+EXPORT void MD5_Final(uint8_t *digest, MD5_CTX *context)
+{
+	uint64_t bits = context->count << 3;
+	uint8_t  finalcount[8];
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		/* Endian independent, the length is little endian */
+		finalcount[i] = (uint8_t) (bits >> (i * 8));
+	}
+
+	MD5_Update(context, (uint8_t *)"\200", 1);
+	while ((context->count & 63) != 56) {
+		MD5_Update(context, (uint8_t *)"\0", 1);
+	}
+	MD5_Update(context, finalcount, 8);  /* Should cause a MD5_Transform() */
+	for (i = 0; i < MD5_DIGEST_LENGTH; i++) {
+		digest[i] = (uint8_t)
+			((context->state[i>>2] >> ((i & 3) * 8)) & 255);
+	}
+}
+
+
+/*************************************************************\
+ * Self Test                                                 *
+\*************************************************************/
+#ifdef MD5_TEST
+/*
+Test Vectors (from RFC 1321)
+
+""
+  D41D8CD9 8F00B204 E9800998 ECF8427E
+"abc"
+  90015098 3CD24FB0 D6963F7D 28E17F72
+"12345678901234567890123456789012345678901234567890123456789012345678901234567890"
+  57EDF4A2 2BE3C955 AC49DA2E 2107B67A
+*/
+static char *test_data[] = {
+	"",
+	"abc",
+	"12345678901234567890123456789012345678901234567890123456789012345678901234567890"};
+static char *test_results[] = {
+	"D41D8CD98F00B204E9800998ECF8427E",
+	"900150983CD24FB0D6963F7D28E17F72",
+	"57EDF4A22BE3C955AC49DA2E2107B67A"};
+
+int main(int argc, char *argv[])
+{
+	int k, i;
+	MD5_CTX context;
+	uint8_t digest[MD5_DIGEST_LENGTH];
+	char output[2*MD5_DIGEST_LENGTH + 1];
+
+	fprintf(stdout, "Verifying MD5 implementation... ");
+	fflush(stdout);
+
+	for (k = 0; k < 3; k++){
+		MD5_Init(&context);
+		MD5_Update(&context, (uint8_t *)test_data[k], strlen(test_data[k]));
+		MD5_Final(digest, &context);
+		for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+			sprintf(output + 2*i, "%02X", digest[i]);
+
+		if (strcmp(output, test_results[k])) {
+			fprintf(stdout, "FAIL\n");
+			fprintf(stderr,"* hash of \"%s\" incorrect:\n", test_data[k]);
+			fprintf(stderr,"\t%s returned\n", output);
+			fprintf(stderr,"\t%s is correct\n", test_results[k]);
+			return 1;
+		}
+	}
+
+	/* success */
+	fprintf(stdout, "OK\n");
+	fflush(stdout);
+	return 0;
+}
+#endif /* MD5_TEST */
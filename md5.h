@@ -0,0 +1,25 @@
+/* Public API for mktorrent's public domain MD5 implementation */
+/* This file is in the public domain */
+
+
+#ifndef MKTORRENT_MD5_H
+#define MKTORRENT_MD5_H
+
+#include <stdint.h>  /* uintX_t */
+
+#include "export.h"  /* EXPORT */
+
+typedef struct {
+    uint32_t state[4];
+    uint64_t count;
+    uint8_t  buffer[64];
+} MD5_CTX;
+
+#define MD5_DIGEST_LENGTH 16
+
+
+EXPORT void MD5_Init(MD5_CTX *context);
+EXPORT void MD5_Update(MD5_CTX *context, const uint8_t *data, unsigned long len);
+EXPORT void MD5_Final(uint8_t *digest, MD5_CTX *context);
+
+#endif /* MKTORRENT_MD5_H */
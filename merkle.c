@@ -0,0 +1,184 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <string.h>       /* memcpy(), memset() */
+#include <stdint.h>       /* uintmax_t */
+
+#ifdef USE_OPENSSL
+#include <openssl/sha.h>  /* SHA256() */
+#else
+#include "sha256.h"
+#endif
+
+#include "export.h"
+#include "mktorrent.h"
+#include "merkle.h"
+
+static void hash_pair(unsigned char *dest, const unsigned char *left,
+		const unsigned char *right)
+{
+	SHA256_CTX c;
+
+	SHA256_Init(&c);
+	SHA256_Update(&c, left, SHA256_DIGEST_LENGTH);
+	SHA256_Update(&c, right, SHA256_DIGEST_LENGTH);
+	SHA256_Final(dest, &c);
+}
+
+/*
+ * add the root of a subtree of the given height to the right of the tree
+ */
+static void merkle_add(struct merkle *t, const unsigned char *hash,
+		unsigned int height)
+{
+	memcpy(t->hashes[t->count], hash, SHA256_DIGEST_LENGTH);
+	t->heights[t->count] = height;
+	t->count++;
+
+	/* join siblings of the same height */
+	while (t->count >= 2
+			&& t->heights[t->count - 1] == t->heights[t->count - 2]) {
+		t->count--;
+		hash_pair(t->hashes[t->count - 1],
+			t->hashes[t->count - 1], t->hashes[t->count]);
+		t->heights[t->count - 1]++;
+	}
+}
+
+EXPORT void merkle_init(struct merkle *t)
+{
+	t->count = 0;
+}
+
+/*
+ * hash the 16 KiB blocks of data and add them to the right of the
+ * tree as leaves, only the last block of a file may be shorter
+ */
+EXPORT void merkle_add_blocks(struct merkle *t, const unsigned char *data,
+		size_t len)
+{
+	unsigned char leaf[SHA256_DIGEST_LENGTH];
+	SHA256_CTX c;
+
+	for (size_t off = 0; off < len; off += V2_BLOCK_SIZE) {
+		size_t n = len - off;
+
+		if (n > V2_BLOCK_SIZE)
+			n = V2_BLOCK_SIZE;
+
+		SHA256_Init(&c);
+		SHA256_Update(&c, data + off, n);
+		SHA256_Final(leaf, &c);
+
+		merkle_add(t, leaf, 0);
+	}
+}
+
+/*
+ * pad the tree with subtrees of zero hashes until it is a
+ * complete tree of the given height and store its root
+ */
+EXPORT void merkle_root(struct merkle *t, unsigned char *root,
+		unsigned int height)
+{
+	unsigned char zero[MERKLE_MAX_HEIGHT + 1][SHA256_DIGEST_LENGTH];
+	unsigned int zero_height = 0;
+
+	memset(zero[0], 0, SHA256_DIGEST_LENGTH);
+
+	while (t->count > 1 || (t->count == 1 && t->heights[0] < height)) {
+		unsigned int h = t->heights[t->count - 1];
+
+		/* the root of a subtree of zero hashes of height h */
+		for (; zero_height < h; zero_height++)
+			hash_pair(zero[zero_height + 1],
+				zero[zero_height], zero[zero_height]);
+
+		merkle_add(t, zero[h], h);
+	}
+
+	if (t->count)
+		memcpy(root, t->hashes[0], SHA256_DIGEST_LENGTH);
+	else
+		memset(root, 0, SHA256_DIGEST_LENGTH);
+}
+
+/*
+ * return the height of the smallest complete tree with
+ * at least the given number of leaves
+ */
+EXPORT unsigned int merkle_height(uintmax_t leaves)
+{
+	unsigned int height = 0;
+
+	while (((uintmax_t) 1 << height) < leaves)
+		height++;
+
+	return height;
+}
+
+/*
+ * return the height of the tree to hash every piece of a file with,
+ * that is the tree over the blocks of one piece, or just the blocks
+ * of the file if it doesn't fill one piece
+ */
+EXPORT unsigned int merkle_piece_height(struct metafile *m, uintmax_t size)
+{
+	if (size < m->piece_length)
+		return merkle_height((size + V2_BLOCK_SIZE - 1) / V2_BLOCK_SIZE);
+
+	return merkle_height(m->piece_length / V2_BLOCK_SIZE);
+}
+
+/*
+ * calculate the pieces root of every file from its piece layer,
+ * layers holds the piece hashes of every file one after the other.
+ * a file no longer than one piece has a single hash, which is the
+ * root of its tree already
+ */
+EXPORT void merkle_file_roots(struct metafile *m, const unsigned char *layers)
+{
+	unsigned int piece_height =
+		merkle_height(m->piece_length / V2_BLOCK_SIZE);
+
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *f = LL_DATA_AS(file_node, struct file_data*);
+		uintmax_t pieces = (f->size + m->piece_length - 1) / m->piece_length;
+		struct merkle t;
+
+		if (pieces <= 1) {
+			if (pieces)
+				memcpy(f->pieces_root, layers, SHA256_DIGEST_LENGTH);
+			else
+				memset(f->pieces_root, 0, SHA256_DIGEST_LENGTH);
+
+			layers += pieces * SHA256_DIGEST_LENGTH;
+			continue;
+		}
+
+		merkle_init(&t);
+		for (uintmax_t i = 0; i < pieces; i++) {
+			merkle_add(&t, layers, piece_height);
+			layers += SHA256_DIGEST_LENGTH;
+		}
+
+		merkle_root(&t, f->pieces_root,
+			piece_height + merkle_height(pieces));
+	}
+}
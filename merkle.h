@@ -0,0 +1,33 @@
+#ifndef MKTORRENT_MERKLE_H
+#define MKTORRENT_MERKLE_H
+
+#include <stddef.h>      /* size_t */
+#include <stdint.h>      /* uintmax_t */
+
+#include "export.h"      /* EXPORT */
+#include "mktorrent.h"   /* struct metafile */
+
+/* a tree of 16 KiB blocks covering 2^64 bytes is 50 levels high */
+#define MERKLE_MAX_HEIGHT 64
+
+/*
+ * a merkle tree is built from left to right keeping only the roots of
+ * the complete subtrees not yet joined with their right sibling,
+ * so at most one subtree of every height is kept
+ */
+struct merkle {
+	unsigned char hashes[MERKLE_MAX_HEIGHT + 1][32];
+	unsigned int heights[MERKLE_MAX_HEIGHT + 1];
+	unsigned int count;
+};
+
+EXPORT void merkle_init(struct merkle *t);
+EXPORT void merkle_add_blocks(struct merkle *t, const unsigned char *data,
+		size_t len);
+EXPORT void merkle_root(struct merkle *t, unsigned char *root,
+		unsigned int height);
+EXPORT unsigned int merkle_height(uintmax_t leaves);
+EXPORT unsigned int merkle_piece_height(struct metafile *m, uintmax_t size);
+EXPORT void merkle_file_roots(struct metafile *m, const unsigned char *layers);
+
+#endif /* MKTORRENT_MERKLE_H */
@@ -12,6 +12,22 @@
 /* number of bytes in one MB */
 #define ONEMEG 1048576
 
+/* size of the blocks at the leaves of the v2 merkle trees */
+#define V2_BLOCK_SIZE 16384
+
+/* kinds of metainfo, a hybrid torrent is both v1 and v2 */
+#define META_V1 1
+#define META_V2 2
+
+/* clients to write fast resume data for */
+#define RESUME_LIBTORRENT 1
+#define RESUME_RTORRENT   2
+
+/* checksums of the files to compute while hashing */
+#define CHECKSUM_MD5    1
+#define CHECKSUM_SHA1   2
+#define CHECKSUM_SHA256 4
+
 /* max torrent size in MB for a given piece length in bits */
 /* where an X bit piece length equals a 2^X byte piece size */
 #define BIT23MAX 12800
@@ -24,6 +40,10 @@
 #define BIT16MAX 100
 #define BIT15MAX 50
 
+/* maximum number of piece lengths the content can be hashed with at once,
+   one for every valid piece length 2^15 to 2^28 */
+#define MAX_PIECE_LENGTHS 14
+
 #include <stdint.h>
 
 #include "ll.h"
@@ -31,32 +51,100 @@
 struct file_data {
 	char *path;
 	uintmax_t size;
+	unsigned char pieces_root[32]; /* root of the v2 merkle tree, SHA256 */
+	uintmax_t dev;             /* device and inode, to find hardlinks */
+	uintmax_t ino;
+	int64_t mtime;             /* modification time in nanoseconds */
+	uintmax_t piece;           /* first piece, when every file starts one */
+	uintmax_t offset;          /* in the stream of all the files */
+	struct file_data *dup;     /* first file with the same content */
+	struct file_sums *sums;    /* checksums of the content, or NULL */
+};
+
+/* a metainfo file written from the same hashes as the others, but with
+   some of the options changed. the info hash differs when the source,
+   private or cross-seed option does */
+struct variant {
+	struct ll *announce_list;  /* announce URLs, NULL if not changed */
+	char *comment;             /* comment, NULL if not changed */
+	char *source;              /* source string, NULL if not changed */
+	int private;               /* private flag, -1 if not changed */
+	int cross_seed;            /* cross-seed flag, -1 if not changed */
+	char *metainfo_file_path;  /* absolute path to the metainfo file */
 };
 
 struct metafile {
 	/* options */
 	unsigned int piece_length; /* piece length */
+	unsigned int piece_lengths[MAX_PIECE_LENGTHS]; /* all piece lengths to
+	                              hash with, the first is piece_length */
+	unsigned int piece_length_count; /* number of piece lengths */
+	unsigned int min_pieces;   /* the piece length chosen gives at least */
+	unsigned int max_pieces;   /* and at most this many pieces, 0 to choose
+	                              it by the total size */
+	uintmax_t max_metainfo;    /* or about this many bytes of metainfo */
 	struct ll *announce_list;  /* announce URLs */
 	char *comment;             /* optional comment */
 	const char *torrent_name;  /* name of torrent (name of directory) */
 	char *metainfo_file_path;  /* absolute path to the metainfo file */
 	struct ll *web_seed_list;  /* web seed URLs */
 	int target_is_directory;   /* target is a directory */
+	int meta_version;          /* META_V1, META_V2 or both */
+	int pad_files;             /* every file starts a new piece, in v1
+	                              the gaps are BEP 47 pad files */
 	int no_creation_date;      /* don't write the creation date */
 	int private;               /* set the private flag */
 	char *source;              /* set source for private trackers */
 	int cross_seed;            /* ensure info hash is unique for easier cross-seeding */
 	int verbose;               /* be verbose */
 	int force_overwrite;       /* overwrite existing output file */
+	int print_info_hash;       /* print the info hash when done */
+	int print_magnet;          /* print the magnet URI when done */
+	int machine_readable;      /* print the result as JSON and nothing else */
+	int progress;              /* print the progress as JSON too */
 	struct ll *exclude_list;   /* exclude list */
+	struct ll *include_list;   /* include list, every file if empty */
+	struct ll *variant_list;   /* variants of the metainfo file to write */
+	unsigned long max_read_rate; /* MiB per second to read at most, 0 for no limit */
+	int idle;                  /* run at idle CPU and I/O priority */
+	unsigned int max_pressure; /* back off while the I/O or CPU pressure
+	                              is above this percentage, 0 for never */
+	int resume;                /* take the hashes done from the checkpoint */
+	char *cache_path;          /* absolute path to the hash cache, or NULL */
+	char *update_path;         /* absolute path to the metainfo file to take
+	                              the hashes of unchanged pieces from, or NULL */
+	struct ll *edit_list;      /* metainfo files to edit instead, or NULL */
+	char *verify_path;         /* absolute path to the metainfo file to check
+	                              the content against instead, or NULL */
+	unsigned int sample;       /* percentage of the pieces to check, 0 for all */
+	int stop_at_mismatch;      /* stop at the first piece that doesn't match */
+	int fast_resume;           /* RESUME_LIBTORRENT and/or RESUME_RTORRENT */
+	char *save_path;           /* absolute path to the directory the content
+	                              is in, for the fast resume data */
+	int checksums;             /* CHECKSUM_MD5, CHECKSUM_SHA1 and/or
+	                              CHECKSUM_SHA256 of every file */
+	char *batch_path;          /* job file to create the torrents of
+	                              instead, or NULL */
+	char *socket_path;         /* Unix socket to take the jobs on
+	                              instead, or NULL */
+	struct ll *batch_args;     /* the other options given, every job
+	                              starts with them */
 #ifdef USE_PTHREADS
 	long threads;              /* number of threads used for hashing */
+	long readers;              /* number of threads reading, 0 for the default */
+	long memory;               /* MiB of read buffers, 0 for the default */
+	unsigned int *cpus;        /* CPUs to run the threads on, or NULL */
+	unsigned int cpu_count;    /* number of CPUs in cpus */
+	int numa;                  /* keep the buffers on the node of the CPUs */
+	int adaptive;              /* tune the threads and buffers while hashing */
 #endif
 
 	/* information calculated by read_dir() */
 	uintmax_t size;              /* combined size of all files */
 	struct ll *file_list;      /* list of files and their sizes */
 	unsigned int pieces;       /* number of pieces */
+	unsigned int v2_pieces;    /* number of v2 pieces, every file starts
+	                              a new piece */
 };
 
 #endif /* MKTORRENT_MKTORRENT_H */
@@ -0,0 +1,284 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* malloc(), strtoul() */
+#include <stdio.h>        /* fopen(), snprintf() etc. */
+#include <string.h>       /* memset(), strerror() */
+#include <errno.h>        /* errno */
+#include <ctype.h>        /* isdigit() */
+#include <unistd.h>       /* sysconf() */
+#include <sys/mman.h>     /* mmap(), madvise() */
+
+#ifdef __linux__
+#include <sys/syscall.h>  /* SYS_sched_setaffinity etc. */
+#endif
+
+#include "export.h"
+#include "numa.h"
+#include "msg.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* the highest CPU number we can pin threads to */
+#define MAX_CPUS 4096
+
+/* huge pages are at least this large */
+#define HUGE_PAGE_SIZE 2097152
+
+#define MASK_BITS (8 * sizeof(unsigned long))
+
+
+/*
+ * parse a list of CPU numbers and ranges like "0-3,8,10-11", also
+ * used by the kernel for the CPUs of a NUMA node.
+ * returns NULL if the list is malformed or empty
+ */
+EXPORT unsigned int *parse_cpu_list(const char *s, unsigned int *count)
+{
+	unsigned int *cpus = NULL;
+	unsigned int n = 0;
+
+	while (*s && *s != '\n') {
+		unsigned long first, last;
+		char *end;
+
+		if (!isdigit((unsigned char) *s))
+			goto bad;
+		first = last = strtoul(s, &end, 10);
+		s = end;
+
+		if (*s == '-') {
+			s++;
+			if (!isdigit((unsigned char) *s))
+				goto bad;
+			last = strtoul(s, &end, 10);
+			s = end;
+		}
+
+		if (first > last || last >= MAX_CPUS)
+			goto bad;
+
+		if (*s == ',')
+			s++;
+		else if (*s && *s != '\n')
+			goto bad;
+
+		cpus = realloc(cpus, (n + last - first + 1) * sizeof(*cpus));
+		FATAL_IF0(cpus == NULL, "out of memory\n");
+
+		while (first <= last)
+			cpus[n++] = first++;
+	}
+
+	if (n == 0)
+		goto bad;
+
+	*count = n;
+	return cpus;
+
+bad:
+	free(cpus);
+	return NULL;
+}
+
+/*
+ * the CPUs we may run on, or all the online CPUs if we can't tell
+ */
+EXPORT unsigned int *allowed_cpus(unsigned int *count)
+{
+	unsigned int *cpus;
+	unsigned int n = 0;
+	long online = 1;
+
+#ifdef __linux__
+	unsigned long mask[MAX_CPUS / MASK_BITS];
+	long r = syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask);
+
+	if (r > 0) {
+		cpus = malloc(MAX_CPUS * sizeof(*cpus));
+		FATAL_IF0(cpus == NULL, "out of memory\n");
+
+		for (unsigned int i = 0; i < (unsigned long) r * 8; i++)
+			if (mask[i / MASK_BITS] & (1UL << i % MASK_BITS))
+				cpus[n++] = i;
+
+		if (n) {
+			*count = n;
+			return cpus;
+		}
+		free(cpus);
+	}
+#endif
+
+#ifdef _SC_NPROCESSORS_ONLN
+	online = sysconf(_SC_NPROCESSORS_ONLN);
+	if (online <= 0)
+		online = 1;
+#endif
+
+	cpus = malloc(online * sizeof(*cpus));
+	FATAL_IF0(cpus == NULL, "out of memory\n");
+
+	for (n = 0; n < (unsigned long) online; n++)
+		cpus[n] = n;
+
+	*count = n;
+	return cpus;
+}
+
+/*
+ * find the NUMA node of every CPU, 0 where the system doesn't tell
+ */
+EXPORT unsigned int *cpu_nodes(const unsigned int *cpus, unsigned int count)
+{
+	unsigned int *nodes = calloc(count, sizeof(*nodes));
+
+	FATAL_IF0(nodes == NULL, "out of memory\n");
+
+#ifdef __linux__
+	/* go through the nodes the kernel lists and look for
+	   our CPUs in their lists */
+	char line[4096];
+	unsigned int *node_list;
+	unsigned int node_count;
+	FILE *f = fopen("/sys/devices/system/node/possible", "r");
+
+	if (f == NULL)
+		return nodes;
+
+	node_list = fgets(line, sizeof(line), f) ?
+		parse_cpu_list(line, &node_count) : NULL;
+	fclose(f);
+
+	if (node_list == NULL)
+		return nodes;
+
+	for (unsigned int i = 0; i < node_count; i++) {
+		char path[64];
+		unsigned int *node_cpus;
+		unsigned int node_cpu_count;
+
+		snprintf(path, sizeof(path),
+			"/sys/devices/system/node/node%u/cpulist", node_list[i]);
+
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+
+		node_cpus = fgets(line, sizeof(line), f) ?
+			parse_cpu_list(line, &node_cpu_count) : NULL;
+		fclose(f);
+
+		if (node_cpus == NULL)
+			continue;
+
+		for (unsigned int j = 0; j < count; j++)
+			for (unsigned int k = 0; k < node_cpu_count; k++)
+				if (cpus[j] == node_cpus[k])
+					nodes[j] = node_list[i];
+
+		free(node_cpus);
+	}
+
+	free(node_list);
+#else
+	(void) cpus;
+#endif
+
+	return nodes;
+}
+
+/*
+ * keep the calling thread on the given CPUs,
+ * this is only done on Linux
+ */
+EXPORT void pin_thread(const unsigned int *cpus, unsigned int count)
+{
+#ifdef __linux__
+	unsigned long mask[MAX_CPUS / MASK_BITS];
+
+	memset(mask, 0, sizeof(mask));
+	for (unsigned int i = 0; i < count; i++)
+		mask[cpus[i] / MASK_BITS] |= 1UL << cpus[i] % MASK_BITS;
+
+	FATAL_IF(syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask),
+		"cannot set the CPU affinity: %s\n", strerror(errno));
+#else
+	(void) cpus;
+	(void) count;
+#endif
+}
+
+/*
+ * allocate memory for buffers shared by threads running on the given
+ * CPUs. it is backed by huge pages if the system has some to spare,
+ * or asked to be, and it is touched from those CPUs, so the pages
+ * come from their NUMA node.
+ * len is updated to the length allocated
+ */
+EXPORT void *pool_alloc(size_t *len, const unsigned int *cpus,
+		unsigned int count)
+{
+	void *p = MAP_FAILED;
+#ifdef __linux__
+	unsigned long saved[MAX_CPUS / MASK_BITS];
+	long saved_len = syscall(SYS_sched_getaffinity, 0,
+		sizeof(saved), saved);
+#endif
+
+#ifdef MAP_HUGETLB
+	if (*len >= HUGE_PAGE_SIZE) {
+		size_t huge_len = (*len + HUGE_PAGE_SIZE - 1)
+			& ~(size_t) (HUGE_PAGE_SIZE - 1);
+
+		p = mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			*len = huge_len;
+	}
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, *len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		FATAL_IF(p == MAP_FAILED, "cannot allocate %zu bytes: %s\n",
+			*len, strerror(errno));
+#ifdef MADV_HUGEPAGE
+		madvise(p, *len, MADV_HUGEPAGE);
+#endif
+	}
+
+	/* the pages are placed on the node of the first CPU to touch them */
+	if (cpus)
+		pin_thread(cpus, count);
+	memset(p, 0, *len);
+
+#ifdef __linux__
+	if (cpus && saved_len > 0)
+		syscall(SYS_sched_setaffinity, 0, saved_len, saved);
+#endif
+
+	return p;
+}
+
+EXPORT void pool_free(void *p, size_t len)
+{
+	munmap(p, len);
+}
@@ -0,0 +1,16 @@
+#ifndef MKTORRENT_NUMA_H
+#define MKTORRENT_NUMA_H
+
+#include <stddef.h>      /* size_t */
+
+#include "export.h"      /* EXPORT */
+
+EXPORT unsigned int *parse_cpu_list(const char *s, unsigned int *count);
+EXPORT unsigned int *allowed_cpus(unsigned int *count);
+EXPORT unsigned int *cpu_nodes(const unsigned int *cpus, unsigned int count);
+EXPORT void pin_thread(const unsigned int *cpus, unsigned int count);
+EXPORT void *pool_alloc(size_t *len, const unsigned int *cpus,
+		unsigned int count);
+EXPORT void pool_free(void *p, size_t len);
+
+#endif /* MKTORRENT_NUMA_H */
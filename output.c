@@ -23,74 +23,186 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include <string.h>       /* strlen() etc. */
 #include <time.h>         /* time() */
 #include <inttypes.h>     /* PRIuMAX */
-#include <stdlib.h>       /* random() */
+#include <stdlib.h>       /* random(), malloc() */
+#include <stdarg.h>       /* va_list etc. */
 
 #ifdef USE_OPENSSL
 #include <openssl/sha.h>  /* SHA_DIGEST_LENGTH */
 #else
 #include "sha1.h"
+#include "sha256.h"
 #endif
 
 #include "export.h"       /* EXPORT */
 #include "mktorrent.h"    /* struct metafile */
+#include "bencode.h"
+#include "checksum.h"
 #include "output.h"
+#include "msg.h"
 
 
+/*
+ * everything in the metainfo file is written through this, so the
+ * info dictionary can be hashed while it is being written
+ */
+struct writer {
+	FILE *f;          /* stream the metainfo is written to */
+	int hashing;      /* META_V1 and/or META_V2 while writing the
+	                     info dictionary */
+	SHA_CTX c;        /* SHA1 hashing context of the info dictionary */
+	SHA256_CTX c2;    /* SHA256 hashing context for v2 */
+};
+
+static void write_raw(struct writer *w, const void *data, size_t len)
+{
+	fwrite(data, 1, len, w->f);
+
+	if (w->hashing & META_V1)
+		SHA1_Update(&w->c, data, len);
+	if (w->hashing & META_V2)
+		SHA256_Update(&w->c2, data, len);
+}
+
+static void write_fmt(struct writer *w, const char *format, ...)
+{
+	char buf[256];
+	char *s = buf;
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+
+	FATAL_IF0(len < 0, "cannot format metainfo entry\n");
+
+	/* fall back to the heap for long entries, eg. long paths */
+	if ((size_t) len >= sizeof(buf)) {
+		s = malloc(len + 1);
+		FATAL_IF0(s == NULL, "out of memory\n");
+
+		va_start(args, format);
+		vsnprintf(s, len + 1, format, args);
+		va_end(args);
+	}
+
+	write_raw(w, s, len);
+
+	if (s != buf)
+		free(s);
+}
+
+
+/*
+ * write the first announce URL
+ */
+static void write_announce(struct writer *w, struct ll *list)
+{
+	struct ll *first_tier = LL_DATA_AS(LL_HEAD(list), struct ll*);
+	const char *first_announce_url =
+		LL_DATA_AS(LL_HEAD(first_tier), const char*);
+
+	write_fmt(w, "8:announce%lu:%s",
+		(unsigned long) strlen(first_announce_url), first_announce_url);
+}
+
+/*
+ * the announce-list entry is written if we have
+ * more than one announce URL, namely
+ * a) there are at least two tiers, or      (first part of OR)
+ * b) there are at least two URLs in tier 1 (second part of OR)
+ */
+static int has_announce_list(struct ll *list)
+{
+	return LL_NEXT(LL_HEAD(list))
+		|| LL_NEXT(LL_HEAD(LL_DATA_AS(LL_HEAD(list), struct ll*)));
+}
+
 /*
  * write announce list
  */
-static void write_announce_list(FILE *f, struct ll *list)
+static void write_announce_list(struct writer *w, struct ll *list)
 {
 	/* the announce list is a list of lists of urls */
-	fprintf(f, "13:announce-listl");
+	write_fmt(w, "13:announce-listl");
 	/* go through them all.. */
 	LL_FOR(tier_node, list) {
 
 		/* .. and print the lists */
-		fprintf(f, "l");
+		write_fmt(w, "l");
 
 		LL_FOR(announce_url_node, LL_DATA_AS(tier_node, struct ll*)) {
 
 			const char *announce_url =
 				LL_DATA_AS(announce_url_node, const char*);
 
-			fprintf(f, "%lu:%s",
+			write_fmt(w, "%lu:%s",
 					(unsigned long) strlen(announce_url), announce_url);
 		}
 
-		fprintf(f, "e");
+		write_fmt(w, "e");
 	}
-	fprintf(f, "e");
+	write_fmt(w, "e");
+}
+
+/*
+ * write the optional md5sum entry of a file, the hex MD5 of its content
+ */
+static void write_md5sum(struct writer *w, struct metafile *m,
+		struct file_data *fd)
+{
+	if (!(m->checksums & CHECKSUM_MD5))
+		return;
+
+	write_fmt(w, "6:md5sum%u:", MD5_DIGEST_LENGTH * 2);
+	for (unsigned int i = 0; i < MD5_DIGEST_LENGTH; i++)
+		write_fmt(w, "%02x", fd->sums->md5[i]);
+}
+
+/*
+ * write the optional sha1 entry of a file, the SHA1 of its content
+ */
+static void write_sha1(struct writer *w, struct metafile *m,
+		struct file_data *fd)
+{
+	if (!(m->checksums & CHECKSUM_SHA1))
+		return;
+
+	write_fmt(w, "4:sha1%u:", SHA_DIGEST_LENGTH);
+	write_raw(w, fd->sums->sha1, SHA_DIGEST_LENGTH);
 }
 
 /*
  * write file list
  */
-static void write_file_list(FILE *f, struct ll *list)
+static void write_file_list(struct writer *w, struct metafile *m)
 {
 	char *a, *b;
 
-	fprintf(f, "5:filesl");
+	write_fmt(w, "5:filesl");
 
 	/* go through all the files */
-	LL_FOR(file_node, list) {
+	LL_FOR(file_node, m->file_list) {
 		struct file_data *fd = LL_DATA_AS(file_node, struct file_data*);
 
 		/* the file list contains a dictionary for every file
-		   with entries for the length and path
+		   with entries for the length and path, and the
+		   checksums asked for around the path
 		   write the length first */
-		fprintf(f, "d6:lengthi%" PRIuMAX "e4:pathl", fd->size);
+		write_fmt(w, "d6:lengthi%" PRIuMAX "e", fd->size);
+		write_md5sum(w, m, fd);
+		write_fmt(w, "4:pathl");
 		/* the file path is written as a list of subdirectories
 		   and the last entry is the filename
 		   sorry this code is even uglier than the rest */
 		a = fd->path;
 		/* while there are subdirectories before the filename.. */
 		while ((b = strchr(a, DIRSEP_CHAR)) != NULL) {
-			/* set the next DIRSEP_CHAR to '\0' so fprintf
+			/* set the next DIRSEP_CHAR to '\0' so write_fmt
 			   will only write the first subdirectory name */
 			*b = '\0';
 			/* print it bencoded */
-			fprintf(f, "%lu:%s", b - a, a);
+			write_fmt(w, "%lu:%s", b - a, a);
 			/* undo our alteration to the string */
 			*b = DIRSEP_CHAR;
 			/* and move a to the beginning of the next
@@ -99,130 +211,577 @@ static void write_file_list(FILE *f, struct ll *list)
 		}
 		/* now print the filename bencoded and end the
 		   path name list and file dictionary */
-		fprintf(f, "%lu:%see", (unsigned long)strlen(a), a);
+		write_fmt(w, "%lu:%se", (unsigned long)strlen(a), a);
+		write_sha1(w, m, fd);
+		write_fmt(w, "e");
+
+		/* pad the file to the end of its last piece with a BEP 47
+		   pad file, it is named .pad/<length> as other clients do */
+		if (m->pad_files && LL_NEXT(file_node)
+				&& fd->size % m->piece_length) {
+			char len[32];
+
+			snprintf(len, sizeof(len), "%" PRIuMAX,
+				m->piece_length - fd->size % m->piece_length);
+			write_fmt(w, "d4:attr1:p6:lengthi%se4:pathl4:.pad%lu:%see",
+				len, (unsigned long) strlen(len), len);
+		}
 	}
 
 	/* whew, now end the file list */
-	fprintf(f, "e");
+	write_fmt(w, "e");
+}
+
+/*
+ * write the entry of a single file in the v2 file tree,
+ * empty files have no pieces root
+ */
+static void write_file_tree_entry(struct writer *w, const char *name,
+		size_t len, struct file_data *fd)
+{
+	write_fmt(w, "%lu:%.*s", (unsigned long) len, (int) len, name);
+
+	if (fd->size == 0) {
+		write_fmt(w, "d0:d6:lengthi0eee");
+		return;
+	}
+
+	write_fmt(w, "d0:d6:lengthi%" PRIuMAX "e11:pieces root32:", fd->size);
+	write_raw(w, fd->pieces_root, sizeof(fd->pieces_root));
+	write_fmt(w, "ee");
+}
+
+/*
+ * write the v2 file tree, a dictionary for every directory with an
+ * entry for every file and subdirectory in it.
+ * the file list is sorted one directory at a time, so the files of
+ * a directory follow each other and the keys come out sorted
+ */
+static void write_file_tree(struct writer *w, struct metafile *m)
+{
+	const char *prev = NULL;  /* path of the previous file */
+	unsigned int depth = 0;   /* number of directories open */
+
+	write_fmt(w, "9:file treed");
+
+	if (!m->target_is_directory) {
+		struct file_data *fd =
+			LL_DATA_AS(LL_HEAD(m->file_list), struct file_data*);
+
+		write_file_tree_entry(w, m->torrent_name,
+			strlen(m->torrent_name), fd);
+		write_fmt(w, "e");
+		return;
+	}
+
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *fd = LL_DATA_AS(file_node, struct file_data*);
+		const char *a = fd->path, *b;
+		unsigned int common = 0;
+
+		/* find the directories shared with the previous file */
+		if (prev) {
+			const char *p = fd->path, *q = prev;
+
+			for (; *p && *p == *q; p++, q++) {
+				if (*p == DIRSEP_CHAR) {
+					common++;
+					a = p + 1;
+				}
+			}
+		}
+
+		/* close the directories of the previous file not shared.. */
+		for (; depth > common; depth--)
+			write_fmt(w, "e");
+
+		/* ..and open the new ones */
+		while ((b = strchr(a, DIRSEP_CHAR)) != NULL) {
+			write_fmt(w, "%lu:%.*sd", (unsigned long) (b - a),
+				(int) (b - a), a);
+			depth++;
+			a = b + 1;
+		}
+
+		write_file_tree_entry(w, a, strlen(a), fd);
+		prev = fd->path;
+	}
+
+	for (; depth > 0; depth--)
+		write_fmt(w, "e");
+
+	write_fmt(w, "e");
+}
+
+/*
+ * the piece layer of a file in the v2 hash string
+ */
+struct piece_layer {
+	const unsigned char *root;
+	const unsigned char *hashes;
+	uintmax_t len;
+};
+
+static int piece_layer_cmp(const void *a, const void *b)
+{
+	const struct piece_layer *x = a, *y = b;
+
+	return memcmp(x->root, y->root, SHA256_DIGEST_LENGTH);
+}
+
+/*
+ * write the piece layers of the v2 torrent, that is the piece hashes
+ * of every file larger than one piece keyed by its pieces root.
+ * files with the same content share an entry
+ */
+static void write_piece_layers(struct writer *w, struct metafile *m,
+		const unsigned char *layers)
+{
+	struct piece_layer *list;
+	size_t count = 0;
+
+	list = malloc((m->v2_pieces + 1) * sizeof(*list));
+	FATAL_IF0(list == NULL, "out of memory\n");
+
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *fd = LL_DATA_AS(file_node, struct file_data*);
+		uintmax_t pieces = (fd->size + m->piece_length - 1) / m->piece_length;
+
+		if (pieces > 1) {
+			list[count].root = fd->pieces_root;
+			list[count].hashes = layers;
+			list[count].len = pieces * SHA256_DIGEST_LENGTH;
+			count++;
+		}
+
+		layers += pieces * SHA256_DIGEST_LENGTH;
+	}
+
+	/* the keys of a dictionary are sorted */
+	qsort(list, count, sizeof(*list), piece_layer_cmp);
+
+	write_fmt(w, "12:piece layersd");
+	for (size_t i = 0; i < count; i++) {
+		if (i > 0 && piece_layer_cmp(&list[i - 1], &list[i]) == 0)
+			continue;
+
+		write_fmt(w, "32:");
+		write_raw(w, list[i].root, SHA256_DIGEST_LENGTH);
+		write_fmt(w, "%" PRIuMAX ":", list[i].len);
+		write_raw(w, list[i].hashes, list[i].len);
+	}
+	write_fmt(w, "e");
+
+	free(list);
 }
 
 /*
  * write web seed list
  */
-static void write_web_seed_list(FILE *f, struct ll *list)
+static void write_web_seed_list(struct writer *w, struct ll *list)
 {
 	/* print the entry and start the list */
-	fprintf(f, "8:url-listl");
+	write_fmt(w, "8:url-listl");
 	/* go through the list and write each URL */
 	LL_FOR(node, list) {
 		const char *web_seed_url = LL_DATA_AS(node, const char*);
-		fprintf(f, "%lu:%s",
+		write_fmt(w, "%lu:%s",
 			(unsigned long) strlen(web_seed_url), web_seed_url);
 	}
 	/* end the list */
-	fprintf(f, "e");
+	write_fmt(w, "e");
+}
+
+/*
+ * write the web seeds, a single URL is written as a string
+ */
+static void write_web_seeds(struct writer *w, struct ll *list)
+{
+	if (LL_IS_SINGLETON(list)) {
+		const char *first_web_seed =
+			LL_DATA_AS(LL_HEAD(list), const char*);
+
+		write_fmt(w, "8:url-list%lu:%s",
+				(unsigned long) strlen(first_web_seed), first_web_seed);
+	} else
+		write_web_seed_list(w, list);
 }
 
 /*
  * write metainfo to the file stream using all the information
- * we've gathered so far and the hash string calculated
+ * we've gathered so far and the hash string calculated,
+ * the SHA1 hash of the info section (the info hash) is
+ * stored in info_hash, and for v2 the SHA256 hash in info_hash_v2.
+ * layers holds the v2 piece hashes of every file
  */
-EXPORT void write_metainfo(FILE *f, struct metafile *m, unsigned char *hash_string)
+EXPORT void write_metainfo(FILE *f, struct metafile *m,
+		unsigned char *hash_string, unsigned char *layers,
+		unsigned char *info_hash, unsigned char *info_hash_v2)
 {
+	struct writer writer, *w = &writer;
+
+	w->f = f;
+	w->hashing = 0;
+
 	/* let the user know we've started writing the metainfo file */
-	printf("writing metainfo file... ");
-	fflush(stdout);
+	if (!m->machine_readable) {
+		printf("writing metainfo file... ");
+		fflush(stdout);
+	}
 
 	/* every metainfo file is one big dictonary */
-	fprintf(f, "d");
+	write_fmt(w, "d");
 
 	if (!LL_IS_EMPTY(m->announce_list)) {
-
-		struct ll *first_tier =
-			LL_DATA_AS(LL_HEAD(m->announce_list), struct ll*);
-
-		/* write the announce URL */
-		const char *first_announce_url
-			= LL_DATA_AS(LL_HEAD(first_tier), const char*);
-
-		fprintf(f, "8:announce%lu:%s",
-			(unsigned long) strlen(first_announce_url), first_announce_url);
-
-		/* write the announce-list entry if we have
-		 * more than one announce URL, namely
-		 * a) there are at least two tiers, or      (first part of OR)
-		 * b) there are at least two URLs in tier 1 (second part of OR)
-		 */
-		if (LL_NEXT(LL_HEAD(m->announce_list)) || LL_NEXT(LL_HEAD(first_tier)))
-			write_announce_list(f, m->announce_list);
+		write_announce(w, m->announce_list);
+		if (has_announce_list(m->announce_list))
+			write_announce_list(w, m->announce_list);
 	}
 
 	/* add the comment if one is specified */
 	if (m->comment != NULL)
-		fprintf(f, "7:comment%lu:%s",
+		write_fmt(w, "7:comment%lu:%s",
 				(unsigned long)strlen(m->comment),
 				m->comment);
 	/* I made this! */
-	fprintf(f, "10:created by13:mktorrent " VERSION);
+	write_fmt(w, "10:created by13:mktorrent " VERSION);
 	/* add the creation date */
 	if (!m->no_creation_date)
-		fprintf(f, "13:creation datei%lde",
+		write_fmt(w, "13:creation datei%lde",
 			(long)time(NULL));
 
 	/* now here comes the info section
-	   it is yet another dictionary */
-	fprintf(f, "4:infod");
-	/* first entry is either 'length', which specifies the length of a
+	   it is yet another dictionary, hash it as we go */
+	write_fmt(w, "4:info");
+	SHA1_Init(&w->c);
+	SHA256_Init(&w->c2);
+	w->hashing = m->meta_version;
+	write_fmt(w, "d");
+
+	/* v2 torrents describe the files in a tree of dictionaries */
+	if (m->meta_version & META_V2)
+		write_file_tree(w, m);
+
+	/* next entry is either 'length', which specifies the length of a
 	   single file torrent, or a list of files and their respective sizes */
-	if (!m->target_is_directory)
-		fprintf(f, "6:lengthi%" PRIuMAX "e",
-			LL_DATA_AS(LL_HEAD(m->file_list), struct file_data*)->size);
-	else
-		write_file_list(f, m->file_list);
-
-	if (m->cross_seed) {
-		fprintf(f, "12:x_cross_seed%u:mktorrent-", CROSS_SEED_RAND_LENGTH * 2 + 10);
-		for (int i = 0; i < CROSS_SEED_RAND_LENGTH; i++) {
-			unsigned char rand_byte = random();
-			fputc("0123456789ABCDEF"[rand_byte >> 4], f);
-			fputc("0123456789ABCDEF"[rand_byte & 0x0F], f);
-		}
+	if (m->meta_version & META_V1) {
+		if (!m->target_is_directory) {
+			write_fmt(w, "6:lengthi%" PRIuMAX "e",
+				LL_DATA_AS(LL_HEAD(m->file_list), struct file_data*)->size);
+			write_md5sum(w, m,
+				LL_DATA_AS(LL_HEAD(m->file_list), struct file_data*));
+		} else
+			write_file_list(w, m);
 	}
 
+	if (m->meta_version & META_V2)
+		write_fmt(w, "12:meta versioni2e");
+
 	/* the info section also contains the name of the torrent,
 	   the piece length and the hash string */
-	fprintf(f, "4:name%lu:%s12:piece lengthi%ue6:pieces%u:",
+	write_fmt(w, "4:name%lu:%s12:piece lengthi%ue",
 		(unsigned long)strlen(m->torrent_name), m->torrent_name,
-		m->piece_length, m->pieces * SHA_DIGEST_LENGTH);
-	fwrite(hash_string, 1, m->pieces * SHA_DIGEST_LENGTH, f);
+		m->piece_length);
+	if (m->meta_version & META_V1) {
+		write_fmt(w, "6:pieces%u:", m->pieces * SHA_DIGEST_LENGTH);
+		write_raw(w, hash_string, m->pieces * SHA_DIGEST_LENGTH);
+	}
 
 	/* set the private flag */
 	if (m->private)
-		fprintf(f, "7:privatei1e");
+		write_fmt(w, "7:privatei1e");
+
+	/* and the checksum of a single file */
+	if ((m->meta_version & META_V1) && !m->target_is_directory)
+		write_sha1(w, m, LL_DATA_AS(LL_HEAD(m->file_list),
+			struct file_data*));
 
 	if (m->source)
-		fprintf(f, "6:source%lu:%s",
+		write_fmt(w, "6:source%lu:%s",
 			(unsigned long) strlen(m->source), m->source);
 
+	/* the keys of a dictionary are sorted, so this comes last */
+	if (m->cross_seed) {
+		write_fmt(w, "12:x_cross_seed%u:mktorrent-", CROSS_SEED_RAND_LENGTH * 2 + 10);
+		for (int i = 0; i < CROSS_SEED_RAND_LENGTH; i++) {
+			unsigned char rand_byte = random();
+			char hex[2] = {
+				"0123456789ABCDEF"[rand_byte >> 4],
+				"0123456789ABCDEF"[rand_byte & 0x0F]
+			};
+			write_raw(w, hex, sizeof(hex));
+		}
+	}
+
 	/* end the info section */
-	fprintf(f, "e");
+	write_fmt(w, "e");
+	w->hashing = 0;
+	SHA1_Final(info_hash, &w->c);
+	SHA256_Final(info_hash_v2, &w->c2);
 
-	/* add url-list if one is specified */
-	if (!LL_IS_EMPTY(m->web_seed_list)) {
-		if (LL_IS_SINGLETON(m->web_seed_list)) {
-			const char *first_web_seed =
-				LL_DATA_AS(LL_HEAD(m->web_seed_list), const char*);
+	/* the v2 piece hashes are outside the info section */
+	if (m->meta_version & META_V2)
+		write_piece_layers(w, m, layers);
 
-			fprintf(f, "8:url-list%lu:%s",
-					(unsigned long) strlen(first_web_seed), first_web_seed);
-		} else
-			write_web_seed_list(f, m->web_seed_list);
-	}
+	/* add url-list if one is specified */
+	if (!LL_IS_EMPTY(m->web_seed_list))
+		write_web_seeds(w, m->web_seed_list);
 
 	/* end the root dictionary */
-	fprintf(f, "e");
+	write_fmt(w, "e");
 
 	/* let the user know we're done already */
-	printf("done\n");
+	if (!m->machine_readable) {
+		printf("done\n");
+		fflush(stdout);
+	}
+}
+
+/*
+ * the keys of the root dictionary an edit may set, in sorted order
+ */
+enum edit_key {
+	EDIT_ANNOUNCE,
+	EDIT_ANNOUNCE_LIST,
+	EDIT_COMMENT,
+	EDIT_CREATION_DATE,
+	EDIT_URL_LIST,
+	EDIT_KEYS
+};
+
+static const char *const edit_keys[EDIT_KEYS] = {
+	"announce",
+	"announce-list",
+	"comment",
+	"creation date",
+	"url-list"
+};
+
+/*
+ * the entry of the key is replaced, or removed, by the edit
+ */
+static int is_edited(struct metafile *m, enum edit_key key)
+{
+	switch (key) {
+	case EDIT_ANNOUNCE:
+	case EDIT_ANNOUNCE_LIST:
+		return !LL_IS_EMPTY(m->announce_list);
+	case EDIT_COMMENT:
+		return m->comment != NULL;
+	case EDIT_CREATION_DATE:
+		return m->no_creation_date;
+	case EDIT_URL_LIST:
+		return !LL_IS_EMPTY(m->web_seed_list);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * write the new entry of an edited key, if it has one
+ */
+static void write_edited(struct writer *w, struct metafile *m,
+		enum edit_key key)
+{
+	if (!is_edited(m, key))
+		return;
+
+	switch (key) {
+	case EDIT_ANNOUNCE:
+		write_announce(w, m->announce_list);
+		break;
+	case EDIT_ANNOUNCE_LIST:
+		if (has_announce_list(m->announce_list))
+			write_announce_list(w, m->announce_list);
+		break;
+	case EDIT_COMMENT:
+		/* an empty comment removes it */
+		if (*m->comment)
+			write_fmt(w, "7:comment%lu:%s",
+				(unsigned long) strlen(m->comment), m->comment);
+		break;
+	case EDIT_URL_LIST:
+		write_web_seeds(w, m->web_seed_list);
+		break;
+	default:
+		break;
+	}
+}
+
+static int edit_key_cmp(enum edit_key key, struct bencode *k)
+{
+	return -bencode_key_cmp(k, edit_keys[key]);
+}
+
+/*
+ * write the metainfo of root with the announce URLs, web seeds and
+ * comment set, and the creation date removed, if asked to.
+ * everything else, and the info dictionary in particular, is copied
+ * as it is, so the info hash stays the same
+ */
+EXPORT void edit_metainfo(FILE *f, struct metafile *m, struct bencode *root)
+{
+	struct writer writer, *w = &writer;
+	unsigned int key = 0;
+
+	w->f = f;
+	w->hashing = 0;
+
+	write_fmt(w, "d");
+
+	/* the keys are sorted, so the new entries go in between */
+	for (struct bencode *k = root->child; k; k = k->next->next) {
+		int edited = 0;
+		int c;
+
+		for (; key < EDIT_KEYS && (c = edit_key_cmp(key, k)) <= 0; key++) {
+			if (c == 0)
+				edited = is_edited(m, key);
+			write_edited(w, m, key);
+		}
+
+		if (!edited) {
+			write_raw(w, k->raw, k->raw_len);
+			write_raw(w, k->next->raw, k->next->raw_len);
+		}
+	}
+
+	for (; key < EDIT_KEYS; key++)
+		write_edited(w, m, key);
+
+	write_fmt(w, "e");
+}
+
+/*
+ * print the info hash as a hex string
+ */
+static void print_hex(FILE *f, const unsigned char *hash, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		fprintf(f, "%02x", hash[i]);
+}
+
+/*
+ * print a string percent-encoded for use in a magnet URI
+ */
+static void print_uri_encoded(FILE *f, const char *s)
+{
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+				|| (c >= '0' && c <= '9') || strchr("-._~", c))
+			fputc(c, f);
+		else
+			fprintf(f, "%%%02X", c);
+	}
+}
+
+/*
+ * print a string as a JSON string literal
+ */
+EXPORT void print_json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+/*
+ * print the magnet URI of the torrent, it contains the info hash,
+ * the name, every announce URL and every web seed
+ */
+static void print_magnet(FILE *f, struct metafile *m,
+		const unsigned char *info_hash, const unsigned char *info_hash_v2)
+{
+	const char *sep = "?";
+
+	fprintf(f, "magnet:");
+
+	if (m->meta_version & META_V1) {
+		fprintf(f, "%sxt=urn:btih:", sep);
+		print_hex(f, info_hash, SHA_DIGEST_LENGTH);
+		sep = "&";
+	}
+
+	/* the v2 info hash is a multihash, 0x12 is SHA256 and 0x20 its length */
+	if (m->meta_version & META_V2) {
+		fprintf(f, "%sxt=urn:btmh:1220", sep);
+		print_hex(f, info_hash_v2, SHA256_DIGEST_LENGTH);
+	}
+
+	fprintf(f, "&dn=");
+	print_uri_encoded(f, m->torrent_name);
+
+	LL_FOR(tier_node, m->announce_list) {
+		LL_FOR(announce_url_node, LL_DATA_AS(tier_node, struct ll*)) {
+			fprintf(f, "&tr=");
+			print_uri_encoded(f,
+				LL_DATA_AS(announce_url_node, const char*));
+		}
+	}
+
+	LL_FOR(node, m->web_seed_list) {
+		fprintf(f, "&ws=");
+		print_uri_encoded(f, LL_DATA_AS(node, const char*));
+	}
+}
+
+/*
+ * print what the user asked to know about the written torrent,
+ * either as plain text or as a single line JSON object
+ */
+EXPORT void print_result(struct metafile *m, const unsigned char *info_hash,
+		const unsigned char *info_hash_v2)
+{
+	if (m->machine_readable) {
+		printf("{\"torrent\": ");
+		print_json_string(stdout, m->metainfo_file_path);
+		printf(", \"name\": ");
+		print_json_string(stdout, m->torrent_name);
+		printf(", \"size\": %" PRIuMAX ", \"piece_length\": %u",
+			m->size, m->piece_length);
+		if (m->meta_version & META_V1) {
+			printf(", \"pieces\": %u, \"info_hash\": \"", m->pieces);
+			print_hex(stdout, info_hash, SHA_DIGEST_LENGTH);
+			printf("\"");
+		}
+		if (m->meta_version & META_V2) {
+			printf(", \"v2_pieces\": %u, \"info_hash_v2\": \"",
+				m->v2_pieces);
+			print_hex(stdout, info_hash_v2, SHA256_DIGEST_LENGTH);
+			printf("\"");
+		}
+		printf(", \"magnet\": \"");
+		print_magnet(stdout, m, info_hash, info_hash_v2);
+		printf("\"}\n");
+	} else {
+		if (m->print_info_hash && (m->meta_version & META_V1)) {
+			printf("info hash: ");
+			print_hex(stdout, info_hash, SHA_DIGEST_LENGTH);
+			printf("\n");
+		}
+
+		if (m->print_info_hash && (m->meta_version & META_V2)) {
+			printf("info hash v2: ");
+			print_hex(stdout, info_hash_v2, SHA256_DIGEST_LENGTH);
+			printf("\n");
+		}
+
+		if (m->print_magnet) {
+			print_magnet(stdout, m, info_hash, info_hash_v2);
+			printf("\n");
+		}
+	}
+
 	fflush(stdout);
 }
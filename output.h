@@ -5,10 +5,16 @@
 
 #include "export.h"     /* EXPORT */
 #include "mktorrent.h"  /* struct metafile */
+#include "bencode.h"    /* struct bencode */
 
 #define CROSS_SEED_RAND_LENGTH 16
 
 EXPORT void write_metainfo(FILE *f, struct metafile *m,
-			unsigned char *hash_string);
+			unsigned char *hash_string, unsigned char *layers,
+			unsigned char *info_hash, unsigned char *info_hash_v2);
+EXPORT void edit_metainfo(FILE *f, struct metafile *m, struct bencode *root);
+EXPORT void print_json_string(FILE *f, const char *s);
+EXPORT void print_result(struct metafile *m, const unsigned char *info_hash,
+			const unsigned char *info_hash_v2);
 
 #endif /* MKTORRENT_OUTPUT_H */
@@ -0,0 +1,217 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* malloc(), free() */
+#include <stdint.h>       /* intptr_t */
+#include <stdatomic.h>    /* atomic_load() etc. */
+#include <limits.h>       /* INT_MAX */
+#include <pthread.h>
+
+#ifdef __linux__
+#include <unistd.h>       /* syscall() */
+#include <sys/syscall.h>  /* SYS_futex */
+#include <linux/futex.h>  /* FUTEX_WAIT_PRIVATE etc. */
+#endif
+
+#include "export.h"
+#include "queue.h"
+#include "msg.h"
+
+
+/*
+ * set up a ring holding at least capacity pointers
+ */
+EXPORT void ring_init(struct ring *r, size_t capacity)
+{
+	size_t size = 2;
+
+	while (size < capacity)
+		size <<= 1;
+
+	r->cells = malloc(size * sizeof(*r->cells));
+	FATAL_IF0(r->cells == NULL, "out of memory\n");
+
+	/* a cell is free to push to when its sequence number
+	   is the position it is pushed at */
+	for (size_t i = 0; i < size; i++)
+		atomic_init(&r->cells[i].seq, i);
+
+	r->mask = size - 1;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+}
+
+EXPORT void ring_destroy(struct ring *r)
+{
+	free(r->cells);
+	r->cells = NULL;
+}
+
+/*
+ * push a pointer to the ring, returns 0 if it is full
+ */
+EXPORT int ring_push(struct ring *r, void *data)
+{
+	size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+	struct ring_cell *cell;
+
+	while (1) {
+		intptr_t dif;
+
+		cell = &r->cells[pos & r->mask];
+		dif = (intptr_t) atomic_load_explicit(&cell->seq,
+				memory_order_acquire) - (intptr_t) pos;
+
+		if (dif == 0) {
+			/* the cell is free, claim it */
+			if (atomic_compare_exchange_weak_explicit(&r->head,
+					&pos, pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			/* the cell still holds what was pushed a lap ago */
+			return 0;
+		} else
+			pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+	}
+
+	cell->data = data;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+	return 1;
+}
+
+/*
+ * pop the oldest pointer from the ring, returns NULL if it is empty
+ */
+EXPORT void *ring_pop(struct ring *r)
+{
+	size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	struct ring_cell *cell;
+	void *data;
+
+	while (1) {
+		intptr_t dif;
+
+		cell = &r->cells[pos & r->mask];
+		dif = (intptr_t) atomic_load_explicit(&cell->seq,
+				memory_order_acquire) - (intptr_t) (pos + 1);
+
+		if (dif == 0) {
+			/* the cell is full, claim it */
+			if (atomic_compare_exchange_weak_explicit(&r->tail,
+					&pos, pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			/* nothing has been pushed to the cell yet */
+			return NULL;
+		} else
+			pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	}
+
+	data = cell->data;
+	/* free the cell for the push a lap from now */
+	atomic_store_explicit(&cell->seq, pos + r->mask + 1, memory_order_release);
+
+	return data;
+}
+
+EXPORT void parking_init(struct parking *p)
+{
+	atomic_init(&p->epoch, 0);
+	atomic_init(&p->waiting, 0);
+#ifndef __linux__
+	pthread_mutex_init(&p->mutex, NULL);
+	pthread_cond_init(&p->cond, NULL);
+#endif
+}
+
+EXPORT void parking_destroy(struct parking *p)
+{
+#ifndef __linux__
+	pthread_mutex_destroy(&p->mutex);
+	pthread_cond_destroy(&p->cond);
+#else
+	(void) p;
+#endif
+}
+
+/*
+ * announce that we're about to sleep, after this the thread must look
+ * for something to do once more before calling park_wait() with the
+ * epoch returned, or park_cancel() if it found something
+ */
+EXPORT unsigned int park_prepare(struct parking *p)
+{
+	unsigned int epoch = atomic_load(&p->epoch);
+
+	atomic_fetch_add(&p->waiting, 1);
+	/* pairs with the fence in park_wake() so either we see what was
+	   given to us, or the waker sees us waiting */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	return epoch;
+}
+
+EXPORT void park_cancel(struct parking *p)
+{
+	atomic_fetch_sub(&p->waiting, 1);
+}
+
+/*
+ * sleep until woken, unless we were woken since park_prepare()
+ */
+EXPORT void park_wait(struct parking *p, unsigned int epoch)
+{
+#ifdef __linux__
+	syscall(SYS_futex, (unsigned int *) &p->epoch, FUTEX_WAIT_PRIVATE,
+		epoch, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&p->mutex);
+	while (atomic_load(&p->epoch) == epoch)
+		pthread_cond_wait(&p->cond, &p->mutex);
+	pthread_mutex_unlock(&p->mutex);
+#endif
+
+	atomic_fetch_sub(&p->waiting, 1);
+}
+
+/*
+ * wake the sleeping threads after giving them something to do,
+ * this is cheap when no one sleeps
+ */
+EXPORT void park_wake(struct parking *p)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_load(&p->waiting) == 0)
+		return;
+
+#ifdef __linux__
+	atomic_fetch_add(&p->epoch, 1);
+	syscall(SYS_futex, (unsigned int *) &p->epoch, FUTEX_WAKE_PRIVATE,
+		INT_MAX, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&p->mutex);
+	atomic_fetch_add(&p->epoch, 1);
+	pthread_mutex_unlock(&p->mutex);
+	pthread_cond_broadcast(&p->cond);
+#endif
+}
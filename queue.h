@@ -0,0 +1,58 @@
+#ifndef MKTORRENT_QUEUE_H
+#define MKTORRENT_QUEUE_H
+
+#include <stddef.h>      /* size_t */
+#include <stdatomic.h>   /* atomic_size_t etc. */
+#include <pthread.h>     /* pthread_mutex_t etc. */
+
+#include "export.h"      /* EXPORT */
+
+/* size of a cache line, the ends of a ring are kept apart so
+   producers and consumers don't fight over the same line */
+#define CACHE_LINE 64
+
+struct ring_cell {
+	atomic_size_t seq;
+	void *data;
+};
+
+/*
+ * a bounded lock-free FIFO queue of pointers for any number of
+ * producers and consumers
+ */
+struct ring {
+	struct ring_cell *cells;
+	size_t mask;
+	char pad0[CACHE_LINE];
+	atomic_size_t head;      /* next cell to push to */
+	char pad1[CACHE_LINE];
+	atomic_size_t tail;      /* next cell to pop from */
+	char pad2[CACHE_LINE];
+};
+
+/*
+ * where threads with nothing to do sleep until woken,
+ * on a futex on Linux
+ */
+struct parking {
+	atomic_uint epoch;       /* changed on every wake up */
+	atomic_uint waiting;     /* number of threads about to sleep */
+#ifndef __linux__
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+};
+
+EXPORT void ring_init(struct ring *r, size_t capacity);
+EXPORT void ring_destroy(struct ring *r);
+EXPORT int ring_push(struct ring *r, void *data);
+EXPORT void *ring_pop(struct ring *r);
+
+EXPORT void parking_init(struct parking *p);
+EXPORT void parking_destroy(struct parking *p);
+EXPORT unsigned int park_prepare(struct parking *p);
+EXPORT void park_cancel(struct parking *p);
+EXPORT void park_wait(struct parking *p, unsigned int epoch);
+EXPORT void park_wake(struct parking *p);
+
+#endif /* MKTORRENT_QUEUE_H */
@@ -0,0 +1,245 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* malloc(), free() */
+#include <stdio.h>        /* fopen(), fprintf() etc. */
+#include <string.h>       /* strlen(), strerror() */
+#include <errno.h>        /* errno */
+#include <time.h>         /* time() */
+#include <inttypes.h>     /* PRIuMAX, PRId64 */
+
+#ifdef USE_OPENSSL
+#include <openssl/sha.h>  /* SHA_DIGEST_LENGTH etc. */
+#else
+#include "sha1.h"
+#include "sha256.h"
+#endif
+
+#include "export.h"
+#include "mktorrent.h"
+#include "bencode.h"
+#include "resume.h"
+#include "msg.h"
+#include "ll.h"
+
+/* added to the path of a metainfo file for the fast resume data */
+#define LIBTORRENT_SUFFIX ".fastresume"
+#define RTORRENT_SUFFIX ".rtorrent"
+
+/* the key rTorrent keeps its resume data in, in the metainfo file */
+#define RTORRENT_KEY "libtorrent_resume"
+
+
+static void write_string(FILE *f, const void *s, size_t len)
+{
+	fprintf(f, "%lu:", (unsigned long) len);
+	fwrite(s, 1, len, f);
+}
+
+/*
+ * the modification time of a file in seconds, as clients store it
+ */
+static int64_t mtime_seconds(const struct file_data *fd)
+{
+	return fd->mtime / 1000000000;
+}
+
+/*
+ * open the file the data for a client is written to, next to the
+ * metainfo file. returns NULL after a warning if it cannot be opened
+ */
+static FILE *open_resume_file(const char *metainfo, const char *suffix,
+		char **path)
+{
+	FILE *f;
+
+	*path = malloc(strlen(metainfo) + strlen(suffix) + 1);
+	FATAL_IF0(*path == NULL, "out of memory\n");
+	sprintf(*path, "%s%s", metainfo, suffix);
+
+	f = fopen(*path, "wb");
+	if (f == NULL)
+		fprintf(stderr, "warning: cannot create '%s': %s\n",
+			*path, strerror(errno));
+
+	return f;
+}
+
+/*
+ * close the file written and warn if anything went wrong
+ */
+static void close_resume_file(FILE *f, char *path)
+{
+	int ok = !ferror(f);
+
+	if (fclose(f))
+		ok = 0;
+	if (!ok)
+		fprintf(stderr, "warning: cannot write '%s': %s\n",
+			path, strerror(errno));
+
+	free(path);
+}
+
+/*
+ * write the libtorrent resume data, every piece is there. the sizes
+ * and times of the files are only read by older versions, which also
+ * list the pad files
+ */
+static void write_libtorrent(struct metafile *m,
+		const unsigned char *info_hash, const unsigned char *info_hash_v2)
+{
+	long now = (long) time(NULL);
+	char *path;
+	FILE *f;
+
+	f = open_resume_file(m->metainfo_file_path, LIBTORRENT_SUFFIX, &path);
+	if (f == NULL) {
+		free(path);
+		return;
+	}
+
+	fprintf(f, "d10:added_timei%lde10:allocation6:sparse"
+		"14:completed_timei%lde", now, now);
+
+	if (m->meta_version & META_V1) {
+		fprintf(f, "10:file sizesl");
+		LL_FOR(file_node, m->file_list) {
+			struct file_data *fd = LL_DATA_AS(file_node, struct file_data*);
+
+			fprintf(f, "li%" PRIuMAX "ei%" PRId64 "ee",
+				fd->size, mtime_seconds(fd));
+			if (m->pad_files && LL_NEXT(file_node)
+					&& fd->size % m->piece_length)
+				fprintf(f, "li%" PRIuMAX "ei0ee", (uintmax_t)
+					(m->piece_length - fd->size % m->piece_length));
+		}
+		fprintf(f, "e");
+	}
+
+	fprintf(f, "11:file-format22:libtorrent resume file"
+		"12:file-versioni1e");
+
+	if (m->meta_version & META_V1) {
+		fprintf(f, "9:info-hash");
+		write_string(f, info_hash, SHA_DIGEST_LENGTH);
+	}
+	if (m->meta_version & META_V2) {
+		fprintf(f, "10:info-hash2");
+		write_string(f, info_hash_v2, SHA256_DIGEST_LENGTH);
+	}
+
+	fprintf(f, "4:name");
+	write_string(f, m->torrent_name, strlen(m->torrent_name));
+
+	/* a byte for every piece, with the lowest bit set if we have it */
+	fprintf(f, "6:pieces%u:", m->pieces);
+	for (unsigned int i = 0; i < m->pieces; i++)
+		fputc(1, f);
+
+	fprintf(f, "9:save_path");
+	write_string(f, m->save_path, strlen(m->save_path));
+	fprintf(f, "e");
+
+	close_resume_file(f, path);
+}
+
+/*
+ * write the libtorrent_resume entry of rTorrent, every piece is there
+ * and every file is complete as long as its mtime is the same
+ */
+static void write_rtorrent_entry(FILE *f, struct metafile *m)
+{
+	uintmax_t offset = 0;
+
+	fprintf(f, "17:" RTORRENT_KEY "d8:bitfieldi%ue5:filesl", m->pieces);
+
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *fd = LL_DATA_AS(file_node, struct file_data*);
+		uintmax_t chunks = 0;
+
+		/* the pieces the file is part of */
+		if (fd->size)
+			chunks = (offset + fd->size - 1) / m->piece_length
+				- offset / m->piece_length + 1;
+		offset += fd->size;
+
+		fprintf(f, "d9:completedi%" PRIuMAX "e5:mtimei%" PRId64
+			"e8:priorityi1ee", chunks, mtime_seconds(fd));
+	}
+
+	fprintf(f, "ee");
+}
+
+/*
+ * write a copy of the metainfo file with the resume data of rTorrent
+ * added, between the keys before and after it
+ */
+static void write_rtorrent(struct metafile *m)
+{
+	struct bencode *root;
+	int written = 0;
+	char *buf, *path;
+	size_t len;
+	FILE *f;
+
+	buf = bencode_read_file(m->metainfo_file_path, &len);
+	root = bencode_parse(buf, len);
+	FATAL_IF(root == NULL || root->type != BENCODE_DICT,
+		"cannot read back '%s'\n", m->metainfo_file_path);
+
+	f = open_resume_file(m->metainfo_file_path, RTORRENT_SUFFIX, &path);
+	if (f == NULL) {
+		free(path);
+		bencode_free(root);
+		free(buf);
+		return;
+	}
+
+	fprintf(f, "d");
+	for (struct bencode *k = root->child; k; k = k->next->next) {
+		if (!written && bencode_key_cmp(k, RTORRENT_KEY) > 0) {
+			write_rtorrent_entry(f, m);
+			written = 1;
+		}
+
+		fwrite(k->raw, 1, k->raw_len, f);
+		fwrite(k->next->raw, 1, k->next->raw_len, f);
+	}
+	if (!written)
+		write_rtorrent_entry(f, m);
+	fprintf(f, "e");
+
+	close_resume_file(f, path);
+	bencode_free(root);
+	free(buf);
+}
+
+/*
+ * write the fast resume data of the clients asked for next to the
+ * metainfo file written, so they seed without checking the content
+ */
+EXPORT void write_fast_resume(struct metafile *m,
+		const unsigned char *info_hash, const unsigned char *info_hash_v2)
+{
+	if (m->fast_resume & RESUME_LIBTORRENT)
+		write_libtorrent(m, info_hash, info_hash_v2);
+	if (m->fast_resume & RESUME_RTORRENT)
+		write_rtorrent(m);
+}
@@ -0,0 +1,10 @@
+#ifndef MKTORRENT_RESUME_H
+#define MKTORRENT_RESUME_H
+
+#include "export.h"      /* EXPORT */
+#include "mktorrent.h"   /* struct metafile */
+
+EXPORT void write_fast_resume(struct metafile *m,
+		const unsigned char *info_hash, const unsigned char *info_hash_v2);
+
+#endif /* MKTORRENT_RESUME_H */
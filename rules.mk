@@ -15,7 +15,7 @@
 # along with this program; if not, write to the Free Software
 # Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 
-.PHONY: strip indent clean install uninstall
+.PHONY: library strip indent clean install uninstall
 
 $(program): $(OBJS)
 	$(CC) $(CFLAGS) $(OBJS) -o $(program) $(LDFLAGS) $(LIBS)
@@ -23,6 +23,11 @@ $(program): $(OBJS)
 allinone: $(SRCS) $(HEADERS)
 	$(CC) $(CFLAGS) $(DEFINES) -DVERSION="\"$(version)\"" -DALLINONE main.c -o $(program) $(LDFLAGS) $(LIBS)
 
+library: libmktorrent.c libmktorrent.h
+	$(CC) $(CFLAGS) -DMKTORRENT_PROGRAM="\"$(PREFIX)/bin/$(program)\"" -fPIC -c libmktorrent.c -o libmktorrent.o
+	$(AR) rcs libmktorrent.a libmktorrent.o
+	$(CC) $(CFLAGS) -shared libmktorrent.o -o libmktorrent.so $(LDFLAGS)
+
 strip:
 	strip $(program)
 
@@ -30,7 +35,7 @@ indent:
 	indent -kr -i8 *.c *.h
 
 clean:
-	rm -f $(program) *.o *.c~ *.h~
+	rm -f $(program) libmktorrent.a libmktorrent.so *.o *.c~ *.h~
 
 install: $(program)
 	$(INSTALL) -d $(DESTDIR)$(PREFIX)/bin
@@ -0,0 +1,636 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* malloc(), free(), exit() */
+#include <stdio.h>        /* fdopen(), open_memstream(), fprintf() etc. */
+#include <string.h>       /* strerror(), strlen(), memchr() */
+#include <errno.h>        /* errno */
+#include <inttypes.h>     /* uintmax_t */
+#include <signal.h>       /* sigaction(), kill() */
+#include <time.h>         /* clock_gettime() */
+#include <poll.h>         /* poll() */
+#include <sys/types.h>    /* pid_t */
+#include <sys/stat.h>     /* stat() */
+#include <sys/socket.h>   /* socket(), bind(), listen(), accept(), send() */
+#include <sys/un.h>       /* struct sockaddr_un */
+#include <sys/wait.h>     /* waitpid() */
+#include <unistd.h>       /* fork(), dup2(), pipe(), unlink(), optind */
+
+#include "export.h"
+#include "mktorrent.h"
+#include "batch.h"
+#include "server.h"
+#include "output.h"
+#include "msg.h"
+#include "ll.h"
+
+/* jobs queued or running at once, more clients are turned away */
+#define SERVER_MAX_JOBS 64
+
+/* longest line of a job a client may send */
+#define SERVER_MAX_LINE 65536
+
+/* seconds a client has to send the line of its job once connected,
+   so idle clients don't hold the slots of the jobs */
+#define SERVER_LINE_TIMEOUT 10
+
+
+/*
+ * a job sent by a client, who is told how it goes
+ * until it is done and the connection is closed
+ */
+struct server_job {
+	FILE *out;               /* the connection, NULL if the slot is free */
+	unsigned long id;        /* number of the job, in the order they came */
+	char *buf;               /* the line read so far, the arguments
+	                            point into it once it is read */
+	size_t len;
+	long long deadline;      /* when the line must be read by */
+	int argc;                /* 0 until the line is read */
+	char **argv;             /* the options given with -L, then the line's */
+	const char *target;      /* the last argument of the line */
+	uintmax_t dev;           /* device the target is on */
+	int dev_known;           /* the target could be stat'ed */
+	pid_t pid;               /* running it, 0 before it starts */
+	long threads;            /* it hashes with */
+	FILE *err;               /* its standard error */
+	int eof;                 /* the client sends no more */
+	int gone;                /* the client went away or doesn't read */
+	int killed;              /* the job is stopped as no one waits for it */
+};
+
+static struct server_job server_jobs[SERVER_MAX_JOBS];
+static int listener = -1;
+
+/* the signal handler wakes poll() up through it */
+static int signal_pipe[2];
+static volatile sig_atomic_t server_stopping;
+
+
+static long long now_ms(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (long long) t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static void on_server_signal(int sig)
+{
+	int saved = errno;
+	ssize_t r;
+
+	if (sig != SIGCHLD)
+		server_stopping = 1;
+
+	r = write(signal_pipe[1], "", 1);
+	(void) r;
+	errno = saved;
+}
+
+static void set_server_signals(void (*handler)(int))
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* a client that goes away must not take the server with it */
+	sa.sa_handler = handler == SIG_DFL ? SIG_DFL : SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+}
+
+/*
+ * tell the client of a job how it goes, the events are JSON like
+ * the results of -j, each on a line of its own. the server doesn't
+ * wait for a client, one that doesn't take the whole event at once
+ * is taken as gone
+ */
+static void send_event(struct server_job *j, const char *event,
+		const char *error)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	ssize_t r;
+	FILE *f;
+
+	if (j->gone)
+		return;
+
+	f = open_memstream(&buf, &len);
+	FATAL_IF(f == NULL, "cannot write an event: %s\n", strerror(errno));
+	fprintf(f, "{\"job\": %lu, \"event\": \"%s\"", j->id, event);
+	if (error) {
+		fprintf(f, ", \"error\": ");
+		print_json_string(f, error);
+	}
+	fprintf(f, "}\n");
+	FATAL_IF(fclose(f), "cannot write an event: %s\n", strerror(errno));
+
+	r = send(fileno(j->out), buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (r < 0 || (size_t) r < len)
+		j->gone = 1;
+	free(buf);
+}
+
+/*
+ * close the connection of a job and free its slot
+ */
+static void end_job(struct server_job *j)
+{
+	fclose(j->out);
+	if (j->err)
+		fclose(j->err);
+	free(j->argv);
+	free(j->buf);
+	memset(j, 0, sizeof(*j));
+}
+
+/*
+ * take a client that connected, or turn it away if there are jobs
+ * enough already
+ */
+static void accept_job(void)
+{
+	static unsigned long next_id = 1;
+	struct server_job *j = NULL;
+	int fd;
+
+	fd = accept(listener, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	for (size_t i = 0; i < SERVER_MAX_JOBS; i++)
+		if (server_jobs[i].out == NULL) {
+			j = &server_jobs[i];
+			break;
+		}
+
+	if (j == NULL) {
+		static const char busy[] = "{\"event\": \"failed\", "
+			"\"error\": \"too many jobs\"}\n";
+		ssize_t r = write(fd, busy, sizeof(busy) - 1);
+
+		(void) r;
+		close(fd);
+		return;
+	}
+
+	j->out = fdopen(fd, "w");
+	FATAL_IF(j->out == NULL, "cannot open the connection: %s\n",
+		strerror(errno));
+	j->id = next_id++;
+	j->deadline = now_ms() + SERVER_LINE_TIMEOUT * 1000;
+}
+
+/*
+ * read what the client of a job sent, until the line of the job is
+ * there. the job is queued then, or the connection is closed if the
+ * line is wrong or the client went away
+ */
+static void read_job(struct server_job *j, struct metafile *m,
+		const char *argv0)
+{
+	char *end;
+	ssize_t n;
+	struct stat s;
+
+	if (j->buf == NULL) {
+		j->buf = malloc(SERVER_MAX_LINE + 1);
+		FATAL_IF0(j->buf == NULL, "out of memory\n");
+	}
+
+	n = read(fileno(j->out), j->buf + j->len, SERVER_MAX_LINE - j->len);
+	if (n <= 0) {
+		end_job(j);
+		return;
+	}
+	j->len += n;
+
+	end = memchr(j->buf, '\n', j->len);
+	if (end == NULL) {
+		if (j->len == SERVER_MAX_LINE) {
+			send_event(j, "failed", "the line is too long");
+			end_job(j);
+		}
+		return;
+	}
+	*end = '\0';
+
+	j->argc = batch_argv(m, argv0, j->buf, &j->argv);
+	if (j->argc <= 0) {
+		send_event(j, "failed", j->argc == -2 ?
+			"an option a job cannot take" : j->argc ?
+			"unclosed quote" : "no target given");
+		end_job(j);
+		return;
+	}
+	j->target = j->argv[j->argc - 1];
+
+	/* a target that isn't there fails in its job */
+	if (stat(j->target, &s) == 0) {
+		j->dev = (uintmax_t) s.st_dev;
+		j->dev_known = 1;
+	}
+
+	send_event(j, "queued", NULL);
+}
+
+/*
+ * see whether the client of a job queued or running went away, what
+ * else it sends is dropped. a client that only stops sending still
+ * waits for its job
+ */
+static void check_client(struct server_job *j, short revents)
+{
+	char drain[256];
+	ssize_t n;
+
+	if (revents & (POLLHUP | POLLERR)) {
+		j->gone = 1;
+		return;
+	}
+
+	n = read(fileno(j->out), drain, sizeof(drain));
+	if (n == 0)
+		j->eof = 1;
+	else if (n < 0 && errno != EINTR && errno != EAGAIN)
+		j->gone = 1;
+}
+
+/*
+ * close the connections of the clients gone whose jobs haven't
+ * started, and stop the jobs running for those gone
+ */
+static void drop_gone(void)
+{
+	for (size_t i = 0; i < SERVER_MAX_JOBS; i++) {
+		struct server_job *j = &server_jobs[i];
+
+		if (j->out == NULL || !j->gone)
+			continue;
+
+		if (j->pid == 0)
+			end_job(j);
+		else if (!j->killed) {
+			kill(j->pid, SIGTERM);
+			j->killed = 1;
+		}
+	}
+}
+
+/*
+ * whether a job is running on the device of the given job
+ */
+static int device_in_use(struct server_job *j)
+{
+	if (!j->dev_known)
+		return 0;
+
+	for (size_t i = 0; i < SERVER_MAX_JOBS; i++)
+		if (server_jobs[i].pid && server_jobs[i].dev_known
+				&& server_jobs[i].dev == j->dev)
+			return 1;
+
+	return 0;
+}
+
+#ifdef USE_PTHREADS
+/*
+ * the devices of the jobs queued or running, a job whose target
+ * couldn't be stat'ed counts as one of its own
+ */
+static long job_devices(void)
+{
+	long devices = 0;
+
+	for (size_t i = 0; i < SERVER_MAX_JOBS; i++) {
+		struct server_job *j = &server_jobs[i];
+		size_t k = 0;
+
+		if (j->out == NULL || j->argc == 0)
+			continue;
+		while (k < i && !(server_jobs[k].out && server_jobs[k].argc
+				&& server_jobs[k].dev_known && j->dev_known
+				&& server_jobs[k].dev == j->dev))
+			k++;
+		if (k == i)
+			devices++;
+	}
+
+	return devices;
+}
+
+/*
+ * the threads of the jobs running
+ */
+static long running_threads(void)
+{
+	long busy = 0;
+
+	for (size_t i = 0; i < SERVER_MAX_JOBS; i++)
+		if (server_jobs[i].pid)
+			busy += server_jobs[i].threads;
+
+	return busy;
+}
+#endif
+
+/*
+ * run a job in a child process, which writes its results straight
+ * to the client, and its errors to a temporary file
+ */
+static void fork_job(struct server_job *j, struct metafile *m,
+		int (*run)(int argc, char *argv[]))
+{
+	j->err = tmpfile();
+	if (j->err == NULL) {
+		send_event(j, "failed", strerror(errno));
+		end_job(j);
+		return;
+	}
+
+	send_event(j, "started", NULL);
+	if (j->gone) {
+		end_job(j);
+		return;
+	}
+
+	/* don't leave what we've printed to be printed again */
+	fflush(stdout);
+	fflush(stderr);
+
+	j->pid = fork();
+	if (j->pid < 0) {
+		j->pid = 0;
+		send_event(j, "failed", strerror(errno));
+		end_job(j);
+		return;
+	}
+
+	if (j->pid == 0) {
+		/* the job only keeps its own connection */
+		set_server_signals(SIG_DFL);
+		close(listener);
+		close(signal_pipe[0]);
+		close(signal_pipe[1]);
+		for (size_t i = 0; i < SERVER_MAX_JOBS; i++)
+			if (server_jobs[i].out && &server_jobs[i] != j)
+				close(fileno(server_jobs[i].out));
+
+		FATAL_IF(dup2(fileno(j->out), STDOUT_FILENO) < 0
+			|| dup2(fileno(j->err), STDERR_FILENO) < 0,
+			"cannot redirect the output: %s\n", strerror(errno));
+
+		exit(run_job(m, j->argc, j->argv, j->threads, run));
+	}
+}
+
+/*
+ * tell the client of a job that is done how it went, a failure comes
+ * with what the job wrote to standard error
+ */
+static void finish_job(struct server_job *j, int status)
+{
+	char error[256];
+	size_t len;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+		send_event(j, "done", NULL);
+		end_job(j);
+		return;
+	}
+
+	rewind(j->err);
+	len = fread(error, 1, sizeof(error) - 1, j->err);
+	while (len && (error[len - 1] == '\n' || error[len - 1] == '\r'))
+		len--;
+	error[len] = '\0';
+
+	if (len == 0 && WIFSIGNALED(status))
+		snprintf(error, sizeof(error), "killed by signal %d",
+			WTERMSIG(status));
+	else if (len == 0)
+		snprintf(error, sizeof(error), "exit status %d",
+			WEXITSTATUS(status));
+
+	send_event(j, "failed", error);
+	end_job(j);
+}
+
+/*
+ * start the queued jobs whose device is free, in the order they came,
+ * while there are threads free for them. a job starts with an even
+ * share of the threads of a single run for the devices with jobs
+ */
+static void start_jobs(struct metafile *m,
+		int (*run)(int argc, char *argv[]))
+{
+	while (1) {
+		struct server_job *next = NULL;
+
+		for (size_t i = 0; i < SERVER_MAX_JOBS; i++) {
+			struct server_job *j = &server_jobs[i];
+
+			if (j->out && j->argc && j->pid == 0
+					&& !device_in_use(j)
+					&& (next == NULL || j->id < next->id))
+				next = j;
+		}
+
+		if (next == NULL)
+			return;
+#ifdef USE_PTHREADS
+		next->threads = job_threads(m, running_threads(), job_devices());
+		if (next->threads == 0)
+			return;
+#endif
+		fork_job(next, m, run);
+	}
+}
+
+/*
+ * listen on a Unix socket and create a torrent for every line a client
+ * sends, each like a run with the options given with -L followed by
+ * those of the line. the jobs on the same device run one at a time in
+ * the order they came, while the jobs on other devices run at the same
+ * time. the client is told when its job is queued, started and done or
+ * failed, with the results of -j in between, and the connection is
+ * closed then. a client that doesn't send its line in time is dropped.
+ * the jobs running at once hash with no more threads than a single run
+ * would, all of them together.
+ * on SIGINT or SIGTERM no new jobs are taken, and the
+ * server returns when the jobs running are done
+ */
+EXPORT int run_server(struct metafile *m, const char *argv0,
+		int (*run)(int argc, char *argv[]))
+{
+	struct pollfd fds[SERVER_MAX_JOBS + 2];
+	struct server_job *polled[SERVER_MAX_JOBS + 2];
+	struct sockaddr_un addr;
+	struct stat s;
+	int running = 0;
+
+	FATAL_IF(strlen(m->socket_path) >= sizeof(addr.sun_path),
+		"the socket path '%s' is too long\n", m->socket_path);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, m->socket_path);
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	FATAL_IF(listener < 0, "cannot create a socket: %s\n", strerror(errno));
+
+	/* a socket left by a server that is gone is taken over */
+	if (stat(m->socket_path, &s) == 0 && S_ISSOCK(s.st_mode))
+		unlink(m->socket_path);
+
+	FATAL_IF(bind(listener, (struct sockaddr *) &addr, sizeof(addr))
+		|| listen(listener, SOMAXCONN),
+		"cannot listen on '%s': %s\n", m->socket_path, strerror(errno));
+
+	FATAL_IF(pipe(signal_pipe), "cannot create a pipe: %s\n",
+		strerror(errno));
+	set_server_signals(on_server_signal);
+
+	if (!m->machine_readable) {
+		printf("listening on %s\n", m->socket_path);
+		fflush(stdout);
+	}
+
+	do {
+		nfds_t count = 0;
+		int timeout = -1;
+		long long now;
+		int status;
+		pid_t pid;
+
+		fds[count].fd = signal_pipe[0];
+		fds[count].events = POLLIN;
+		polled[count++] = NULL;
+
+		if (!server_stopping) {
+			fds[count].fd = listener;
+			fds[count].events = POLLIN;
+			polled[count++] = NULL;
+		}
+
+		/* the clients whose line isn't read yet, until the
+		   first of them runs out of time, and those waiting
+		   for their jobs, to see if they go away */
+		now = now_ms();
+		for (size_t i = 0; i < SERVER_MAX_JOBS; i++) {
+			struct server_job *j = &server_jobs[i];
+
+			if (j->out == NULL || j->gone)
+				continue;
+
+			if (j->argc == 0) {
+				long long left = j->deadline - now;
+
+				if (left < 0)
+					left = 0;
+				if (timeout < 0 || left < timeout)
+					timeout = left;
+			}
+
+			fds[count].fd = fileno(j->out);
+			fds[count].events = j->eof ? 0 : POLLIN;
+			polled[count++] = j;
+		}
+
+		if (poll(fds, count, timeout) < 0) {
+			FATAL_IF(errno != EINTR, "cannot poll: %s\n",
+				strerror(errno));
+			continue;
+		}
+
+		for (nfds_t i = 0; i < count; i++) {
+			if (fds[i].revents == 0)
+				continue;
+
+			if (polled[i] && polled[i]->argc == 0)
+				read_job(polled[i], m, argv0);
+			else if (polled[i])
+				check_client(polled[i], fds[i].revents);
+			else if (fds[i].fd == listener)
+				accept_job();
+			else {
+				char drain[64];
+				ssize_t r;
+
+				r = read(signal_pipe[0], drain, sizeof(drain));
+
+				(void) r;
+			}
+		}
+
+		/* drop the clients that didn't send their line in time */
+		now = now_ms();
+		for (size_t i = 0; i < SERVER_MAX_JOBS; i++) {
+			struct server_job *j = &server_jobs[i];
+
+			if (j->out && j->argc == 0 && j->deadline <= now) {
+				send_event(j, "failed", "no job was sent in time");
+				end_job(j);
+			}
+		}
+
+		/* the jobs done */
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+			for (size_t i = 0; i < SERVER_MAX_JOBS; i++)
+				if (server_jobs[i].pid == pid)
+					finish_job(&server_jobs[i], status);
+
+		drop_gone();
+
+		/* turn away the jobs that haven't started when stopping */
+		for (size_t i = 0; i < SERVER_MAX_JOBS; i++) {
+			struct server_job *j = &server_jobs[i];
+
+			if (server_stopping && j->out && j->pid == 0) {
+				send_event(j, "failed", "the server is stopping");
+				end_job(j);
+			}
+		}
+
+		if (!server_stopping)
+			start_jobs(m, run);
+
+		running = 0;
+		for (size_t i = 0; i < SERVER_MAX_JOBS; i++)
+			if (server_jobs[i].pid)
+				running++;
+	} while (!server_stopping || running);
+
+	set_server_signals(SIG_DFL);
+	close(signal_pipe[0]);
+	close(signal_pipe[1]);
+	close(listener);
+	unlink(m->socket_path);
+
+	if (!m->machine_readable)
+		printf("stopped listening on %s\n", m->socket_path);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,10 @@
+#ifndef MKTORRENT_SERVER_H
+#define MKTORRENT_SERVER_H
+
+#include "export.h"      /* EXPORT */
+#include "mktorrent.h"   /* struct metafile */
+
+EXPORT int run_server(struct metafile *m, const char *argv0,
+		int (*run)(int argc, char *argv[]));
+
+#endif /* MKTORRENT_SERVER_H */
@@ -12,7 +12,6 @@
  */
 
 /* #define SHA1_TEST */
-/* #define SHA1_HANDSOFF */
 /* #define SHA1_WIPE_VARS */
 /* #define SHA1_VERBOSE */
 
@@ -72,15 +71,12 @@ static void SHA1_Transform(uint32_t state[5], const uint8_t buffer[64])
 		uint8_t c[64];
 		uint32_t l[16];
 	} CHAR64LONG16;
-	CHAR64LONG16 *block;
-#ifdef SHA1_HANDSOFF
-	static uint8_t workspace[64];
+	CHAR64LONG16 block[1];
 
-	block = (CHAR64LONG16 *)workspace;
+	/* the block is expanded in place, so work on a copy on the stack;
+	   the same data may be hashed more than once and by several
+	   threads at the same time */
 	memcpy(block, buffer, 64);
-#else
-	block = (CHAR64LONG16 *)buffer;
-#endif
 
 	/* Copy context->state[] to working vars */
 	a = state[0];
@@ -197,10 +193,6 @@ EXPORT void SHA1_Final(uint8_t *digest, SHA_CTX *context)
 	memset(context->count, 0, 8);
 	memset(finalcount, 0, 8);
 #endif
-
-#ifdef SHA1_HANDSOFF /* make SHA1Transform overwrite its own static vars */
-	SHA1_Transform(context->state, context->buffer);
-#endif
 }
 
 
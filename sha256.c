@@ -0,0 +1,211 @@
+/*
+ * SHA-256 in C
+ * Written from the description in FIPS PUB 180-4
+ * for mktorrent
+ * 100% Public Domain
+ */
+
+/* #define SHA256_TEST */
+
+
+#ifdef SHA256_TEST
+#include <stdio.h>
+#endif
+
+#include <string.h>
+#include <stdint.h>
+
+#include "export.h"
+#include "sha256.h"
+
+#define ror(value, bits) (((value) >> (bits)) | ((value) << (32 - (bits))))
+
+#define Ch(x,y,z)  (((x) & (y)) ^ (~(x) & (z)))
+#define Maj(x,y,z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define S0(x) (ror(x, 2) ^ ror(x,13) ^ ror(x,22))
+#define S1(x) (ror(x, 6) ^ ror(x,11) ^ ror(x,25))
+#define s0(x) (ror(x, 7) ^ ror(x,18) ^ ((x) >>  3))
+#define s1(x) (ror(x,17) ^ ror(x,19) ^ ((x) >> 10))
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+/* Hash a single 512-bit block. This is the core of the algorithm. */
+static void SHA256_Transform(uint32_t state[8], const uint8_t buffer[64])
+{
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	uint32_t w[64];
+	int i;
+
+	/* the message schedule, the block is read big endian */
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t) buffer[4*i] << 24
+			| (uint32_t) buffer[4*i + 1] << 16
+			| (uint32_t) buffer[4*i + 2] << 8
+			| (uint32_t) buffer[4*i + 3];
+	for (; i < 64; i++)
+		w[i] = s1(w[i - 2]) + w[i - 7] + s0(w[i - 15]) + w[i - 16];
+
+	/* Copy context->state[] to working vars */
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+
+	/* 64 rounds */
+	for (i = 0; i < 64; i++) {
+		t1 = h + S1(e) + Ch(e, f, g) + K[i] + w[i];
+		t2 = S0(a) + Maj(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	/* Add the working vars back into context.state[] */
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+/* SHA256_Init - Initialize new context */
+EXPORT void SHA256_Init(SHA256_CTX *context)
+{
+	/* SHA-256 initialization constants */
+	context->state[0] = 0x6a09e667;
+	context->state[1] = 0xbb67ae85;
+	context->state[2] = 0x3c6ef372;
+	context->state[3] = 0xa54ff53a;
+	context->state[4] = 0x510e527f;
+	context->state[5] = 0x9b05688c;
+	context->state[6] = 0x1f83d9ab;
+	context->state[7] = 0x5be0cd19;
+	context->count = 0;
+}
+
+/* Run your data through this. */
+EXPORT void SHA256_Update(SHA256_CTX *context, const uint8_t *data, unsigned long len)
+{
+	size_t i, j;
+
+	j = context->count & 63;
+	context->count += len;
+
+	if ((j + len) > 63) {
+		memcpy(&context->buffer[j], data, (i = 64-j));
+		SHA256_Transform(context->state, context->buffer);
+		for ( ; i + 63 < len; i += 64) {
+			SHA256_Transform(context->state, data + i);
+		}
+		j = 0;
+	} else
+		i = 0;
+
+	memcpy(&context->buffer[j], &data[i], len - i);
+}
+
+/* Add padding and return the message digest. */
+EXPORT void SHA256_Final(uint8_t *digest, SHA256_CTX *context)
+{
+	uint64_t bits = context->count << 3;
+	uint8_t  finalcount[8];
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		/* Endian independent */
+		finalcount[i] = (uint8_t) (bits >> ((7 - i) * 8));
+	}
+
+	SHA256_Update(context, (uint8_t *)"\200", 1);
+	while ((context->count & 63) != 56) {
+		SHA256_Update(context, (uint8_t *)"\0", 1);
+	}
+	SHA256_Update(context, finalcount, 8);  /* Should cause a SHA256_Transform() */
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		digest[i] = (uint8_t)
+			((context->state[i>>2] >> ((3-(i & 3)) * 8)) & 255);
+	}
+}
+
+
+/*************************************************************\
+ * Self Test                                                 *
+\*************************************************************/
+#ifdef SHA256_TEST
+/*
+Test Vectors (from FIPS PUB 180-4 examples)
+
+"abc"
+  BA7816BF 8F01CFEA 414140DE 5DAE2223 B00361A3 96177A9C B410FF61 F20015AD
+"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"
+  248D6A61 D20638B8 E5C02693 0C3E6039 A33CE459 64FF2167 F6ECEDD4 19DB06C1
+*/
+static char *test_data[] = {
+	"abc",
+	"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"};
+static char *test_results[] = {
+	"BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD",
+	"248D6A61D20638B8E5C026930C3E6039A33CE45964FF2167F6ECEDD419DB06C1"};
+
+int main(int argc, char *argv[])
+{
+	int k, i;
+	SHA256_CTX context;
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	char output[2*SHA256_DIGEST_LENGTH + 1];
+
+	fprintf(stdout, "Verifying SHA-256 implementation... ");
+	fflush(stdout);
+
+	for (k = 0; k < 2; k++){
+		SHA256_Init(&context);
+		SHA256_Update(&context, (uint8_t *)test_data[k], strlen(test_data[k]));
+		SHA256_Final(digest, &context);
+		for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+			sprintf(output + 2*i, "%02X", digest[i]);
+
+		if (strcmp(output, test_results[k])) {
+			fprintf(stdout, "FAIL\n");
+			fprintf(stderr,"* hash of \"%s\" incorrect:\n", test_data[k]);
+			fprintf(stderr,"\t%s returned\n", output);
+			fprintf(stderr,"\t%s is correct\n", test_results[k]);
+			return 1;
+		}
+	}
+
+	/* success */
+	fprintf(stdout, "OK\n");
+	fflush(stdout);
+	return 0;
+}
+#endif /* SHA256_TEST */
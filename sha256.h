@@ -0,0 +1,25 @@
+/* Public API for mktorrent's public domain SHA-256 implementation */
+/* This file is in the public domain */
+
+
+#ifndef MKTORRENT_SHA256_H
+#define MKTORRENT_SHA256_H
+
+#include <stdint.h>  /* uintX_t */
+
+#include "export.h"  /* EXPORT */
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t count;
+    uint8_t  buffer[64];
+} SHA256_CTX;
+
+#define SHA256_DIGEST_LENGTH 32
+
+
+EXPORT void SHA256_Init(SHA256_CTX *context);
+EXPORT void SHA256_Update(SHA256_CTX *context, const uint8_t *data, unsigned long len);
+EXPORT void SHA256_Final(uint8_t *digest, SHA256_CTX *context);
+
+#endif /* MKTORRENT_SHA256_H */
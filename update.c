@@ -0,0 +1,684 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* malloc(), qsort(), bsearch() */
+#include <stdio.h>        /* fopen(), getline(), fprintf() etc. */
+#include <string.h>       /* memcpy(), strcmp(), strerror() */
+#include <errno.h>        /* errno */
+#include <inttypes.h>     /* PRIuMAX, strtoumax() etc. */
+
+#ifdef USE_OPENSSL
+#include <openssl/sha.h>  /* SHA_DIGEST_LENGTH */
+#else
+#include "sha1.h"
+#include "sha256.h"
+#endif
+
+#include "export.h"
+#include "mktorrent.h"
+#include "bencode.h"
+#include "checkpoint.h"
+#include "dedup.h"
+#include "update.h"
+#include "msg.h"
+#include "ll.h"
+
+/* added to the path of a metainfo file for its sidecar */
+#define TIMES_SUFFIX ".mtimes"
+
+
+/*
+ * read and parse a metainfo file, and find its info dictionary
+ */
+static struct bencode *load_metainfo(const char *path, char **buf,
+		struct bencode **info)
+{
+	struct bencode *root;
+	size_t len;
+
+	*buf = bencode_read_file(path, &len);
+	root = bencode_parse(*buf, len);
+	*info = bencode_get(root, "info", BENCODE_DICT);
+	FATAL_IF(*info == NULL, "'%s' is not a valid metainfo file\n", path);
+
+	return root;
+}
+
+/*
+ * the piece length of a metainfo file as a power of two, or 0 if
+ * it isn't one we can create torrents with
+ */
+EXPORT unsigned int update_piece_length(const char *path)
+{
+	struct bencode *root, *info, *len;
+	unsigned int r = 0;
+	char *buf;
+
+	root = load_metainfo(path, &buf, &info);
+	len = bencode_get(info, "piece length", BENCODE_INTEGER);
+
+	for (unsigned int n = 15; len && n <= 28; n++)
+		if (len->i == (intmax_t) 1 << n)
+			r = n;
+
+	bencode_free(root);
+	free(buf);
+
+	return r;
+}
+
+/*
+ * append a file to a list growing as needed
+ */
+static struct update_file *add_file(struct update_file **files,
+		size_t *count)
+{
+	struct update_file *f;
+
+	/* grow by doubling whenever the count is a power of two */
+	if ((*count & (*count - 1)) == 0) {
+		f = realloc(*files, (*count ? 2 * *count : 16) * sizeof(*f));
+		FATAL_IF0(f == NULL, "out of memory\n");
+		*files = f;
+	}
+
+	f = &(*files)[(*count)++];
+	memset(f, 0, sizeof(*f));
+
+	return f;
+}
+
+/*
+ * add a name to a path of the old torrent
+ */
+static char *join_name(const char *prefix, const char *name, size_t len)
+{
+	size_t n = strlen(prefix);
+	char *r = malloc(n + len + 2);
+
+	FATAL_IF0(r == NULL, "out of memory\n");
+
+	memcpy(r, prefix, n);
+	if (n)
+		r[n++] = DIRSEP_CHAR;
+	memcpy(r + n, name, len);
+	r[n + len] = '\0';
+
+	return r;
+}
+
+/*
+ * join the names of a path list of the old torrent into a path,
+ * or return NULL if it isn't one
+ */
+static char *join_path(struct bencode *list)
+{
+	char *r = strdup("");
+
+	FATAL_IF0(r == NULL, "out of memory\n");
+
+	for (struct bencode *c = list->child; c; c = c->next) {
+		char *p;
+
+		if (c->type != BENCODE_STRING) {
+			free(r);
+			return NULL;
+		}
+
+		p = join_name(r, c->s, c->len);
+		free(r);
+		r = p;
+	}
+
+	return r;
+}
+
+/*
+ * the files of the v1 file list, or the single file, of the old torrent.
+ * returns 0 if there are none
+ */
+static int load_file_list(struct update *u, struct bencode *info)
+{
+	struct bencode *files = bencode_get(info, "files", BENCODE_LIST);
+	struct bencode *len = bencode_get(info, "length", BENCODE_INTEGER);
+
+	if (files == NULL && len == NULL)
+		return 0;
+
+	if (files == NULL) {
+		struct update_file *f = add_file(&u->old, &u->old_count);
+
+		FATAL_IF(len->i < 0, "'%s' is not a valid metainfo file\n",
+			u->path);
+		f->path = strdup("");
+		FATAL_IF0(f->path == NULL, "out of memory\n");
+		f->size = len->i;
+		u->old_size = f->size;
+		return 1;
+	}
+
+	for (struct bencode *d = files->child; d; d = d->next) {
+		struct bencode *path = bencode_get(d, "path", BENCODE_LIST);
+		struct bencode *attr = bencode_get(d, "attr", BENCODE_STRING);
+		struct update_file *f;
+
+		len = bencode_get(d, "length", BENCODE_INTEGER);
+		FATAL_IF(len == NULL || len->i < 0 || path == NULL,
+			"'%s' is not a valid metainfo file\n", u->path);
+
+		f = add_file(&u->old, &u->old_count);
+		f->size = len->i;
+		f->start = u->old_size;
+		u->old_size += f->size;
+
+		/* a BEP 47 pad file is all zeros */
+		if (attr && memchr(attr->s, 'p', attr->len))
+			continue;
+
+		f->path = join_path(path);
+		FATAL_IF(f->path == NULL, "'%s' is not a valid metainfo file\n",
+			u->path);
+	}
+
+	return 1;
+}
+
+static int update_file_cmp(const void *a, const void *b)
+{
+	const struct update_file *x = *(struct update_file * const *) a;
+	const struct update_file *y = *(struct update_file * const *) b;
+
+	return strcmp(x->path, y->path);
+}
+
+static void sort_by_path(struct update *u)
+{
+	u->by_path = malloc((u->old_count + 1) * sizeof(*u->by_path));
+	FATAL_IF0(u->by_path == NULL, "out of memory\n");
+
+	u->path_count = 0;
+	for (size_t i = 0; i < u->old_count; i++)
+		if (u->old[i].path)
+			u->by_path[u->path_count++] = &u->old[i];
+
+	qsort(u->by_path, u->path_count, sizeof(*u->by_path), update_file_cmp);
+}
+
+/*
+ * the old file with the given path, or NULL
+ */
+static struct update_file *find_old(struct update *u, const char *path)
+{
+	struct update_file key, *k = &key, **r;
+
+	key.path = path;
+	r = bsearch(&k, u->by_path, u->path_count, sizeof(*u->by_path),
+		update_file_cmp);
+
+	return r ? *r : NULL;
+}
+
+/*
+ * go through the v2 file tree of the old torrent and take the pieces
+ * root of every file, adding the files if there is no v1 file list
+ */
+static void walk_tree(struct update *u, struct bencode *dir,
+		const char *prefix, int single, int add)
+{
+	for (struct bencode *k = dir->child; k; k = k->next->next) {
+		struct bencode *v = k->next;
+		struct bencode *file = bencode_find(v, "", 0);
+		struct bencode *len, *root;
+		struct update_file *f;
+		char *path;
+
+		FATAL_IF(v->type != BENCODE_DICT,
+			"'%s' is not a valid metainfo file\n", u->path);
+
+		path = single ? strdup("") : join_name(prefix, k->s, k->len);
+		FATAL_IF0(path == NULL, "out of memory\n");
+
+		if (file == NULL) {
+			walk_tree(u, v, path, 0, add);
+			free(path);
+			continue;
+		}
+
+		len = bencode_get(file, "length", BENCODE_INTEGER);
+		root = bencode_get(file, "pieces root", BENCODE_STRING);
+		FATAL_IF(len == NULL || len->i < 0,
+			"'%s' is not a valid metainfo file\n", u->path);
+
+		if (len->i == 0 || root == NULL || root->len != SHA256_DIGEST_LENGTH) {
+			free(path);
+			continue;
+		}
+
+		if (add) {
+			f = add_file(&u->old, &u->old_count);
+			f->path = path;
+			f->size = len->i;
+		} else {
+			f = find_old(u, path);
+			free(path);
+			if (f == NULL || f->size != (uintmax_t) len->i)
+				continue;
+		}
+
+		f->root = (const unsigned char *) root->s;
+	}
+}
+
+/*
+ * find the v2 piece hashes of the old files in the piece layers,
+ * a file of a single piece has its pieces root as its only hash
+ */
+static void find_layers(struct update *u)
+{
+	struct bencode *layers = bencode_get(u->root, "piece layers",
+		BENCODE_DICT);
+
+	for (size_t i = 0; i < u->old_count; i++) {
+		struct update_file *f = &u->old[i];
+		uintmax_t pieces = (f->size + u->piece_length - 1) / u->piece_length;
+		struct bencode *l;
+
+		if (f->root == NULL)
+			continue;
+
+		if (pieces == 1) {
+			f->layer = f->root;
+			continue;
+		}
+
+		l = bencode_find(layers, (const char *) f->root,
+			SHA256_DIGEST_LENGTH);
+		if (l && l->type == BENCODE_STRING
+				&& l->len == pieces * SHA256_DIGEST_LENGTH)
+			f->layer = (const unsigned char *) l->s;
+	}
+}
+
+/*
+ * read the sizes and modification times of the old files from the
+ * sidecar written with the old torrent, lines of
+ * <size> <mtime in nanoseconds> <path>
+ */
+static void load_times(struct update *u)
+{
+	const char *path = u->path;
+	char *name = malloc(strlen(path) + sizeof(TIMES_SUFFIX));
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *f;
+
+	FATAL_IF0(name == NULL, "out of memory\n");
+	sprintf(name, "%s" TIMES_SUFFIX, path);
+
+	f = fopen(name, "r");
+	if (f == NULL) {
+		fprintf(stderr, "warning: cannot open '%s': %s, files of the "
+			"same path and size are taken as unchanged\n",
+			name, strerror(errno));
+		free(name);
+		return;
+	}
+
+	u->has_times = 1;
+	while ((len = getline(&line, &size, f)) > 0) {
+		struct update_file *o;
+		uintmax_t file_size;
+		intmax_t mtime;
+		char *p = line;
+
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+
+		file_size = strtoumax(p, &p, 10);
+		if (*p != ' ')
+			continue;
+		mtime = strtoimax(p + 1, &p, 10);
+		if (*p != ' ')
+			continue;
+
+		o = find_old(u, p + 1);
+		if (o && o->size == file_size) {
+			o->mtime = mtime;
+			o->has_mtime = 1;
+		}
+	}
+
+	free(line);
+	fclose(f);
+	free(name);
+}
+
+/*
+ * lay out the files we hash in the stream of v1 pieces, with the
+ * gaps filled by pad files, and find the unchanged ones in the old
+ * torrent
+ */
+static void layout_files(struct update *u)
+{
+	struct metafile *m = u->m;
+
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *fd = LL_DATA_AS(file_node, struct file_data*);
+		uintmax_t start = m->pad_files ?
+			(uintmax_t) fd->piece * m->piece_length : u->new_size;
+		struct update_file *f, *o;
+
+		if (fd->size == 0)
+			continue;
+
+		if (start > u->new_size) {
+			f = add_file(&u->new, &u->new_count);
+			f->start = u->new_size;
+			f->size = start - u->new_size;
+		}
+
+		f = add_file(&u->new, &u->new_count);
+		f->path = m->target_is_directory ? fd->path : "";
+		f->size = fd->size;
+		f->start = start;
+		f->node = file_node;
+		u->new_size = start + fd->size;
+
+		o = find_old(u, f->path);
+		if (o && o->size == f->size
+				&& (!u->has_times || (o->has_mtime && o->mtime == fd->mtime)))
+			f->old = o;
+	}
+}
+
+/*
+ * read a metainfo file, its files in the order of the stream of v1
+ * pieces and their hashes
+ */
+EXPORT void update_read(struct update *u, struct metafile *m, const char *path)
+{
+	struct bencode *info, *len, *tree, *pieces, *name;
+	int single;
+
+	memset(u, 0, sizeof(*u));
+	u->m = m;
+	u->path = path;
+
+	u->root = load_metainfo(path, &u->buf, &info);
+	len = bencode_get(info, "piece length", BENCODE_INTEGER);
+	FATAL_IF(len == NULL || len->i <= 0 || len->i > UINT32_MAX
+			|| (len->i & (len->i - 1)),
+		"'%s' is not a valid metainfo file\n", path);
+	u->piece_length = len->i;
+
+	tree = bencode_get(info, "file tree", BENCODE_DICT);
+	name = bencode_get(info, "name", BENCODE_STRING);
+
+	if (load_file_list(u, info)) {
+		single = bencode_get(info, "files", BENCODE_LIST) == NULL;
+		sort_by_path(u);
+		if (tree)
+			walk_tree(u, tree, "", single, 0);
+	} else if (tree) {
+		/* a single file is the only entry, named as the torrent */
+		single = tree->len == 2 && bencode_find(tree->child->next, "", 0)
+			&& name && name->len == tree->child->len
+			&& memcmp(name->s, tree->child->s, name->len) == 0;
+		walk_tree(u, tree, "", single, 1);
+		sort_by_path(u);
+
+		/* every file starts a new piece, as in a hybrid torrent */
+		for (size_t i = 0; i < u->old_count; i++) {
+			u->old[i].start = (u->old_size + u->piece_length - 1)
+				/ u->piece_length * u->piece_length;
+			u->old_size = u->old[i].start + u->old[i].size;
+		}
+	}
+
+	if (tree)
+		find_layers(u);
+
+	pieces = bencode_get(info, "pieces", BENCODE_STRING);
+	if (pieces && pieces->len == SHA_DIGEST_LENGTH *
+			((u->old_size + u->piece_length - 1) / u->piece_length))
+		u->pieces = (const unsigned char *) pieces->s;
+	else if (pieces)
+		fprintf(stderr, "warning: the pieces of '%s' don't match "
+			"its files, ignoring them\n", path);
+}
+
+/*
+ * read the old torrent given, if any
+ */
+EXPORT void update_open(struct update *u, struct metafile *m)
+{
+	if (m->update_path == NULL) {
+		memset(u, 0, sizeof(*u));
+		u->m = m;
+		return;
+	}
+
+	update_read(u, m, m->update_path);
+	load_times(u);
+	layout_files(u);
+}
+
+/*
+ * the file at an offset of the stream, the files are in order
+ * and follow each other
+ */
+EXPORT struct update_file *update_file_at(struct update_file *files,
+		size_t count, uintmax_t offset)
+{
+	size_t lo = 0, hi = count;
+
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (files[mid].start <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return &files[lo];
+}
+
+/*
+ * the old v1 piece with the same content as the new piece of len
+ * bytes at the offset, that is made of the same parts of the same
+ * unchanged files and pad files, or -1 if there is none
+ */
+static intmax_t find_piece(struct update *u, uintmax_t offset, uintmax_t len)
+{
+	struct update_file *a = update_file_at(u->new, u->new_count, offset);
+	struct update_file *b;
+	uintmax_t x = offset, y, first;
+
+	if (a->old == NULL)
+		return -1;
+
+	/* the old piece starts there too, and is as long */
+	y = a->old->start + (x - a->start);
+	if (y % u->piece_length || y + len > u->old_size
+			|| (len < u->piece_length && y + len != u->old_size))
+		return -1;
+
+	first = y / u->piece_length;
+	b = a->old;
+	for (uintmax_t n = 0; n < len; ) {
+		uintmax_t step = len - n;
+
+		while (x >= a->start + a->size)
+			a++;
+		while (y >= b->start + b->size)
+			b++;
+
+		if ((a->path == NULL) != (b->path == NULL)
+				|| (a->path && (a->old != b
+					|| x - a->start != y - b->start)))
+			return -1;
+
+		if (a->start + a->size - x < step)
+			step = a->start + a->size - x;
+		if (b->start + b->size - y < step)
+			step = b->start + b->size - y;
+
+		x += step;
+		y += step;
+		n += step;
+	}
+
+	return first;
+}
+
+/*
+ * the hash of a piece of a set in the old torrent, or NULL
+ */
+static const unsigned char *piece_hash(struct update *u,
+		unsigned int set, uintmax_t piece)
+{
+	struct metafile *m = u->m;
+	unsigned int len = set == CHECKPOINT_V2 ?
+		m->piece_length : m->piece_lengths[set];
+	uintmax_t offset = piece * len;
+	struct update_file *a;
+	intmax_t q;
+
+	if (len != u->piece_length)
+		return NULL;
+
+	/* every file starts a new v2 piece */
+	if (set == CHECKPOINT_V2) {
+		a = update_file_at(u->new, u->new_count, offset);
+		if (a->path == NULL || a->old == NULL || a->old->layer == NULL)
+			return NULL;
+		return a->old->layer
+			+ (offset - a->start) / len * SHA256_DIGEST_LENGTH;
+	}
+
+	if (u->pieces == NULL)
+		return NULL;
+
+	q = find_piece(u, offset, u->new_size - offset < len ?
+		u->new_size - offset : len);
+
+	return q < 0 ? NULL : u->pieces + q * SHA_DIGEST_LENGTH;
+}
+
+/*
+ * take the hashes of the units whose pieces are all in the old
+ * torrent. returns the number of units taken
+ */
+EXPORT uintmax_t update_fill(struct update *u, struct checkpoint *cp)
+{
+	struct metafile *m = u->m;
+	uintmax_t r = 0;
+
+	if (u->root == NULL || u->new_count == 0)
+		return 0;
+
+	for (uintmax_t unit = 0; unit < cp->units; unit++) {
+		int found = 1;
+
+		if (checkpoint_done(cp, unit))
+			continue;
+
+		/* a duplicate is never read */
+		if (m->pad_files) {
+			struct update_file *a = update_file_at(u->new, u->new_count,
+				unit * cp->unit_len);
+
+			if (a->path == NULL || is_duplicate(m, a->node))
+				continue;
+		}
+
+		/* the hashes copied for a unit not found are hashed over */
+		for (unsigned int set = 0; found && set <= CHECKPOINT_V2; set++) {
+			unsigned int n = checkpoint_pieces(cp, unit, set);
+			unsigned char *dest = checkpoint_hash(cp, unit, set);
+
+			for (unsigned int i = 0; found && i < n; i++) {
+				const unsigned char *h = piece_hash(u, set,
+					unit * cp->per[set] + i);
+
+				if (h)
+					memcpy(dest + i * cp->digest[set], h,
+						cp->digest[set]);
+				else
+					found = 0;
+			}
+		}
+
+		if (found) {
+			checkpoint_unit(cp, unit);
+			r++;
+		}
+	}
+
+	if (!m->machine_readable)
+		printf("took %" PRIuMAX " of %" PRIuMAX " pieces from '%s'\n",
+			r, cp->units, m->update_path);
+
+	return r;
+}
+
+EXPORT void update_close(struct update *u)
+{
+	for (size_t i = 0; i < u->old_count; i++)
+		free((char *) u->old[i].path);
+	free(u->old);
+	free(u->by_path);
+	free(u->new);
+	bencode_free(u->root);
+	free(u->buf);
+}
+
+/*
+ * write the sidecar of a metainfo file with the size and modification
+ * time of every file, so the next update can tell if they changed
+ */
+EXPORT void update_write_times(struct metafile *m)
+{
+	char *name = malloc(strlen(m->metainfo_file_path) + sizeof(TIMES_SUFFIX));
+	FILE *f;
+	int ok;
+
+	FATAL_IF0(name == NULL, "out of memory\n");
+	sprintf(name, "%s" TIMES_SUFFIX, m->metainfo_file_path);
+
+	f = fopen(name, "w");
+	ok = f != NULL;
+	LL_FOR(file_node, m->file_list) {
+		struct file_data *fd = LL_DATA_AS(file_node, struct file_data*);
+
+		if (ok && fprintf(f, "%" PRIuMAX " %" PRId64 " %s\n", fd->size,
+				fd->mtime, m->target_is_directory ? fd->path : "") < 0)
+			ok = 0;
+	}
+	if (f && fclose(f))
+		ok = 0;
+
+	if (!ok)
+		fprintf(stderr, "warning: cannot write '%s': %s\n",
+			name, strerror(errno));
+
+	free(name);
+}
@@ -0,0 +1,57 @@
+#ifndef MKTORRENT_UPDATE_H
+#define MKTORRENT_UPDATE_H
+
+#include <stddef.h>      /* size_t */
+#include <stdint.h>      /* uintmax_t etc. */
+
+#include "export.h"      /* EXPORT */
+#include "mktorrent.h"   /* struct metafile */
+#include "bencode.h"     /* struct bencode */
+#include "checkpoint.h"  /* struct checkpoint */
+
+/*
+ * a file of the old or the new torrent at its offset in the stream of
+ * v1 pieces, pad files and the gaps they fill have no path
+ */
+struct update_file {
+	const char *path;             /* "" in a single file torrent */
+	uintmax_t size;
+	uintmax_t start;              /* offset in the stream */
+	int64_t mtime;                /* from the sidecar, old files only */
+	int has_mtime;
+	const unsigned char *root;    /* pieces root, old files only */
+	const unsigned char *layer;   /* v2 piece hashes, old files only */
+	struct update_file *old;      /* the same unchanged file in the old
+	                                 torrent, new files only */
+	struct ll_node *node;         /* in the file list, new files only */
+};
+
+struct update {
+	struct metafile *m;
+	const char *path;             /* of the old metainfo file */
+	char *buf;                    /* its content */
+	struct bencode *root;
+	unsigned int piece_length;    /* of the old torrent */
+	int has_times;                /* the sidecar with the mtimes was read */
+	const unsigned char *pieces;  /* its v1 piece hashes, or NULL */
+	struct update_file *old;      /* in the order of the stream */
+	size_t old_count;
+	uintmax_t old_size;
+	struct update_file **by_path; /* the old files sorted by path */
+	size_t path_count;
+	struct update_file *new;
+	size_t new_count;
+	uintmax_t new_size;
+};
+
+EXPORT unsigned int update_piece_length(const char *path);
+EXPORT void update_read(struct update *u, struct metafile *m,
+		const char *path);
+EXPORT void update_open(struct update *u, struct metafile *m);
+EXPORT uintmax_t update_fill(struct update *u, struct checkpoint *cp);
+EXPORT struct update_file *update_file_at(struct update_file *files,
+		size_t count, uintmax_t offset);
+EXPORT void update_close(struct update *u);
+EXPORT void update_write_times(struct metafile *m);
+
+#endif /* MKTORRENT_UPDATE_H */
@@ -0,0 +1,400 @@
+/*
+This file is part of mktorrent
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+
+
+#include <stdlib.h>       /* calloc(), random(), exit() */
+#include <stdio.h>        /* printf() etc. */
+#include <string.h>       /* memset(), memcmp(), strdup() */
+#include <inttypes.h>     /* PRIuMAX */
+#include <stdatomic.h>    /* atomic_flag */
+
+#ifdef USE_OPENSSL
+#include <openssl/sha.h>  /* SHA_DIGEST_LENGTH etc. */
+#else
+#include "sha1.h"
+#include "sha256.h"
+#endif
+
+#include "export.h"
+#include "mktorrent.h"
+#include "bencode.h"
+#include "checkpoint.h"
+#include "output.h"
+#include "update.h"
+#include "verify.h"
+#include "msg.h"
+#include "ll.h"
+
+#define is_sampled(v, unit) ((v)->sampled[(unit) / 8] & 1 << (unit) % 8)
+
+
+/*
+ * read the metainfo file we verify against, returns its version and
+ * whether its files start new pieces. the files must be laid out as
+ * we lay them out, or the pieces we hash would differ
+ */
+static int verify_read(struct update *u, struct metafile *m, int *pad)
+{
+	struct bencode *info, *version;
+	uintmax_t pos = 0;
+	size_t last = 0;
+	int r = 0;
+
+	update_read(u, m, m->verify_path);
+	info = bencode_get(u->root, "info", BENCODE_DICT);
+	version = bencode_get(info, "meta version", BENCODE_INTEGER);
+
+	FATAL_IF(bencode_get(info, "pieces", BENCODE_STRING) && u->pieces == NULL,
+		"'%s' is not a valid metainfo file\n", m->verify_path);
+
+	if (u->pieces)
+		r |= META_V1;
+	if (version && version->i == 2
+			&& bencode_get(info, "file tree", BENCODE_DICT))
+		r |= META_V2;
+	FATAL_IF(r == 0, "'%s' has no piece hashes to check against\n",
+		m->verify_path);
+
+	*pad = (r & META_V2) != 0;
+	for (size_t i = 0; i < u->old_count; i++)
+		if (u->old[i].path == NULL)
+			*pad = 1;
+
+	for (size_t i = 0; i < u->old_count; i++) {
+		struct update_file *f = &u->old[i];
+		uintmax_t start = *pad ? (pos + u->piece_length - 1)
+			/ u->piece_length * u->piece_length : pos;
+
+		/* empty files have no place in the stream */
+		if (f->path == NULL || f->size == 0)
+			continue;
+
+		FATAL_IF((r & META_V2) && f->layer == NULL,
+			"'%s' is not a valid metainfo file\n", m->verify_path);
+		FATAL_IF(f->start != start, "the pad files of '%s' aren't where "
+			"mktorrent puts them, it cannot be checked\n",
+			m->verify_path);
+		pos = start + f->size;
+		last = i;
+	}
+
+	/* and the last file is only padded when empty files follow it */
+	for (size_t i = last + 1; *pad && i < u->old_count; i++)
+		if (u->old[i].path)
+			pos = (pos + u->piece_length - 1)
+				/ u->piece_length * u->piece_length;
+	FATAL_IF(pos != u->old_size, "the pad files of '%s' aren't where "
+		"mktorrent puts them, it cannot be checked\n", m->verify_path);
+
+	return r;
+}
+
+/*
+ * read the metainfo file we verify against, and list its files in the
+ * order they are hashed, with the sizes they should have. the piece
+ * length, the version and the pad files are taken from it
+ */
+EXPORT struct ll *verify_files(struct metafile *m)
+{
+	struct ll *list = ll_new();
+	struct update u;
+	unsigned int n;
+	int single;
+
+	FATAL_IF0(list == NULL, "out of memory\n");
+
+	m->meta_version = verify_read(&u, m, &m->pad_files);
+
+	for (n = 15; n < 28 && (1U << n) < u.piece_length; n++)
+		;
+	FATAL_IF((1U << n) != u.piece_length, "the piece length of '%s' "
+		"isn't one from 2^15 to 2^28, it cannot be checked\n",
+		m->verify_path);
+	m->piece_lengths[0] = n;
+	m->piece_length_count = 1;
+
+	FATAL_IF(u.old_count == 0, "'%s' has no files to check\n",
+		m->verify_path);
+
+	single = u.old_count == 1 && *u.old[0].path == '\0';
+	FATAL_IF(single && m->target_is_directory,
+		"'%s' has a single file, give it instead of a directory\n",
+		m->verify_path);
+	FATAL_IF(!single && !m->target_is_directory,
+		"'%s' has a directory of files, give the directory\n",
+		m->verify_path);
+
+	for (size_t i = 0; i < u.old_count; i++) {
+		struct file_data fd = {
+			NULL,
+			u.old[i].size,
+			{ 0 },
+			0,
+			0,
+			0,
+			0,
+			0,
+			NULL,
+			NULL
+		};
+
+		if (u.old[i].path == NULL)
+			continue;
+
+		fd.path = strdup(u.old[i].path);
+		FATAL_IF0(fd.path == NULL
+				|| ll_append(list, &fd, sizeof(fd)) == NULL,
+			"out of memory\n");
+	}
+
+	update_close(&u);
+
+	return list;
+}
+
+/*
+ * choose the units to check. the hashes of a duplicate are copied
+ * from the first copy, which is only sure to be hashed when we check
+ * every unit, so a sample leaves the duplicates out
+ */
+static void choose_units(struct verify *v, struct checkpoint *cp)
+{
+	struct metafile *m = v->m;
+	uintmax_t eligible = 0, chosen = 0, spare = 0;
+
+	memset(v->sampled, 0xff, cp->units / 8 + 1);
+	if (m->sample == 0 || m->sample >= 100)
+		return;
+
+	for (uintmax_t unit = 0; unit < cp->units; unit++)
+		if (checkpoint_copied(cp, unit))
+			v->sampled[unit / 8] &= ~(1 << unit % 8);
+
+	/* every unit is checked by chance, but at least one is */
+	for (uintmax_t unit = 0; unit < cp->units; unit++) {
+		if (!is_sampled(v, unit))
+			continue;
+
+		eligible++;
+		if ((uintmax_t) random() % eligible == 0)
+			spare = unit;
+
+		if ((unsigned long) random() % 100 < m->sample)
+			chosen++;
+		else
+			v->sampled[unit / 8] &= ~(1 << unit % 8);
+	}
+
+	if (chosen == 0 && eligible)
+		v->sampled[spare / 8] |= 1 << spare % 8;
+}
+
+/*
+ * read the metainfo file we verify against, and take the units we
+ * don't check as done so they aren't read
+ */
+EXPORT void verify_open(struct verify *v, struct metafile *m,
+		struct checkpoint *cp)
+{
+	int pad;
+
+	memset(v, 0, sizeof(*v));
+	v->m = m;
+
+	if (m->verify_path == NULL)
+		return;
+
+	verify_read(&v->u, m, &pad);
+
+	v->sampled = malloc(cp->units / 8 + 1);
+	v->bad = calloc(v->u.old_count, sizeof(*v->bad));
+	FATAL_IF0(v->sampled == NULL || v->bad == NULL, "out of memory\n");
+
+	choose_units(v, cp);
+	for (uintmax_t unit = 0; unit < cp->units; unit++)
+		if (!is_sampled(v, unit))
+			checkpoint_unit(cp, unit);
+
+	if (m->stop_at_mismatch)
+		cp->verify = v;
+}
+
+/*
+ * whether the hashes of a unit differ from those of the metainfo file
+ */
+static int check_unit(struct verify *v, struct checkpoint *cp, uintmax_t unit)
+{
+	struct update *u = &v->u;
+	uintmax_t offset = unit * u->piece_length;
+
+	for (unsigned int set = 0; set <= CHECKPOINT_V2; set++) {
+		const unsigned char *want;
+
+		if (checkpoint_pieces(cp, unit, set) == 0)
+			continue;
+
+		/* every file starts a new v2 piece */
+		if (set == CHECKPOINT_V2) {
+			struct update_file *f = update_file_at(u->old,
+				u->old_count, offset);
+
+			want = f->layer + (offset - f->start) / u->piece_length
+				* SHA256_DIGEST_LENGTH;
+		} else
+			want = u->pieces + unit * SHA_DIGEST_LENGTH;
+
+		if (memcmp(checkpoint_hash(cp, unit, set), want, cp->digest[set]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * count a piece that doesn't match against the files it is made of
+ */
+static void mark_bad(struct verify *v, uintmax_t unit)
+{
+	struct update *u = &v->u;
+	uintmax_t start = unit * u->piece_length;
+	uintmax_t end = start + u->piece_length;
+	struct update_file *f = update_file_at(u->old, u->old_count, start);
+
+	if (v->m->verbose)
+		printf("piece %" PRIuMAX " doesn't match\n", unit);
+
+	for (; f < u->old + u->old_count && f->start < end; f++)
+		if (f->path && f->start + f->size > start)
+			v->bad[f - u->old]++;
+}
+
+/*
+ * print the files with pieces that don't match, and how sure we are
+ * of the rest. when k pieces of a sample match, at most 3/k of all are
+ * bad with 95% confidence, by the rule of three
+ */
+static void print_report(struct verify *v, struct checkpoint *cp,
+		uintmax_t checked, uintmax_t bad, int stopped)
+{
+	struct metafile *m = v->m;
+	struct update *u = &v->u;
+	const char *sep = "";
+
+	if (m->machine_readable) {
+		printf("{\"verify\": ");
+		print_json_string(stdout, m->verify_path);
+		printf(", \"pieces\": %" PRIuMAX ", \"checked\": %" PRIuMAX
+			", \"bad\": %" PRIuMAX ", \"stopped\": %s, \"files\": [",
+			cp->units, checked, bad, stopped ? "true" : "false");
+	}
+
+	for (size_t i = 0; i < u->old_count; i++) {
+		const char *path = u->old[i].path;
+
+		if (v->bad[i] == 0)
+			continue;
+
+		/* a single file has no path of its own */
+		if (*path == '\0')
+			path = LL_DATA_AS(LL_HEAD(m->file_list),
+				struct file_data*)->path;
+
+		if (m->machine_readable) {
+			printf("%s", sep);
+			print_json_string(stdout, path);
+			sep = ", ";
+		} else
+			printf("pieces that don't match in '%s': %" PRIuMAX "\n",
+				path, v->bad[i]);
+	}
+
+	if (m->machine_readable)
+		printf("]}\n");
+	else if (stopped)
+		printf("stopped at the first piece that doesn't match, after "
+			"checking %" PRIuMAX " of %" PRIuMAX " pieces\n",
+			checked, cp->units);
+	else if (bad)
+		printf("%" PRIuMAX " of the %" PRIuMAX " pieces checked "
+			"don't match\n", bad, checked);
+	else if (checked == cp->units)
+		printf("all %" PRIuMAX " pieces match\n", checked);
+	else
+		printf("the %" PRIuMAX " of %" PRIuMAX " pieces checked match, "
+			"at most %.2g%% of all are bad with 95%% confidence\n",
+			checked, cp->units,
+			checked >= 3 ? 300.0 / checked : 100.0);
+
+	fflush(stdout);
+}
+
+/*
+ * check a unit as soon as it is hashed, and stop at the first one
+ * that doesn't match. the hashing threads may get here at once
+ */
+EXPORT void verify_unit(struct verify *v, struct checkpoint *cp,
+		uintmax_t unit)
+{
+	static atomic_flag stopping = ATOMIC_FLAG_INIT;
+	uintmax_t checked = 0;
+
+	if (!check_unit(v, cp, unit) || atomic_flag_test_and_set(&stopping))
+		return;
+
+	for (uintmax_t i = 0; i < cp->units; i++)
+		if (is_sampled(v, i) && checkpoint_done(cp, i))
+			checked++;
+
+	mark_bad(v, unit);
+	print_report(v, cp, checked, 1, 1);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * check every unit chosen, now that the duplicates are copied too,
+ * and exit with failure if any doesn't match
+ */
+EXPORT void verify_close(struct verify *v, struct checkpoint *cp)
+{
+	uintmax_t checked = 0, bad = 0;
+
+	if (v->m->verify_path == NULL)
+		return;
+
+	cp->verify = NULL;
+
+	for (uintmax_t unit = 0; unit < cp->units; unit++) {
+		if (!is_sampled(v, unit))
+			continue;
+
+		checked++;
+		if (check_unit(v, cp, unit)) {
+			mark_bad(v, unit);
+			bad++;
+		}
+	}
+
+	print_report(v, cp, checked, bad, 0);
+
+	free(v->sampled);
+	free(v->bad);
+	update_close(&v->u);
+
+	if (bad)
+		exit(EXIT_FAILURE);
+}
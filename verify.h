@@ -0,0 +1,27 @@
+#ifndef MKTORRENT_VERIFY_H
+#define MKTORRENT_VERIFY_H
+
+#include <stdint.h>      /* uintmax_t */
+
+#include "export.h"      /* EXPORT */
+#include "mktorrent.h"   /* struct metafile */
+#include "ll.h"          /* struct ll */
+#include "checkpoint.h"  /* struct checkpoint */
+#include "update.h"      /* struct update */
+
+struct verify {
+	struct metafile *m;
+	struct update u;              /* the metainfo file checked against */
+	unsigned char *sampled;       /* a bit for every unit checked */
+	uintmax_t *bad;               /* pieces that don't match in every
+	                                 file of u */
+};
+
+EXPORT struct ll *verify_files(struct metafile *m);
+EXPORT void verify_open(struct verify *v, struct metafile *m,
+		struct checkpoint *cp);
+EXPORT void verify_unit(struct verify *v, struct checkpoint *cp,
+		uintmax_t unit);
+EXPORT void verify_close(struct verify *v, struct checkpoint *cp);
+
+#endif /* MKTORRENT_VERIFY_H */